@@ -1,15 +1,30 @@
+newoption {
+  trigger     = "simd",
+  value       = "isa",
+  description = "Instruction set for the lane-parallel rasterizer",
+  allowed     = {
+    { "none",  "Scalar only" },
+    { "sse4",  "SSE4.1, 4 lanes" },
+    { "avx2",  "AVX2, 8 lanes" },
+  },
+  default     = "none"
+}
+
+newoption {
+  trigger     = "no-stats",
+  description = "Build the rasterizer's counters and stage timers out"
+}
+
 workspace "raster"
   configurations { "debug", "release" }
 
-project "raster"
-  kind "ConsoleApp"
+  -- shared by every project
   language "C++"
   targetdir "%{cfg.buildcfg}/bin"
 
-  files { "src/**.hpp", "src/**.cpp" }
-
   -- includedirs { "rk-core/include", "rk-math/include" }
-  -- links { "pthread", "pulse" }
+  links { "pthread" }
+  -- links { "pulse" }
 
   warnings "Extra"
 
@@ -22,6 +37,38 @@ project "raster"
     defines { "NDEBUG" }
     optimize "On"
 
+  filter "options:simd=sse4"
+    vectorextensions "SSE4.1"
+
+  filter "options:simd=avx2"
+    vectorextensions "AVX2"
+
+  filter "options:no-stats"
+    defines { "RASTER_STATS=0" }
+
   filter "toolset:gcc"
-    buildoptions { "-std=c++14" } --, "-pthread" }
+    buildoptions { "-std=c++14", "-pthread" }
+
+  filter {}
 
+-- the renderer
+project "raster"
+  kind "ConsoleApp"
+  files { "src/**.hpp", "src/part3.cpp" }
+
+-- stage timings over generated scenes, see src/bench.cpp
+project "bench"
+  kind "ConsoleApp"
+  files { "src/**.hpp", "src/bench.cpp" }
+
+-- lane-parallel coverage against the scalar reference, see
+-- src/test_coverage.cpp; exits nonzero on a mismatch
+project "test_coverage"
+  kind "ConsoleApp"
+  files { "src/**.hpp", "src/test_coverage.cpp" }
+
+-- texture level of detail against known scales, see src/test_texture.cpp;
+-- exits nonzero on a mismatch
+project "test_texture"
+  kind "ConsoleApp"
+  files { "src/**.hpp", "src/test_texture.cpp" }
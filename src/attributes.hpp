@@ -0,0 +1,40 @@
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+// per-vertex values interpolated across a triangle
+template<size_t N>
+using Attributes = std::array<float, N>;
+
+// attributes as planes over the image: values at an origin pixel, and
+// steps per image column and row. set up once per triangle, so pixels
+// only need additions
+template<size_t N>
+struct Planes {
+  Attributes<N> at0, dx, dy;
+
+  Attributes<N> at (int x, int y) const {
+    Attributes<N> v;
+    for (size_t i = 0; i != N; i++)
+      v[i] = at0[i] + x*dx[i] + y*dy[i];
+    return v;
+  }
+};
+
+template<size_t N>
+void operator += (Attributes<N>& v, Attributes<N> const& d) {
+  for (size_t i = 0; i != N; i++)
+    v[i] += d[i];
+}
+
+// v + n*d
+template<size_t N>
+Attributes<N> advance (Attributes<N> const& v, Attributes<N> const& d, int n) {
+  Attributes<N> r;
+  for (size_t i = 0; i != N; i++)
+    r[i] = v[i] + n*d[i];
+  return r;
+}
+
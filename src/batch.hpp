@@ -0,0 +1,121 @@
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// a bounded queue from one stage of a pipeline to the next. push waits
+// while it's full and pop while it's empty, so a fast stage can only get
+// so far ahead of a slow one. closing it wakes both ends: pushes fail
+// from then on, and pops take what's left and then fail, so a producer
+// closes it when done and a consumer when it gives up
+template<typename T>
+class StageQueue {
+  std::mutex              lock;
+  std::condition_variable changed;
+  std::deque<T>           items;
+  size_t const            capacity;
+  bool                    closed = false;
+
+public:
+  explicit StageQueue (size_t capacity) : capacity (capacity) { }
+
+  bool push (T&& item) {
+    std::unique_lock<std::mutex> guard (lock);
+    changed.wait (guard, [this] { return closed || items.size () < capacity; });
+    if (closed)
+      return false;
+    items.push_back (std::move (item));
+    changed.notify_all ();
+    return true;
+  }
+
+  bool pop (T& item) {
+    std::unique_lock<std::mutex> guard (lock);
+    changed.wait (guard, [this] { return closed || !items.empty (); });
+    if (items.empty ())
+      return false;
+    item = std::move (items.front ());
+    items.pop_front ();
+    changed.notify_all ();
+    return true;
+  }
+
+  void close () {
+    std::lock_guard<std::mutex> guard (lock);
+    closed = true;
+    changed.notify_all ();
+  }
+};
+
+// one frame of a batch: the scene to draw, and where the image goes
+struct BatchFrame {
+  std::string scene_path, output_path;
+};
+
+// a batch list has a frame per line, a scene path and an output path
+// separated by spaces. blank lines and lines starting with # are skipped
+static inline std::vector<BatchFrame> read_batch_list (char const* path) {
+  std::ifstream in (path);
+  if (!in)
+    throw std::runtime_error (std::string ("Can't open ") + path);
+
+  std::vector<BatchFrame> frames;
+  std::string line;
+  for (int number = 1; std::getline (in, line); number++) {
+    std::istringstream words (line);
+    BatchFrame frame;
+    if (!(words >> frame.scene_path) || frame.scene_path[0] == '#')
+      continue;
+    std::string extra;
+    if (!(words >> frame.output_path) || (words >> extra))
+      throw std::runtime_error (std::string (path) + ":" + std::to_string (number) + ": Expected a scene path and an output path");
+    frames.push_back (std::move (frame));
+  }
+  return frames;
+}
+
+// a path pattern with the frame number put in, printf style: the pattern
+// has one %d, which may have flags and a width, as in frame%04d.script,
+// and %% for a plain %
+static inline std::string frame_path (char const* pattern, int frame) {
+  int conversions = 0;
+  for (char const* p = pattern; *p; p++) {
+    if (*p != '%')
+      continue;
+    if (p[1] == '%') {
+      p++;
+      continue;
+    }
+    p += 1 + strspn (p + 1, "0123456789-+ ");
+    if (*p != 'd')
+      throw std::runtime_error (std::string ("Frame pattern needs %d: ") + pattern);
+    conversions++;
+  }
+  if (conversions != 1)
+    throw std::runtime_error (std::string ("Frame pattern needs one %d: ") + pattern);
+
+  int const size = snprintf (nullptr, 0, pattern, frame);
+  std::string path (size_t (size) + 1, '\0');
+  snprintf (&path[0], path.size (), pattern, frame);
+  path.pop_back ();
+  return path;
+}
+
+// frames first to last, from patterns for their scene and output paths
+static inline std::vector<BatchFrame> frame_range (char const* scene_pattern, char const* output_pattern, int first, int last) {
+  std::vector<BatchFrame> frames;
+  for (int frame = first; frame <= last; frame++)
+    frames.push_back (BatchFrame { frame_path (scene_pattern, frame), frame_path (output_pattern, frame) });
+  return frames;
+}
@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buffer_pool.hpp"
+#include "encode.hpp"
+#include "image.hpp"
+#include "pipeline.hpp"
+#include "rasterize.hpp"
+#include "scene.hpp"
+#include "scene_gen.hpp"
+#include "script.hpp"
+#include "simd.hpp"
+#include "tiles.hpp"
+#include "worker_pool.hpp"
+
+// benchmark: generated scenes of each kind at several canvas sizes, each
+// frame timed stage by stage, repeated after a warmup, and reported as
+// percentiles in json or csv to compare builds with
+
+// program options
+class Options {
+public:
+  char const* output_path = "-";
+  char const* report = "json";
+  Format format = Format::qoi;
+  std::vector<SceneKind> scenes { std::begin (scene_kinds), std::end (scene_kinds) };
+  std::vector<int> sizes { 256, 1024, 2048 };
+  int runs = 10;
+  int warmup = 2;
+  uint64_t seed = 1;
+  int threads = std::max (1u, std::thread::hardware_concurrency ());
+};
+
+// comma separated list of names or numbers
+template<typename Convert>
+auto parse_list (char const* list, Convert convert) -> std::vector<decltype (convert (""))> {
+  std::vector<decltype (convert (""))> items;
+  std::stringstream stream (list);
+  std::string item;
+  while (std::getline (stream, item, ','))
+    items.push_back (convert (item.c_str ()));
+  return items;
+}
+
+// extract program options from command line arguments
+Options parse_options (char const** args, int arg_count) {
+  Options opts;
+
+  for (int i = 1; i != arg_count; i++) {
+    char const* arg = args[i];
+
+    if (!strcmp ("--output", arg) || !strcmp ("-o", arg)) {
+      // "-" alone is stdout
+      if (++i == arg_count || (args[i][0] == '-' && args[i][1]))
+        throw std::runtime_error ("Need output path");
+      opts.output_path = args[i];
+    }
+    else if (!strcmp ("--threads", arg) || !strcmp ("-j", arg)) {
+      if (++i == arg_count || (opts.threads = atoi (args[i])) <= 0)
+        throw std::runtime_error ("Need a positive thread count");
+    }
+    else if (!strcmp ("--report", arg)) {
+      if (++i == arg_count || (strcmp (args[i], "json") && strcmp (args[i], "csv")))
+        throw std::runtime_error ("Need json or csv");
+      opts.report = args[i];
+    }
+    else if (!strcmp ("--format", arg) || !strcmp ("-f", arg)) {
+      if (++i == arg_count || args[i][0] == '-')
+        throw std::runtime_error ("Need format name");
+      opts.format = format_named (args[i]);
+    }
+    else if (!strcmp ("--scenes", arg)) {
+      if (++i == arg_count || args[i][0] == '-')
+        throw std::runtime_error ("Need scene names");
+      opts.scenes = parse_list (args[i], scene_kind_named);
+    }
+    else if (!strcmp ("--sizes", arg)) {
+      if (++i == arg_count || args[i][0] == '-')
+        throw std::runtime_error ("Need canvas sizes");
+      opts.sizes = parse_list (args[i], [] (char const* s) {
+        int const size = atoi (s);
+        if (size < 64 || size > 16384)
+          throw std::runtime_error (std::string ("Bad canvas size ") + s);
+        return size;
+      });
+    }
+    else if (!strcmp ("--runs", arg)) {
+      if (++i == arg_count || (opts.runs = atoi (args[i])) <= 0)
+        throw std::runtime_error ("Need a positive run count");
+    }
+    else if (!strcmp ("--warmup", arg)) {
+      if (++i == arg_count || (opts.warmup = atoi (args[i])) < 0)
+        throw std::runtime_error ("Need a warmup run count");
+    }
+    else if (!strcmp ("--seed", arg)) {
+      if (++i == arg_count)
+        throw std::runtime_error ("Need a seed");
+      opts.seed = strtoull (args[i], nullptr, 10);
+    }
+    else {
+      throw std::runtime_error (std::string ("Unknown option ") + arg);
+    }
+  }
+
+  return opts;
+}
+
+// what's timed of a frame, as reported
+enum Timing {
+  timing_parse,  // script text to triangles
+  timing_setup,  // buffers and binning, ahead of drawing
+  timing_raster, // covering pixels and testing depth: drawing, shading deferred
+  timing_shade,  // shading the pixels covered, after
+  timing_write,  // encoding the image
+  timing_frame,  // all of a frame drawn and shaded as it goes, on the clock
+  timing_count
+};
+
+static char const* const timing_names[timing_count] = {
+  "parse", "setup", "raster", "shade", "write", "frame"
+};
+
+// times of the runs of one scene, in milliseconds, stage by stage
+struct CaseResult {
+  SceneKind kind;
+  int size;
+  size_t triangles;
+  std::vector<double> times[timing_count];
+};
+
+// linearly interpolated, of sorted times
+static inline double percentile (std::vector<double> const& sorted, double p) {
+  double const at = p * (sorted.size () - 1);
+  size_t const i = size_t (at);
+  if (i + 1 >= sorted.size ())
+    return sorted.back ();
+  return sorted[i] + (sorted[i+1] - sorted[i]) * (at - i);
+}
+
+// run one scene. raster and shade come from a frame with shading
+// deferred, which is what splits them, and are summed over the workers;
+// the frame time is of the usual forward render
+CaseResult bench_case (WorkerPool& pool, BufferPool& buffers, Options const& opts, SceneKind kind, int size) {
+  using Clock = std::chrono::steady_clock;
+  using Milliseconds = std::chrono::duration<double, std::milli>;
+  auto none = [] (Image<Pixelu8> const&, int, int, int) { };
+
+  std::string const text = generate_scene (kind, size, size, opts.seed);
+  CaseResult result { kind, size, 0, { } };
+  std::vector<uint8_t> encoded;
+
+  for (int run = -opts.warmup; run != opts.runs; run++) {
+    auto const start = Clock::now ();
+    Script script;
+    ScriptBuilder builder { script };
+    parse_script (text.data (), text.size (), builder);
+    SceneView const scene = script.view ();
+    auto const parsed = Clock::now ();
+
+    RenderSetup setup;
+    setup.deferred = true;
+    FrameTimes times;
+    rasterize<Linear> (pool, scene, setup, none, &buffers, &times);
+
+    setup.deferred = false;
+    auto const forward = Clock::now ();
+    Image<Pixelu8> const image = rasterize<Linear> (pool, scene, setup, none, &buffers);
+    auto const drawn = Clock::now ();
+
+    encoded.clear ();
+    encode_header (opts.format, encoded, image.width (), image.height ());
+    encode_strip (opts.format, encoded, image, 0, image.height ());
+    encode_footer (opts.format, encoded);
+    auto const written = Clock::now ();
+
+    result.triangles = scene.count;
+    if (run < 0)
+      continue;
+    double const stages[timing_count] = {
+      Milliseconds (parsed - start).count (),
+      times.bin,
+      times.draw,
+      times.shade,
+      Milliseconds (written - drawn).count (),
+      Milliseconds (drawn - forward).count ()
+    };
+    for (int s = 0; s != timing_count; s++)
+      result.times[s].push_back (stages[s]);
+  }
+
+  for (std::vector<double>& t : result.times)
+    std::sort (t.begin (), t.end ());
+  return result;
+}
+
+static double const reported[] = { 0, 0.5, 0.9, 0.99, 1 };
+static char const* const reported_names[] = { "min", "p50", "p90", "p99", "max" };
+
+void write_json (std::ostream& out, Options const& opts, std::vector<CaseResult> const& results) {
+  out << "{\n"
+      << "  \"build\": { \"compiler\": \"" << __VERSION__ << "\", \"lanes\": " << I32Lanes::width
+      << ", \"subpixel_bits\": " << subpixel_bits << " },\n"
+      << "  \"threads\": " << opts.threads << ", \"runs\": " << opts.runs << ", \"warmup\": " << opts.warmup
+      << ", \"seed\": " << opts.seed << ",\n"
+      << "  \"results\": [";
+  for (size_t i = 0; i != results.size (); i++) {
+    CaseResult const& r = results[i];
+    out << (i? "," : "") << "\n    { \"scene\": \"" << scene_kind_name (r.kind) << "\", \"size\": " << r.size
+        << ", \"triangles\": " << r.triangles << ",";
+    for (int s = 0; s != timing_count; s++) {
+      out << "\n      \"" << timing_names[s] << "\": {";
+      for (int p = 0; p != 5; p++)
+        out << (p? ", " : " ") << "\"" << reported_names[p] << "\": " << percentile (r.times[s], reported[p]);
+      out << " }" << (s + 1 != timing_count? "," : "");
+    }
+    out << "\n    }";
+  }
+  out << "\n  ]\n}\n";
+}
+
+// a row per scene and stage
+void write_csv (std::ostream& out, std::vector<CaseResult> const& results) {
+  out << "scene,size,triangles,stage";
+  for (char const* name : reported_names)
+    out << "," << name;
+  out << "\n";
+  for (CaseResult const& r : results) {
+    for (int s = 0; s != timing_count; s++) {
+      out << scene_kind_name (r.kind) << "," << r.size << "," << r.triangles << "," << timing_names[s];
+      for (double p : reported)
+        out << "," << percentile (r.times[s], p);
+      out << "\n";
+    }
+  }
+}
+
+int main (int arg_count, char const** args) try {
+  Options const opts = parse_options (args, arg_count);
+  WorkerPool pool (opts.threads);
+  BufferPool buffers;
+
+  // progress to stderr, since the report may be going to stdout
+  std::vector<CaseResult> results;
+  for (int size : opts.sizes) {
+    for (SceneKind kind : opts.scenes) {
+      std::cerr << scene_kind_name (kind) << " " << size << "x" << size << "\n";
+      results.push_back (bench_case (pool, buffers, opts, kind, size));
+    }
+  }
+
+  std::ofstream file;
+  if (strcmp (opts.output_path, "-")) {
+    file.open (opts.output_path);
+    if (!file)
+      throw std::runtime_error (std::string ("Can't create ") + opts.output_path);
+  }
+  std::ostream& out = file.is_open ()? file : std::cout;
+  out.precision (4);
+  out << std::fixed;
+  if (!strcmp (opts.report, "json"))
+    write_json (out, opts, results);
+  else
+    write_csv (out, results);
+}
+catch (std::exception const& e) {
+  std::cerr << e.what () << "\n";
+  return 1;
+}
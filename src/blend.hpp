@@ -0,0 +1,185 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if defined (__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "pixel.hpp"
+
+// how a drawn pixel combines with what's under it. colours are taken as
+// premultiplied by their alpha:
+//   replace   d = s
+//   over      d = s + d*(1 - sa)
+//   add       d = d + s
+//   multiply  d = d * (s + 1 - sa)
+// so a transparent pixel leaves d alone in every mode
+enum class Blend {
+  replace,
+  over,
+  add,
+  multiply
+};
+
+static inline Blend blend_named (char const* name) {
+  if (!strcmp (name, "replace"))
+    return Blend::replace;
+  if (!strcmp (name, "over"))
+    return Blend::over;
+  if (!strcmp (name, "add"))
+    return Blend::add;
+  if (!strcmp (name, "multiply"))
+    return Blend::multiply;
+  throw std::runtime_error (std::string ("Unknown blend mode ") + name);
+}
+
+// channels are blended as 16-bit words, with x*y/255 rounded exactly as
+//   t = x*y + 128, (t + t/256) / 256
+// the same in every version, so results don't depend on the target.
+// results saturate at 255
+
+static inline int mul255 (int x, int y) {
+  int const t = x*y + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+template<Blend B>
+Pixelu8 blend_pixel (Pixelu8 d, Pixelu8 s, bool premultiplied) {
+  int const sa = s.a;
+  Pixelu8 out;
+  for (int i = 0; i != 4; i++) {
+    int const dc = d.channels[i];
+    int sc = s.channels[i];
+    if (!premultiplied && i != 3)
+      sc = mul255 (sc, sa);
+
+    int c;
+    switch (B) {
+    case Blend::replace:  c = sc; break;
+    case Blend::over:     c = sc + mul255 (dc, 255 - sa); break;
+    case Blend::add:      c = dc + sc; break;
+    case Blend::multiply: c = mul255 (dc, std::min (255, sc + 255 - sa)); break;
+    }
+    out.channels[i] = uint8_t (std::min (255, c));
+  }
+  return out;
+}
+
+#if defined (__SSE2__)
+// the word operations, for a register of each width
+struct Words128 {
+  using V = __m128i;
+  static V zero () { return _mm_setzero_si128 (); }
+  static V splat (short x) { return _mm_set1_epi16 (x); }
+  static V add (V a, V b) { return _mm_add_epi16 (a, b); }
+  static V sub (V a, V b) { return _mm_sub_epi16 (a, b); }
+  static V min (V a, V b) { return _mm_min_epi16 (a, b); }
+  static V mul (V a, V b) { return _mm_mullo_epi16 (a, b); }
+  static V shr8 (V a) { return _mm_srli_epi16 (a, 8); }
+  static V select (V mask, V a, V b) { return _mm_or_si128 (_mm_and_si128 (mask, a), _mm_andnot_si128 (mask, b)); }
+  static V alpha (V a) { return _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (a, 0xff), 0xff); }
+  static V colour () { return _mm_setr_epi16 (-1, -1, -1, 0, -1, -1, -1, 0); }
+  static V low (V bytes) { return _mm_unpacklo_epi8 (bytes, zero ()); }
+  static V high (V bytes) { return _mm_unpackhi_epi8 (bytes, zero ()); }
+  static V pack (V lo, V hi) { return _mm_packus_epi16 (lo, hi); }
+  static V load (void const* p) { return _mm_loadu_si128 (static_cast<V const*> (p)); }
+  static void store (void* p, V a) { _mm_storeu_si128 (static_cast<V*> (p), a); }
+};
+#endif
+
+#if defined (__AVX2__)
+// unpacking and packing both work within 128-bit halves, so they undo
+// each other and pixels stay in order
+struct Words256 {
+  using V = __m256i;
+  static V zero () { return _mm256_setzero_si256 (); }
+  static V splat (short x) { return _mm256_set1_epi16 (x); }
+  static V add (V a, V b) { return _mm256_add_epi16 (a, b); }
+  static V sub (V a, V b) { return _mm256_sub_epi16 (a, b); }
+  static V min (V a, V b) { return _mm256_min_epi16 (a, b); }
+  static V mul (V a, V b) { return _mm256_mullo_epi16 (a, b); }
+  static V shr8 (V a) { return _mm256_srli_epi16 (a, 8); }
+  static V select (V mask, V a, V b) { return _mm256_blendv_epi8 (b, a, mask); }
+  static V alpha (V a) { return _mm256_shufflehi_epi16 (_mm256_shufflelo_epi16 (a, 0xff), 0xff); }
+  static V colour () { return _mm256_setr_epi16 (-1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0); }
+  static V low (V bytes) { return _mm256_unpacklo_epi8 (bytes, zero ()); }
+  static V high (V bytes) { return _mm256_unpackhi_epi8 (bytes, zero ()); }
+  static V pack (V lo, V hi) { return _mm256_packus_epi16 (lo, hi); }
+  static V load (void const* p) { return _mm256_loadu_si256 (static_cast<V const*> (p)); }
+  static void store (void* p, V a) { _mm256_storeu_si256 (static_cast<V*> (p), a); }
+};
+#endif
+
+// blend words of whole pixels, as blend_pixel does
+template<Blend B, typename W>
+typename W::V blend_words (typename W::V d, typename W::V s, bool premultiplied) {
+  using V = typename W::V;
+  auto mul255 = [] (V x, V y) {
+    V const t = W::add (W::mul (x, y), W::splat (128));
+    return W::shr8 (W::add (t, W::shr8 (t)));
+  };
+
+  V const sa = W::alpha (s), full = W::splat (255);
+  if (!premultiplied)
+    s = W::select (W::colour (), mul255 (s, sa), s);
+
+  switch (B) {
+  case Blend::replace:  return s;
+  case Blend::over:     return W::add (s, mul255 (d, W::sub (full, sa)));
+  case Blend::add:      return W::add (d, s);
+  case Blend::multiply: return mul255 (d, W::min (full, W::sub (W::add (s, full), sa)));
+  }
+  return s;
+}
+
+// blend a run of pixels into dst. the vector versions blend 8 or 4 pixels
+// at a time, 2 to a 128-bit half
+template<Blend B>
+void blend_span (Pixelu8* dst, Pixelu8 const* src, size_t count, bool premultiplied) {
+  size_t i = 0;
+
+  // whole registers of pixels, in bytes and then as words
+  auto blend = [premultiplied] (auto words, void* d, void const* s) {
+    using W = decltype (words);
+    auto const db = W::load (d), sb = W::load (s);
+    W::store (d, W::pack (
+      blend_words<B, W> (W::low  (db), W::low  (sb), premultiplied),
+      blend_words<B, W> (W::high (db), W::high (sb), premultiplied)));
+  };
+
+#if defined (__AVX2__)
+  for (; i + 8 <= count; i += 8)
+    blend (Words256 (), dst + i, src + i);
+#endif
+#if defined (__SSE2__)
+  for (; i + 4 <= count; i += 4)
+    blend (Words128 (), dst + i, src + i);
+#endif
+
+  for (; i < count; i++)
+    dst[i] = blend_pixel<B> (dst[i], src[i], premultiplied);
+}
+
+// blends pixels into the canvas, as draw_triangle's write. the mode is
+// picked once a group, which costs much less than the blending
+struct Blender {
+  Blend mode;
+  bool premultiplied; // whether colours come premultiplied, else they're done here
+
+  void operator () (Pixelu8* dst, Pixelu8 const* src, size_t count) const {
+    switch (mode) {
+    case Blend::replace:  blend_span<Blend::replace>  (dst, src, count, premultiplied); break;
+    case Blend::over:     blend_span<Blend::over>     (dst, src, count, premultiplied); break;
+    case Blend::add:      blend_span<Blend::add>      (dst, src, count, premultiplied); break;
+    case Blend::multiply: blend_span<Blend::multiply> (dst, src, count, premultiplied); break;
+    }
+  }
+};
+
@@ -0,0 +1,68 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// alignment of pixel buffers and of every image row
+static constexpr size_t buffer_align = 64;
+
+static inline void* aligned_buffer (size_t bytes) {
+  void* p = nullptr;
+  if (posix_memalign (&p, buffer_align, bytes ? bytes : buffer_align))
+    throw std::bad_alloc ();
+  return p;
+}
+
+// keeps released pixel buffers for reuse, so rendering the same size of
+// canvas over and over doesn't go back to the allocator each time.
+// safe to share between threads
+class BufferPool {
+  struct Buffer {
+    void*  data;
+    size_t bytes;
+  };
+
+  std::mutex lock;
+  std::vector<Buffer> free;
+
+public:
+  BufferPool () = default;
+  BufferPool (BufferPool const&) = delete;
+  BufferPool& operator = (BufferPool const&) = delete;
+
+  ~BufferPool () {
+    for (Buffer& buffer : free)
+      std::free (buffer.data);
+  }
+
+  // the smallest kept buffer that's big enough, or a new one
+  void* take (size_t bytes, size_t& capacity) {
+    {
+      std::lock_guard<std::mutex> guard (lock);
+      auto best = free.end ();
+      for (auto i = free.begin (); i != free.end (); i++) {
+        if (i->bytes >= bytes && (best == free.end () || i->bytes < best->bytes))
+          best = i;
+      }
+      if (best != free.end ()) {
+        Buffer const buffer = *best;
+        free.erase (best);
+        capacity = buffer.bytes;
+        return buffer.data;
+      }
+    }
+
+    capacity = bytes;
+    return aligned_buffer (bytes);
+  }
+
+  void give (void* data, size_t capacity) {
+    std::lock_guard<std::mutex> guard (lock);
+    free.push_back (Buffer { data, capacity });
+  }
+};
+
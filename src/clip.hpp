@@ -0,0 +1,90 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "fixed.hpp"
+
+// vertices within this many sub-pixels of the canvas centre, on both
+// axes, are inside the guard band. there edge function deltas stay under
+// 2^30 and their products under 2^60, so setup in 64 bits is exact.
+// triangles reaching past it are clipped to it before setup; the band is
+// far bigger than any canvas, so that's only ever off-screen
+static constexpr i32 guard_band = i32 (1) << 29;
+
+static inline bool in_guard_band (P2fx p) {
+  return p.x >= -guard_band && p.x <= guard_band && p.y >= -guard_band && p.y <= guard_band;
+}
+
+static inline bool in_guard_band (P2fx a, P2fx b, P2fx c) {
+  return in_guard_band (a) && in_guard_band (b) && in_guard_band (c);
+}
+
+// a corner of a clipped triangle, and its barycentric weights in the
+// original triangle, to interpolate attributes with
+struct ClipVertex {
+  P2fx  p;
+  float w[3];
+};
+
+// each side of the band cuts off at most one more corner
+static constexpr int clip_max_vertices = 7;
+
+// clip triangle abc to the guard band, keeping its winding, and return
+// the number of corners of what's left. edges are cut at the band
+// working from their inside end, so two triangles sharing an edge get
+// the same new corners and fans of them still meet exactly
+static inline int clip_triangle (P2fx a, P2fx b, P2fx c, ClipVertex (&out)[clip_max_vertices]) {
+  struct Corner {
+    double p[2], w[3];
+  };
+  Corner poly[clip_max_vertices] = {
+    { { double (a.x), double (a.y) }, { 1, 0, 0 } },
+    { { double (b.x), double (b.y) }, { 0, 1, 0 } },
+    { { double (c.x), double (c.y) }, { 0, 0, 1 } }
+  };
+  int n = 3;
+
+  // each side is where p[axis]*side reaches the band
+  for (int axis = 0; axis != 2; axis++) {
+    for (double side : { -1.0, 1.0 }) {
+      auto inside = [&] (Corner const& v) { return v.p[axis]*side <= guard_band; };
+      auto cut = [&] (Corner const& in, Corner const& out) {
+        double const t = (guard_band - in.p[axis]*side) / ((out.p[axis] - in.p[axis])*side);
+        Corner v;
+        for (int i = 0; i != 2; i++)
+          v.p[i] = in.p[i] + (out.p[i] - in.p[i])*t;
+        for (int i = 0; i != 3; i++)
+          v.w[i] = in.w[i] + (out.w[i] - in.w[i])*t;
+        v.p[axis] = guard_band*side;
+        return v;
+      };
+
+      Corner kept[clip_max_vertices];
+      int m = 0;
+      for (int i = 0; i != n; i++) {
+        Corner const& s = poly[i];
+        Corner const& e = poly[(i+1) % n];
+        if (inside (s))
+          kept[m++] = s;
+        if (inside (s) && !inside (e))
+          kept[m++] = cut (s, e);
+        else if (!inside (s) && inside (e))
+          kept[m++] = cut (e, s);
+      }
+      std::copy (kept, kept + m, poly);
+      n = m;
+    }
+  }
+
+  for (int i = 0; i != n; i++) {
+    auto round = [] (double x) {
+      return i32 (std::min<long long> (std::max<long long> (std::llround (x), -guard_band), guard_band));
+    };
+    out[i].p = P2fx { round (poly[i].p[0]), round (poly[i].p[1]) };
+    for (int j = 0; j != 3; j++)
+      out[i].w[j] = float (poly[i].w[j]);
+  }
+  return n;
+}
@@ -0,0 +1,76 @@
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "image.hpp"
+#include "mapped_file.hpp"
+#include "pixel.hpp"
+#include "qoi.hpp"
+
+// decode a binary ppm (P6) with 8-bit channels
+static inline Image<Pixelu8> ppm_decode (char const* data, size_t size) {
+  char const* ptr = data;
+  char const* const end = data + size;
+
+  // header fields are separated by whitespace and # comments. not
+  // strchr, which would count a null as whitespace too
+  auto space = [] (char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+  };
+  auto field = [&] () {
+    for (;;) {
+      while (ptr != end && space (*ptr))
+        ptr++;
+      if (ptr == end || *ptr != '#')
+        break;
+      while (ptr != end && *ptr != '\n')
+        ptr++;
+    }
+    int value = 0;
+    char const* const start = ptr;
+    for (; ptr != end && *ptr >= '0' && *ptr <= '9' && value < 1 << 16; ptr++)
+      value = value*10 + (*ptr - '0');
+    if (ptr == start)
+      throw std::runtime_error ("Bad ppm header");
+    return value;
+  };
+
+  if (size < 2 || memcmp (data, "P6", 2))
+    throw std::runtime_error ("Not a binary ppm image");
+  ptr += 2;
+  int const width = field (), height = field (), maxval = field ();
+  if (width <= 0 || height <= 0 || width >= 1 << 16 || height >= 1 << 16 || maxval != 255)
+    throw std::runtime_error ("Unsupported ppm image");
+
+  // one whitespace character, then the pixels
+  ptr++;
+  if (ptr > end || size_t (end - ptr) < size_t (width) * height * 3)
+    throw std::runtime_error ("Truncated ppm image");
+
+  Image<Pixelu8> image (width, height);
+  uint8_t const* in = reinterpret_cast<uint8_t const*> (ptr);
+  for (int y = 0; y != height; y++) {
+    Pixelu8* row = image.row (y);
+    for (int x = 0; x != width; x++, in += 3)
+      row[x] = Pixelu8 (in[0], in[1], in[2]);
+  }
+  return image;
+}
+
+// load a ppm or qoi image, going by its contents
+static inline Image<Pixelu8> load_image (char const* path) {
+  MappedFile file (path);
+  try {
+    if (file.size () >= 4 && !memcmp (file.data (), "qoif", 4))
+      return qoi_decode (reinterpret_cast<uint8_t const*> (file.data ()), file.size ());
+    return ppm_decode (file.data (), file.size ());
+  }
+  catch (std::runtime_error const& e) {
+    throw std::runtime_error (std::string (path) + ": " + e.what ());
+  }
+}
+
@@ -0,0 +1,101 @@
+
+#pragma once
+
+#include <algorithm>
+#include <limits>
+
+#include "buffer_pool.hpp"
+#include "image.hpp"
+#include "tiles.hpp"
+
+// depth of an empty pixel
+static constexpr float depth_far = std::numeric_limits<float>::infinity ();
+
+// depth buffer for a canvas, in the canvas's layout. smaller depths are
+// nearer. alongside the depths it keeps bounds for each 8x8 block, so
+// whole blocks of a triangle can be found hidden, or wholly in front,
+// without looking at pixels:
+//   nearest <= every depth in the block <= farthest
+// the bounds are allowed to be loose, but never wrong.
+// multisampled, each sample has its depth, as it has its colour, and a
+// pixel's depth is its farthest sample's, so the bounds hold for samples
+template<typename Layout>
+class DepthBuffer {
+public:
+  Image<float, Layout> depth;
+  Image<float> nearest, farthest; // one per block
+  Image<float, Layout> samples;   // multisampled, a pixel's side by side
+  int sample_count;
+
+  DepthBuffer (int w, int h, BufferPool* pool = nullptr, int sample_count = 1) :
+    depth    (w, h, Uninitialized (), pool),
+    nearest  ((w + block_size - 1) / block_size, (h + block_size - 1) / block_size, Uninitialized (), pool),
+    farthest (nearest.width (), nearest.height (), Uninitialized (), pool),
+    sample_count (sample_count)
+  {
+    if (sample_count > 1)
+      samples = Image<float, Layout> (w * sample_count, h, Uninitialized (), pool);
+  }
+
+  // reset a rect, aligned to blocks, to nothing drawn
+  void clear (Rect const& r) {
+    assert (r.x0 % block_size == 0 && r.y0 % block_size == 0);
+    depth.clear (r, depth_far);
+    if (sample_count > 1)
+      samples.clear (Rect { r.x0 * sample_count, r.y0, r.x1 * sample_count, r.y1 }, depth_far);
+    nearest.clear (blocks (r), depth_far);
+    farthest.clear (blocks (r), depth_far);
+  }
+
+  // depth of sample s of pixel x, y
+  float& sample (int x, int y, int s) {
+    return samples.at (x * sample_count + s, y);
+  }
+
+  // blocks touching a rect of pixels
+  Rect blocks (Rect const& r) const {
+    return Rect {
+      r.x0 / block_size, r.y0 / block_size,
+      (r.x1 + block_size - 1) / block_size, (r.y1 + block_size - 1) / block_size
+    };
+  }
+
+  // bounds over every block touching r
+  float nearest_in (Rect const& r) const {
+    Rect const b = blocks (r);
+    float z = depth_far;
+    for (int y = b.y0; y != b.y1; y++) {
+      for (int x = b.x0; x != b.x1; x++)
+        z = std::min (z, nearest.at (x, y));
+    }
+    return z;
+  }
+
+  float farthest_in (Rect const& r) const {
+    Rect const b = blocks (r);
+    float z = -depth_far;
+    for (int y = b.y0; y != b.y1; y++) {
+      for (int x = b.x0; x != b.x1; x++)
+        z = std::max (z, farthest.at (x, y));
+    }
+    return z;
+  }
+
+  // after depths no nearer than z were written into the block at x, y.
+  // depths only ever decrease, so farthest stays an upper bound; when
+  // asked, it's tightened by scanning the block
+  void drawn (int x, int y, float z, bool rescan) {
+    int const bx = x / block_size, by = y / block_size;
+    nearest.at (bx, by) = std::min (nearest.at (bx, by), z);
+    if (rescan) {
+      float m = -depth_far;
+      depth.spans (Rect { bx*block_size, by*block_size, (bx+1)*block_size, (by+1)*block_size },
+        [&m] (int, int, float const* d, int count) {
+          for (int i = 0; i != count; i++)
+            m = std::max (m, d[i]);
+        });
+      farthest.at (bx, by) = m;
+    }
+  }
+};
+
@@ -2,103 +2,771 @@
 #pragma once
 
 #include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <type_traits>
 
+#if defined (__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "attributes.hpp"
+#include "clip.hpp"
+#include "depth.hpp"
 #include "image.hpp"
 #include "vector.hpp"
 #include "line2.hpp"
 #include "pixel.hpp"
+#include "fixed.hpp"
+#include "simd.hpp"
+#include "stats.hpp"
+#include "tiles.hpp"
+
+// edge function: twice the signed area of abp, in squared sub-pixel units.
+// exact for points inside the guard band
+static inline i64 wf (P2fx a, P2fx b, P2fx p) {
+  return i64 (b.x-a.x)*(p.y-a.y) - i64 (b.y-a.y)*(p.x-a.x);
+}
 
-i32 wf (P2i32 a, P2i32 b, P2i32 p) {
-  return (b.x-a.x)*(p.y-a.y) - (b.y-a.y)*(p.x-a.x);
+// whether abc winds counter-clockwise, so faces the viewer, for vertices
+// anywhere. only those past the guard band need products wider than 64 bits
+static inline bool facing (P2fx a, P2fx b, P2fx c) {
+  if (in_guard_band (a, b, c))
+    return wf (a, b, c) > 0;
+  using i128 = __int128;
+  return i128 (i64 (b.x) - a.x) * (i64 (c.y) - a.y) > i128 (i64 (b.y) - a.y) * (i64 (c.x) - a.x);
 }
 
-bool top_left (P2i32 a, P2i32 b) {
+static inline bool top_left (P2fx a, P2fx b) {
   auto const d = b - a;
   return (d.y == 0 && d.x < 0) || d.y > 0;
 }
 
-// general triangle rasterizer
-template<typename T, typename Shader>
-void draw_triangle (
-  Image<T>& out,
-  P2i32 const a, P2i32 const b, P2i32 const c,
-  Shader const& shader)
+// reference coverage test for a run of pixels, one bit per pixel.
+// the lane-parallel path in draw_triangle must agree with this exactly,
+// as test_coverage.cpp checks
+static inline unsigned coverage_mask (
+  i32 wa, i32 wb, i32 wc,
+  i32 dwadx, i32 dwbdx, i32 dwcdx,
+  int count)
 {
-  // twice signed area
-  i32 const tsa = wf (a, b, c);
-  if (tsa <= 0)
-    return;
-
-  // normalizing factor
-  float const k = 1.f / tsa;
+  // stepped in 64 bits, as the step past the last pixel needn't fit
+  i64 a = wa, b = wb, c = wc;
+  unsigned mask = 0;
+  for (int i = 0; i != count; i++) {
+    if ((a | b | c) >= 0)
+      mask |= 1u << i;
+    a += dwadx; b += dwbdx; c += dwcdx;
+  }
+  return mask;
+}
 
-  // setup
+// pixel bounds of a triangle in image coordinates, clipped to the canvas.
+// returns false for triangles that face away and so draw nothing. with a
+// margin, in sub-pixels, pixels whose centres are that near the bbox count
+// too, for sample points off the centre. triangles wholly off the canvas
+// are rejected by their bbox, before their winding is worked out
+template<typename T, typename L>
+bool triangle_rect (Image<T, L> const& out, P2fx a, P2fx b, P2fx c, Rect& rect, i32 margin = 0) {
   i32 const
     cx = out.width  () / 2,
-    cy = out.height () / 2,
-    // bbox, clipped to canvas
-    xl = std::max (std::min ({ a.x, b.x, c.x }), -cx  ),
-    yl = std::max (std::min ({ a.y, b.y, c.y }), -cy+1),
-    xh = std::min (std::max ({ a.x, b.x, c.x }),  cx-1),
-    yh = std::min (std::max ({ a.y, b.y, c.y }),  cy  ),
-    // edge function deltas
-    dwadx = b.y-c.y, dwady = c.x-b.x,
-    dwbdx = c.y-a.y, dwbdy = a.x-c.x,
-    dwcdx = a.y-b.y, dwcdy = b.x-a.x,
-    // edge function biases
-    ea = top_left (b, c)? 0 : -1,
-    eb = top_left (c, a)? 0 : -1,
-    ec = top_left (a, b)? 0 : -1;
-
-  P2i32 p {xl, yl};
-
-  // edge values at left side
-  i32
-    wa0 = wf (b, c, p) + ea,
-    wb0 = wf (c, a, p) + eb,
-    wc0 = wf (a, b, p) + ec;
-
-  // sample each pixel in the bbox
-  for (; p.y <= yh; p.y++) {
-    i32 wa = wa0, wb = wb0, wc = wc0;
-
-    for (p.x = xl; p.x <= xh; p.x++) {
-      // shade pixel if we're inside the triangle
-      // or on the right kind of edge,
-      // passing normalized barycentrics
-      if ((wa | wb | wc) >= 0)
-        out.at (cx+p.x, cy-p.y) = shader (wa*k, wb*k, wc*k);
-
-      // step edge functions in x
-      wa += dwadx; wb += dwbdx; wc += dwcdx;
+    cy = out.height () / 2;
+
+  // bounds are widened in 64 bits and held to just past the canvas, so
+  // vertices can be anywhere
+  auto bound = [] (i64 v, i32 half) {
+    i64 const limit = i64 (half + 1) * subpixel_one;
+    return i32 (std::min (std::max (v, -limit), limit));
+  };
+
+  // pixel centres inside the fixed-point bbox
+  i32 const
+    xl = std::max (pixel_ceil  (bound (i64 (std::min ({ a.x, b.x, c.x })) - margin, cx)), -cx  ),
+    yl = std::max (pixel_ceil  (bound (i64 (std::min ({ a.y, b.y, c.y })) - margin, cy)), -cy+1),
+    xh = std::min (pixel_floor (bound (i64 (std::max ({ a.x, b.x, c.x })) + margin, cx)),  cx-1),
+    yh = std::min (pixel_floor (bound (i64 (std::max ({ a.y, b.y, c.y })) + margin, cy)),  cy  );
+
+  // canvas y points up, image y points down
+  rect = Rect { cx+xl, cy-yh, cx+xh+1, cy-yl+1 };
+  return !rect.empty () && facing (a, b, c);
+}
+
+// an edge function, biased by the fill rule, over a patch of the image.
+// W is i32 when the values over the patch are known to fit, i64 otherwise
+template<typename W>
+struct Edge {
+  W w;      // value at the patch origin
+  W dx, dy; // steps per image column and row
+
+  // summed in 64 bits: a value over the patch fits W, but the terms
+  // making it up can be twice as big
+  W at (int x, int y) const {
+    return W (w + i64 (x)*dx + i64 (y)*dy);
+  }
+
+  // least and greatest values over a w by h block at x, y
+  W min (int x, int y, int wide, int high) const {
+    return W (w + i64 (x)*dx + i64 (y)*dy + std::min (i64 (0), i64 (dx)*(wide-1)) + std::min (i64 (0), i64 (dy)*(high-1)));
+  }
+
+  W max (int x, int y, int wide, int high) const {
+    return W (w + i64 (x)*dx + i64 (y)*dy + std::max (i64 (0), i64 (dx)*(wide-1)) + std::max (i64 (0), i64 (dy)*(high-1)));
+  }
+};
+
+// edge a->b, with the patch origin at pixel o.
+// sample points are whole pixels, so the full-precision edge function is
+// always a multiple of subpixel_one plus a constant; dividing that out
+// (rounding down, which keeps the sign test exact) leaves per-pixel steps
+// that are just the edge's fixed-point deltas. canvas y points up and
+// image rows run down, hence the sign on dy. samples can sit at an
+// offset from pixel centres, in canvas sub-pixels; the steps are the same
+static inline Edge<i64> make_edge (P2fx a, P2fx b, P2i32 o, P2i32 offset = P2i32 { 0, 0 }) {
+  P2fx const p { o.x * subpixel_one + offset.x, o.y * subpixel_one + offset.y };
+  i64 const w = wf (a, b, p) + (top_left (a, b)? 0 : -1);
+  return Edge<i64> { w >> subpixel_bits, a.y-b.y, a.x-b.x };
+}
+
+// whether an edge's values stay within i32 over a w by h patch
+static inline bool fits_i32 (Edge<i64> const& e, int wide, int high) {
+  i64 const limit = std::numeric_limits<i32>::max ();
+  return std::max (-e.min (0, 0, wide, high), e.max (0, 0, wide, high)) <= limit;
+}
+
+static inline Edge<i32> narrow (Edge<i64> const& e) {
+  return Edge<i32> { i32 (e.w), i32 (e.dx), i32 (e.dy) };
+}
+
+enum class Cover { none, full, partial };
+
+// classify a block against all three edges by its extreme corners
+template<typename W>
+Cover classify (Edge<W> const (&e)[3], int x, int y, int wide, int high) {
+  bool full = true;
+  for (Edge<W> const& edge : e) {
+    if (edge.max (x, y, wide, high) < 0)
+      return Cover::none;
+    full = full && edge.min (x, y, wide, high) >= 0;
+  }
+  return full? Cover::full : Cover::partial;
+}
+
+// pixels are shaded in groups of up to this many along a row, so that
+// shaders can work on several pixels at once
+static constexpr int group_size = 8;
+static_assert (I32Lanes::width <= group_size, "Lane groups must fit shading groups");
+
+// shade the covered pixels of a row, a group of lanes at a time. each
+// group goes to group (x, y, v, mask, run): run pixels from x, those in
+// mask covered, with v the attributes at x to be stepped past the run
+template<size_t N, typename Group>
+void test_row (
+  Edge<i32> const (&e)[3], Planes<N> const& p,
+  int x0, int x1, int y,
+  Group const& group)
+{
+  // a group's step needn't fit 32 bits when the row is narrower than a
+  // group. it's taken in 64 and wraps in the lanes, which is harmless:
+  // lanes past the row are masked off, and those in it come out exact
+  auto step = [] (i32 dx) {
+    return splat (i32 (i64 (I32Lanes::width) * dx));
+  };
+  int const lanes = I32Lanes::width;
+  I32Lanes
+    va = ramp (e[0].at (x0, y), e[0].dx), sa = step (e[0].dx),
+    vb = ramp (e[1].at (x0, y), e[1].dx), sb = step (e[1].dx),
+    vc = ramp (e[2].at (x0, y), e[2].dx), sc = step (e[2].dx);
+  Attributes<N> v = p.at (x0, y);
+
+  for (int x = x0; x < x1; x += lanes) {
+    // lanes inside the triangle, or on the right kind of edge
+    int const run = std::min (lanes, x1 - x);
+    unsigned const mask = ~sign_mask (va | vb | vc) & low_lanes (run);
+
+    group (x, y, v, mask, run);
+
+    va = va + sa; vb = vb + sb; vc = vc + sc;
+  }
+}
+
+// wide edge values take the scalar path; only huge triangles come here
+template<size_t N, typename Group>
+void test_row (
+  Edge<i64> const (&e)[3], Planes<N> const& p,
+  int x0, int x1, int y,
+  Group const& group)
+{
+  i64
+    wa = e[0].at (x0, y),
+    wb = e[1].at (x0, y),
+    wc = e[2].at (x0, y);
+  Attributes<N> v = p.at (x0, y);
+
+  for (int x = x0; x != x1; x++) {
+    if ((wa | wb | wc) >= 0)
+      group (x, y, v, 1u, 1);
+    else
+      v += p.dx;
+    wa += e[0].dx; wb += e[1].dx; wc += e[2].dx;
+  }
+}
+
+// shaders take one pixel's attributes and return its colour. a shader
+// may also have shader.lanes (attributes, mask, pixels), shading up to
+// group_size pixels at once; those in mask are the ones that count
+template<typename Shader, size_t N, typename T>
+auto shade_group (Shader const& shader, Attributes<N> const* v, unsigned mask, T* out, int)
+  -> decltype (shader.lanes (v, mask, out), void ())
+{
+  shader.lanes (v, mask, out);
+}
+
+template<typename Shader, size_t N, typename T>
+void shade_group (Shader const& shader, Attributes<N> const* v, unsigned mask, T* out, long) {
+  for (; mask; mask &= mask - 1) {
+    int const i = lowest_lane (mask);
+    out[i] = shader (v[i]);
+  }
+}
+
+// no depth testing: every covered pixel is drawn
+struct NoDepth {
+  bool tracked () const { return false; }
+  bool occluded (int, int, int, int) const { return false; }
+  bool in_front (int, int, int, int) const { return true; }
+  bool test (int, int) const { return true; }
+  void write (int, int) const { }
+  void drawn (int, int, int, int) const { }
+
+  template<typename Samples> NoDepth with_samples (Samples const&) const { return *this; }
+  unsigned test_samples (int, int, unsigned cover) const { return cover; }
+  void write_samples (int, int, unsigned) const { }
+};
+
+// writing shaded pixels: Overwrite stores them over what's there, and
+// anything else is a blender, blend (under, pixels, count), that mixes a
+// run of pixels into the run of canvas pixels under them. runs that
+// aren't contiguous in the canvas are blended in a copy
+struct Overwrite { };
+
+template<typename T, typename L>
+void write_group (Image<T, L>& out, int x, int y, T const* pixels, unsigned mask, Overwrite) {
+  for (; mask; mask &= mask - 1) {
+    int const i = lowest_lane (mask);
+    out.at (x+i, y) = pixels[i];
+  }
+}
+
+template<typename T, typename L, typename Blender>
+void write_group (Image<T, L>& out, int x, int y, T const* pixels, unsigned mask, Blender const& blend) {
+  if (!mask)
+    return;
+  int const count = 32 - __builtin_clz (mask);
+
+  // a whole run along a linear row is blended where it lies
+  if (L::row_major && mask == low_lanes (count)) {
+    blend (&out.at (x, y), pixels, size_t (count));
+    return;
+  }
+
+  T under[group_size];
+  for (unsigned m = mask; m; m &= m - 1) {
+    int const i = lowest_lane (m);
+    under[i] = out.at (x+i, y);
+  }
+  blend (under, pixels, size_t (count));
+  write_group (out, x, y, under, mask, Overwrite ());
+}
+
+// depth testing for draw_triangle: the buffer, and each vertex's depth.
+// a pixel is drawn if it's no farther than what's there already, so at
+// equal depths later triangles win, as they would without testing
+template<typename L>
+struct DepthTest {
+  DepthBuffer<L>& buffer;
+  float a, b, c;
+};
+
+template<typename L>
+struct SampledDepthPlane;
+
+// the depth test as draw_edges sees it: a plane of depths over the bbox r,
+// with coordinates relative to its top left like everything else there
+template<typename L>
+struct DepthPlane {
+  DepthBuffer<L>* buffer;
+  Rect  r;
+  float z0, dx, dy; // at the origin, and steps per column and row
+  float near, far;  // the triangle's range, widened by slack
+  float slack;      // error in the plane's values, from rounding
+
+  float at (int x, int y) const {
+    return z0 + x*dx + y*dy;
+  }
+
+  // the plane at the sample points of a multisampled buffer, whose
+  // offset (s) is in canvas sub-pixels, y up
+  template<typename Samples>
+  SampledDepthPlane<L> with_samples (Samples const& msaa) const {
+    SampledDepthPlane<L> p;
+    static_cast<DepthPlane&> (p) = *this;
+    p.samples = msaa.samples ();
+    for (int s = 0; s != p.samples; s++) {
+      P2i32 const d = msaa.offset (s);
+      p.sample_dz[s] = (dx * d.x - dy * d.y) / subpixel_one;
+      p.spread = std::max (p.spread, std::abs (p.sample_dz[s]));
     }
+    // a block's bounds then hold for its samples too
+    p.slack += p.spread;
+    return p;
+  }
+
+  // whether the buffer keeps bounds per block, to be updated as blocks
+  // are drawn
+  bool tracked () const { return true; }
 
-    // step edge functions in y
-    wa0 += dwady; wb0 += dwbdy; wc0 += dwcdy;
+  // bounds on the triangle's depths over a block. depths inside the
+  // triangle lie between its vertices', which tightens those a lot
+  float nearest (int x0, int y0, int x1, int y1) const {
+    return std::max (near, at (x0, y0) + std::min (0.f, dx*(x1-x0-1)) + std::min (0.f, dy*(y1-y0-1)) - slack);
   }
+
+  float farthest (int x0, int y0, int x1, int y1) const {
+    return std::min (far, at (x0, y0) + std::max (0.f, dx*(x1-x0-1)) + std::max (0.f, dy*(y1-y0-1)) + slack);
+  }
+
+  Rect image (int x0, int y0, int x1, int y1) const {
+    return Rect { r.x0+x0, r.y0+y0, r.x0+x1, r.y0+y1 };
+  }
+
+  // whether every pixel of a block is behind what's drawn there
+  bool occluded (int x0, int y0, int x1, int y1) const {
+    return nearest (x0, y0, x1, y1) > buffer->farthest_in (image (x0, y0, x1, y1));
+  }
+
+  // whether every pixel of a block will pass the test
+  bool in_front (int x0, int y0, int x1, int y1) const {
+    return farthest (x0, y0, x1, y1) <= buffer->nearest_in (image (x0, y0, x1, y1));
+  }
+
+  // early test of a pixel before shading; keeps its depth if it passes
+  bool test (int x, int y) const {
+    float const z = at (x, y);
+    float& d = buffer->depth.at (r.x0+x, r.y0+y);
+    if (z > d)
+      return false;
+    d = z;
+    return true;
+  }
+
+  void write (int x, int y) const {
+    buffer->depth.at (r.x0+x, r.y0+y) = at (x, y);
+  }
+
+  // update the bounds of an 8x8 block after drawing in it. the farthest
+  // bound only matters once a block is drawn over whole, so it's only
+  // worth recomputing then
+  void drawn (int x0, int y0, int x1, int y1) const {
+    Rect const b = image (x0, y0, x1, y1);
+    Rect const whole = intersect (buffer->depth.bounds (),
+      Rect { b.x0 & -block_size, b.y0 & -block_size, (b.x0 & -block_size) + block_size, (b.y0 & -block_size) + block_size });
+    bool const all = b.x0 == whole.x0 && b.y0 == whole.y0 && b.x1 == whole.x1 && b.y1 == whole.y1;
+    buffer->drawn (b.x0, b.y0, nearest (x0, y0, x1, y1), all);
+  }
+};
+
+// a depth plane over a multisampled buffer: how much deeper each sample
+// is than its pixel's centre, and the most any is nearer or farther
+template<typename L>
+struct SampledDepthPlane : DepthPlane<L> {
+  static constexpr int max_samples = 8;
+
+  int   samples = 1;
+  float sample_dz[max_samples] = { };
+  float spread = 0;
+
+  // the samples in cover of pixel x, y no farther than what's there,
+  // keeping their depths, or with Test false all of them. a pixel wholly
+  // behind its farthest sample is turned away without looking at any
+  template<bool Test>
+  unsigned keep_samples (int x, int y, unsigned cover) const {
+    float const z = this->at (x, y);
+    int const px = this->r.x0+x, py = this->r.y0+y;
+    float& pixel = this->buffer->depth.at (px, py);
+    if (Test && z - spread > pixel)
+      return 0;
+
+    unsigned kept = 0;
+    float farthest = -depth_far;
+
+#if defined (__SSE2__)
+    // a pixel's samples lie side by side along a linear row, and there
+    // are four or eight, so four at a time
+    if (L::row_major) {
+      float* d = &this->buffer->sample (px, py, 0);
+      __m128i const bits = _mm_setr_epi32 (1, 2, 4, 8);
+      __m128 const zv = _mm_set1_ps (z);
+      __m128 far4 = _mm_set1_ps (farthest);
+      for (int s = 0; s < samples; s += 4) {
+        __m128 const
+          zs  = _mm_add_ps (zv, _mm_loadu_ps (sample_dz + s)),
+          old = _mm_loadu_ps (d + s),
+          covered = _mm_castsi128_ps (_mm_cmpeq_epi32 (_mm_and_si128 (_mm_set1_epi32 (int (cover >> s)), bits), bits)),
+          take = Test? _mm_and_ps (covered, _mm_cmple_ps (zs, old)) : covered,
+          now  = _mm_or_ps (_mm_and_ps (take, zs), _mm_andnot_ps (take, old));
+        _mm_storeu_ps (d + s, now);
+        kept |= unsigned (_mm_movemask_ps (take)) << s;
+        far4 = _mm_max_ps (far4, now);
+      }
+      far4 = _mm_max_ps (far4, _mm_movehl_ps (far4, far4));
+      far4 = _mm_max_ss (far4, _mm_shuffle_ps (far4, far4, 1));
+      pixel = _mm_cvtss_f32 (far4);
+      return kept;
+    }
+#endif
+
+    for (int s = 0; s != samples; s++) {
+      float& d = this->buffer->sample (px, py, s);
+      float const zs = z + sample_dz[s];
+      if ((cover >> s & 1) && (!Test || zs <= d)) {
+        d = zs;
+        kept |= 1u << s;
+      }
+      farthest = std::max (farthest, d);
+    }
+    pixel = farthest;
+    return kept;
+  }
+
+  unsigned test_samples (int x, int y, unsigned cover) const {
+    return keep_samples<true> (x, y, cover);
+  }
+
+  void write_samples (int x, int y, unsigned cover) const {
+    keep_samples<false> (x, y, cover);
+  }
+};
+
+// the depth test for part of a clipped triangle, with corners u, v, w
+static inline NoDepth clipped_depth (NoDepth, ClipVertex const&, ClipVertex const&, ClipVertex const&) {
+  return NoDepth ();
+}
+
+template<typename L>
+DepthTest<L> clipped_depth (DepthTest<L> const& t, ClipVertex const& u, ClipVertex const& v, ClipVertex const& w) {
+  auto z = [&t] (ClipVertex const& c) { return c.w[0]*t.a + c.w[1]*t.b + c.w[2]*t.c; };
+  return DepthTest<L> { t.buffer, z (u), z (v), z (w) };
+}
+
+static inline NoDepth depth_plane (NoDepth, Rect, Edge<i64> const (&)[3], float) {
+  return NoDepth ();
+}
+
+// depth is interpolated like any attribute, from the same edge values
+template<typename L>
+DepthPlane<L> depth_plane (DepthTest<L> const& t, Rect r, Edge<i64> const (&e)[3], float k) {
+  float const
+    z0 = (t.a*e[0].w  + t.b*e[1].w  + t.c*e[2].w ) * k,
+    dx = (t.a*e[0].dx + t.b*e[1].dx + t.c*e[2].dx) * k,
+    dy = (t.a*e[0].dy + t.b*e[1].dy + t.c*e[2].dy) * k,
+    slack = (std::abs (z0) + std::abs (dx) * r.width () + std::abs (dy) * r.height ())
+            * 4 * std::numeric_limits<float>::epsilon ();
+  return DepthPlane<L> {
+    &t.buffer, r, z0, dx, dy,
+    std::min ({ t.a, t.b, t.c }) - slack,
+    std::max ({ t.a, t.b, t.c }) + slack,
+    slack
+  };
+}
+
+// walk the bbox r in 64x64 and then 8x8 blocks; blocks outside the
+// triangle are skipped, blocks inside it are shaded without testing,
+// and only blocks straddling an edge are tested pixel by pixel. with a
+// depth test, blocks hidden by what's drawn are skipped too, and pixels
+// are tested against the depth buffer before they're shaded
+template<typename T, typename L, typename W, size_t N, typename Shader, typename Depth, typename Write>
+void draw_edges (
+  Image<T, L>& out,
+  Rect const r,
+  Edge<W> const (&e)[3],
+  Planes<N> const& p,
+  Shader const& shader,
+  Depth const& depth,
+  Write const& write)
+{
+  RasterStats& stats = thread_stats ();
+
+  // shade a group of pixels along a row, as test_row passes them.
+  // attributes are stepped pixel by pixel whatever the group size, so
+  // every build rounds them the same way. visible says every pixel is
+  // known to pass the depth test
+  auto group = [&] (int x, int y, Attributes<N>& v, unsigned mask, int run, bool visible) {
+    Attributes<N> vs[group_size];
+    for (int i = 0; i != run; i++) {
+      vs[i] = v;
+      v += p.dx;
+    }
+
+    for (unsigned m = std::is_same<Depth, NoDepth>::value? 0 : mask; m; m &= m - 1) {
+      int const i = lowest_lane (m);
+      if (visible) {
+        depth.write (x+i, y);
+      }
+      else if (!depth.test (x+i, y)) {
+        mask &= ~(1u << i);
+        stats.pixels_hidden++;
+      }
+    }
+
+    T pixels[group_size];
+    shade_group (shader, vs, mask, pixels, 0);
+    write_group (out, r.x0+x, r.y0+y, pixels, mask, write);
+    stats.pixels_shaded += __builtin_popcount (mask);
+  };
+
+  auto tested = [&] (int x, int y, Attributes<N>& v, unsigned mask, int run) {
+    group (x, y, v, mask, run, false);
+  };
+
+  // shade every pixel of a block, without testing coverage
+  auto fill = [&] (int x0, int y0, int x1, int y1) {
+    bool const visible = depth.in_front (x0, y0, x1, y1);
+    for (int y = y0; y != y1; y++) {
+      Attributes<N> v = p.at (x0, y);
+      for (int x = x0; x < x1; x += group_size) {
+        int const run = std::min (group_size, x1 - x);
+        group (x, y, v, low_lanes (run), run, visible);
+      }
+    }
+  };
+
+  auto test = [&] (int x0, int y0, int x1, int y1) {
+    stats.pixels_tested += (x1 - x0) * (y1 - y0);
+    for (int y = y0; y != y1; y++)
+      test_row (e, p, x0, x1, y, tested);
+  };
+
+  // walk blocks of the given size, aligned in image space, over part of
+  // the bbox. coordinates are relative to the bbox's top left
+  auto blocks = [&] (int size, int x0, int y0, int x1, int y1, auto const& visit) {
+    for (int by = (r.y0+y0) & -size; by < r.y0+y1; by += size) {
+      for (int bx = (r.x0+x0) & -size; bx < r.x0+x1; bx += size) {
+        int const
+          bx0 = std::max (bx - r.x0, x0), bx1 = std::min (bx + size - r.x0, x1),
+          by0 = std::max (by - r.y0, y0), by1 = std::min (by + size - r.y0, y1);
+        visit (bx0, by0, bx1, by1, classify (e, bx0, by0, bx1-bx0, by1-by0));
+      }
+    }
+  };
+
+  // 8x8 blocks inside a 64x64 one
+  auto fine = [&] (int x0, int y0, int x1, int y1, bool full) {
+    blocks (block_size, x0, y0, x1, y1,
+      [&] (int bx0, int by0, int bx1, int by1, Cover block)
+    {
+      if (block == Cover::none) {
+        stats.blocks_skipped++;
+      }
+      else if (depth.occluded (bx0, by0, bx1, by1)) {
+        stats.blocks_occluded++;
+      }
+      else if (full || block == Cover::full) {
+        stats.blocks_filled++;
+        fill (bx0, by0, bx1, by1);
+        depth.drawn (bx0, by0, bx1, by1);
+      }
+      else {
+        stats.blocks_tested++;
+        test (bx0, by0, bx1, by1);
+        depth.drawn (bx0, by0, bx1, by1);
+      }
+    });
+  };
+
+  blocks (coarse_block_size, 0, 0, r.width (), r.height (),
+    [&] (int x0, int y0, int x1, int y1, Cover cover)
+  {
+    if (cover == Cover::none) {
+      stats.coarse_skipped++;
+    }
+    else if (depth.occluded (x0, y0, x1, y1)) {
+      stats.coarse_occluded++;
+    }
+    else if (cover == Cover::full) {
+      stats.coarse_filled++;
+      // without depth, a covered block is one fill; with it, the 8x8
+      // blocks are visited for their depth bounds
+      if (!depth.tracked ())
+        fill (x0, y0, x1, y1);
+      else
+        fine (x0, y0, x1, y1, true);
+    }
+    else {
+      stats.coarse_tested++;
+      fine (x0, y0, x1, y1, false);
+    }
+  });
+}
+
+// attribute planes. each vertex's barycentric weight is its opposite
+// edge function, normalized by k, so the planes are the weighted sums of
+// the edge functions' values and steps
+template<size_t N>
+Planes<N> attribute_planes (
+  Edge<i64> const (&e)[3], float k,
+  Attributes<N> const& aa, Attributes<N> const& ba, Attributes<N> const& ca)
+{
+  Planes<N> p;
+  for (size_t i = 0; i != N; i++) {
+    p.at0[i] = (aa[i]*e[0].w  + ba[i]*e[1].w  + ca[i]*e[2].w ) * k;
+    p.dx[i]  = (aa[i]*e[0].dx + ba[i]*e[1].dx + ca[i]*e[2].dx) * k;
+    p.dy[i]  = (aa[i]*e[0].dy + ba[i]*e[1].dy + ca[i]*e[2].dy) * k;
+  }
+  return p;
+}
+
+template<typename T, typename L, size_t N, typename Shader, typename Depth, typename Write>
+void draw_clipped (
+  Image<T, L>& out,
+  Rect const clip,
+  P2fx const a, P2fx const b, P2fx const c,
+  Attributes<N> const& aa, Attributes<N> const& ba, Attributes<N> const& ca,
+  Shader const& shader,
+  Depth const& depth,
+  Write const& write);
+
+// general triangle rasterizer, taking fixed-point vertices and
+// per-vertex attributes; the shader gets the attributes interpolated
+// to each covered pixel. only pixels inside clip are touched. depth is
+// NoDepth, or a DepthTest to draw only pixels not hidden in its buffer.
+// write is Overwrite, or a blender such as Blender in blend.hpp
+template<typename T, typename L, size_t N, typename Shader, typename Depth = NoDepth, typename Write = Overwrite>
+void draw_triangle (
+  Image<T, L>& out,
+  Rect const clip,
+  P2fx const a, P2fx const b, P2fx const c,
+  Attributes<N> const& aa, Attributes<N> const& ba, Attributes<N> const& ca,
+  Shader const& shader,
+  Depth const& depth = Depth (),
+  Write const& write = Write ())
+{
+  // bbox in image coordinates
+  Rect r;
+  if (!triangle_rect (out, a, b, c, r))
+    return;
+  r = intersect (r, clip);
+  if (r.empty ())
+    return;
+  if (!in_guard_band (a, b, c)) {
+    draw_clipped (out, clip, a, b, c, aa, ba, ca, shader, depth, write);
+    return;
+  }
+  thread_stats ().triangle_draws++;
+
+  // normalizing factor, from twice signed area. edge values are in
+  // sub-pixel-by-pixel units, the area in squared sub-pixels
+  float const k = float (subpixel_one) / wf (a, b, c);
+
+  // setup in 64 bits, relative to the top left of the bbox
+  P2i32 const origin { r.x0 - out.width () / 2, out.height () / 2 - r.y0 };
+  Edge<i64> const e[3] = {
+    make_edge (b, c, origin),
+    make_edge (c, a, origin),
+    make_edge (a, b, origin)
+  };
+
+  Planes<N> const p = attribute_planes (e, k, aa, ba, ca);
+
+  // step in 32 bits unless the values over the bbox need more
+  if (fits_i32 (e[0], r.width (), r.height ()) &&
+      fits_i32 (e[1], r.width (), r.height ()) &&
+      fits_i32 (e[2], r.width (), r.height ()))
+  {
+    Edge<i32> const narrow_e[3] = { narrow (e[0]), narrow (e[1]), narrow (e[2]) };
+    draw_edges (out, r, narrow_e, p, shader, depth_plane (depth, r, e, k), write);
+  }
+  else {
+    draw_edges (out, r, e, p, shader, depth_plane (depth, r, e, k), write);
+  }
+}
+
+// triangles reaching past the guard band are clipped to it, and what's
+// left is drawn as a fan. new corners are on the band, far off the
+// canvas, so rounding them to the sub-pixel grid doesn't show. the fan
+// goes back through draw_triangle, whichever overload the write picks
+template<typename T, typename L, size_t N, typename Shader, typename Depth, typename Write>
+void draw_clipped (
+  Image<T, L>& out,
+  Rect const clip,
+  P2fx const a, P2fx const b, P2fx const c,
+  Attributes<N> const& aa, Attributes<N> const& ba, Attributes<N> const& ca,
+  Shader const& shader,
+  Depth const& depth,
+  Write const& write)
+{
+  ClipVertex v[clip_max_vertices];
+  int const n = clip_triangle (a, b, c, v);
+  thread_stats ().triangles_clipped++;
+
+  auto attributes = [&] (ClipVertex const& u) {
+    Attributes<N> r;
+    for (size_t i = 0; i != N; i++)
+      r[i] = u.w[0]*aa[i] + u.w[1]*ba[i] + u.w[2]*ca[i];
+    return r;
+  };
+
+  for (int i = 1; i+1 < n; i++) {
+    draw_triangle (out, clip, v[0].p, v[i].p, v[i+1].p,
+      attributes (v[0]), attributes (v[i]), attributes (v[i+1]),
+      shader, clipped_depth (depth, v[0], v[i], v[i+1]), write);
+  }
+}
+
+template<typename T, typename L, size_t N, typename Shader>
+void draw_triangle (
+  Image<T, L>& out,
+  P2fx const a, P2fx const b, P2fx const c,
+  Attributes<N> const& aa, Attributes<N> const& ba, Attributes<N> const& ca,
+  Shader const& shader)
+{
+  draw_triangle (out, out.bounds (), a, b, c, aa, ba, ca, shader);
+}
+
+// rasterize with a shader taking normalized barycentrics; these are
+// just attributes that are one at their own vertex and zero elsewhere
+template<typename T, typename L, typename Shader>
+void draw_triangle (
+  Image<T, L>& out,
+  P2fx const a, P2fx const b, P2fx const c,
+  Shader const& shader)
+{
+  Attributes<3> const ua {{ 1, 0, 0 }}, ub {{ 0, 1, 0 }}, uc {{ 0, 0, 1 }};
+  draw_triangle (out, a, b, c, ua, ub, uc,
+    [&shader] (Attributes<3> const& w) { return shader (w[0], w[1], w[2]); });
 }
 
 // draw triangle with no fancy shading
-template<typename Pixel, typename Colour>
-void draw_triangle_bilevel (Image<Pixel>& out, P2i32 a, P2i32 b, P2i32 c, Colour col) {
+template<typename Pixel, typename L, typename Colour>
+void draw_triangle_bilevel (Image<Pixel, L>& out, P2fx a, P2fx b, P2fx c, Colour col) {
   // shader just sets pixels
-  auto shader = [col] (auto, auto, auto) { return convert_pixel (col); };
-  draw_triangle (out, a, b, c, shader);
+  Attributes<0> const none {};
+  auto shader = [col] (Attributes<0> const&) { return convert_pixel (col); };
+  draw_triangle (out, a, b, c, none, none, none, shader);
 }
 
 // draw triangle with interpolated colours
-template<typename Pixel, typename Colour>
+template<typename Pixel, typename L, typename Colour>
 void draw_triangle_shaded (
-  Image<Pixel>& out,
-  P2i32 a, Colour a_colour,
-  P2i32 b, Colour b_colour,
-  P2i32 c, Colour c_colour)
+  Image<Pixel, L>& out,
+  P2fx a, Colour a_colour,
+  P2fx b, Colour b_colour,
+  P2fx c, Colour c_colour)
 {
-  // use barycentric coords to weight vertex colours
-  auto shader = [a_colour, b_colour, c_colour] (float a, float b, float c) {
-    return convert_pixel (a*a_colour + b*b_colour + c*c_colour);
+  // vertex colours are interpolated as attributes
+  auto channels = [] (Colour c) { return Attributes<4> {{ float (c.r), float (c.g), float (c.b), float (c.a) }}; };
+  auto shader = [] (Attributes<4> const& c) {
+    return convert_pixel (Pixelf (c[0], c[1], c[2], c[3]));
   };
-  draw_triangle (out, a, b, c, shader);
+  draw_triangle (out, a, b, c, channels (a_colour), channels (b_colour), channels (c_colour), shader);
 }
-
@@ -0,0 +1,158 @@
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "image.hpp"
+#include "output.hpp"
+#include "pixel.hpp"
+#include "qoi.hpp"
+#include "stats.hpp"
+
+// image file formats we can write
+enum class Format {
+  ppm, // uncompressed P6
+  qoi  // compressed, see qoi.hpp
+};
+
+static inline Format format_named (char const* name) {
+  if (!strcmp (name, "ppm"))
+    return Format::ppm;
+  if (!strcmp (name, "qoi"))
+    return Format::qoi;
+  throw std::runtime_error (std::string ("Unknown format ") + name);
+}
+
+// guess format from a path's extension, defaulting to ppm
+static inline Format format_for (char const* path) {
+  char const* dot = strrchr (path, '.');
+  if (dot && !strcmp (dot, ".qoi"))
+    return Format::qoi;
+  return Format::ppm;
+}
+
+static inline void encode_header (Format format, std::vector<uint8_t>& out, int width, int height) {
+  if (format == Format::qoi) {
+    qoi_header (out, width, height);
+  }
+  else {
+    std::string const header =
+      "P6\n" + std::to_string (width) + " " + std::to_string (height) + "\n"
+      "255\n";
+    out.insert (out.end (), header.begin (), header.end ());
+  }
+}
+
+// encode rows [y0, y1). strips are independent of one another
+static inline void encode_strip (Format format, std::vector<uint8_t>& out, Image<Pixelu8> const& image, int y0, int y1) {
+  if (format == Format::qoi) {
+    qoi_strip (out, image, y0, y1);
+  }
+  else {
+    size_t const at = out.size (), row_bytes = size_t (image.width ()) * 3;
+    out.resize (at + (y1 - y0) * row_bytes);
+    for (int y = y0; y != y1; y++)
+      pack_rgb (out.data () + at + (y - y0) * row_bytes, image.row (y), image.width ());
+  }
+}
+
+static inline void encode_footer (Format format, std::vector<uint8_t>& out) {
+  if (format == Format::qoi)
+    qoi_footer (out);
+}
+
+// rewrite rect r of a ppm already written out whole, row by row in
+// place, leaving the rest of the file be
+static inline void update_ppm (Output& out, Image<Pixelu8> const& image, Rect const& r) {
+  if (r.empty ())
+    return;
+  std::vector<uint8_t> header;
+  encode_header (Format::ppm, header, image.width (), image.height ());
+  std::vector<uint8_t> row (size_t (r.width ()) * 3);
+  StageTimer const timer (stage_write);
+  for (int y = r.y0; y != r.y1; y++) {
+    pack_rgb (row.data (), image.row (y) + r.x0, r.width ());
+    out.write_at (row.data (), row.size (), off_t (header.size () + (size_t (y) * image.width () + r.x0) * 3));
+  }
+}
+
+// encodes an image strip by strip and writes the strips out in order.
+// strips may be encoded on any thread and finish in any order; each is
+// written as soon as it and every strip before it are done. one thread
+// writes at a time, outside the lock, and picks up whatever strips finish
+// meanwhile, so no other waits on output
+class StripWriter {
+  Output& out;
+  Format const format;
+
+  std::mutex lock;
+  std::vector<std::vector<uint8_t>> strips;
+  std::vector<bool> ready;
+  size_t next = 0;
+  bool writing = false;
+
+public:
+  StripWriter (Output& out, Format format, int width, int height, int strip_count) :
+    out (out),
+    format (format),
+    strips (strip_count),
+    ready (strip_count, false)
+  {
+    std::vector<uint8_t> header;
+    encode_header (format, header, width, height);
+    out.write (header.data (), header.size ());
+  }
+
+  void encode (Image<Pixelu8> const& image, int strip, int y0, int y1) {
+    std::vector<uint8_t> data;
+    {
+      StageTimer const timer (stage_encode);
+      encode_strip (format, data, image, y0, y1);
+    }
+
+    std::unique_lock<std::mutex> guard (lock);
+    strips[strip] = std::move (data);
+    ready[strip] = true;
+    if (writing)
+      return;
+
+    // take every strip that can go out now, and write them in one go.
+    // a failed write leaves writing set, so no later strip goes out
+    // after a gap
+    writing = true;
+    std::vector<std::vector<uint8_t>> taken;
+    for (;;) {
+      for (; next != strips.size () && ready[next]; next++)
+        taken.push_back (std::move (strips[next]));
+      if (taken.empty ())
+        break;
+      guard.unlock ();
+      {
+        StageTimer const timer (stage_write);
+        std::vector<iovec> parts;
+        for (std::vector<uint8_t>& t : taken)
+          parts.push_back (iovec { t.data (), t.size () });
+        out.write (parts.data (), int (parts.size ()));
+      }
+      taken.clear ();
+      guard.lock ();
+    }
+    writing = false;
+  }
+
+  void finish () {
+    if (next != strips.size ())
+      throw std::logic_error ("Image strips missing");
+    StageTimer const timer (stage_write);
+    std::vector<uint8_t> footer;
+    encode_footer (format, footer);
+    if (!footer.empty ())
+      out.write (footer.data (), footer.size ());
+  }
+};
+
@@ -0,0 +1,36 @@
+
+#pragma once
+
+#include <cmath>
+
+#include "vector.hpp"
+
+// bits of sub-pixel precision in vertex positions; 8 gives 24.8 fixed point.
+// override with -DSUBPIXEL_BITS=n
+#ifndef SUBPIXEL_BITS
+#define SUBPIXEL_BITS 8
+#endif
+
+static constexpr int subpixel_bits = SUBPIXEL_BITS;
+static constexpr i32 subpixel_one  = 1 << subpixel_bits;
+
+static_assert (subpixel_bits >= 0 && subpixel_bits <= 12, "Unreasonable sub-pixel precision");
+
+// canvas position in fixed point, subpixel_one units to the pixel.
+// pixel centres sit on whole multiples of subpixel_one
+using P2fx = Point2<i32>;
+
+// round a canvas position to the sub-pixel grid
+static inline P2fx snap (float x, float y) {
+  return P2fx { i32 (std::lround (x * subpixel_one)), i32 (std::lround (y * subpixel_one)) };
+}
+
+// whole pixels that lie at or after / at or before a fixed-point coordinate
+static inline i32 pixel_ceil (i32 x) {
+  return -((-x) >> subpixel_bits);
+}
+
+static inline i32 pixel_floor (i32 x) {
+  return x >> subpixel_bits;
+}
+
@@ -1,30 +1,252 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <utility>
 
+#include "buffer_pool.hpp"
 #include "vector.hpp"
 
-template<typename Pixel>
+// half-open rectangle of pixels, in image coordinates
+struct Rect {
+  int x0, y0, x1, y1;
+
+  int width () const {
+    return x1 - x0;
+  }
+
+  int height () const {
+    return y1 - y0;
+  }
+
+  bool empty () const {
+    return x1 <= x0 || y1 <= y0;
+  }
+};
+
+static inline Rect intersect (Rect a, Rect b) {
+  return Rect {
+    std::max (a.x0, b.x0), std::max (a.y0, b.y0),
+    std::min (a.x1, b.x1), std::min (a.y1, b.y1)
+  };
+}
+
+// interleave the bits of x and y, x in the even bits
+static inline uint32_t morton (uint32_t x, uint32_t y) {
+  auto spread = [] (uint32_t v) {
+    v &= 0xffff;
+    v = (v | v << 8) & 0x00ff00ff;
+    v = (v | v << 4) & 0x0f0f0f0f;
+    v = (v | v << 2) & 0x33333333;
+    v = (v | v << 1) & 0x55555555;
+    return v;
+  };
+  return spread (x) | spread (y) << 1;
+}
+
+static constexpr int log2_int (int x) {
+  return x > 1? 1 + log2_int (x / 2) : 0;
+}
+
+// pixel layouts. a layout maps (x, y) to an offset into the image's
+// storage, and walks a rectangle as runs of pixels that are adjacent in
+// both x and memory, calling span (x, y, offset, count) in storage order
+
+// row by row, each row padded to whole 64-byte lines
+struct Linear {
+  static constexpr bool row_major = true;
+
+  int    pitch = 0; // pixels from one row to the next
+  size_t count = 0; // pixels of storage
+
+  Linear () = default;
+
+  // pitch defaults to the width rounded up
+  Linear (int w, int h, size_t pixel_bytes, int row_pitch) {
+    int const align = std::max (1, int (buffer_align / pixel_bytes));
+    pitch = row_pitch? row_pitch : (w + align - 1) / align * align;
+    assert (pitch >= w);
+    count = size_t (pitch) * h;
+  }
+
+  size_t offset (int x, int y) const {
+    return size_t (y) * pitch + x;
+  }
+
+  template<typename Span>
+  void spans (Rect const& r, Span const& span) const {
+    for (int y = r.y0; y != r.y1; y++)
+      span (r.x0, y, offset (r.x0, y), r.width ());
+  }
+};
+
+// square tiles of Size pixels, stored one after another a row of tiles
+// at a time. within a tile pixels go row by row, or in Morton order, so
+// a small 2d patch of the image is a few cache lines and one page
+template<int Size, bool Morton = false>
+struct Tiled {
+  static_assert (Size > 0 && (Size & (Size - 1)) == 0, "Tile size must be a power of two");
+  static constexpr bool row_major = false;
+  static constexpr int shift = log2_int (Size), mask = Size - 1;
+
+  int    across = 0; // tiles per row of tiles
+  size_t count  = 0;
+
+  Tiled () = default;
+
+  // images are padded out to whole tiles; there's no row pitch
+  Tiled (int w, int h, size_t, int row_pitch) {
+    assert (row_pitch == 0);
+    (void) row_pitch;
+    across = (w + mask) >> shift;
+    count = size_t (across) * ((h + mask) >> shift) << 2*shift;
+  }
+
+  size_t offset (int x, int y) const {
+    size_t const tile = size_t (y >> shift) * across + (x >> shift);
+    size_t const within = Morton?
+      morton (uint32_t (x & mask), uint32_t (y & mask)) :
+      uint32_t ((y & mask) << shift | (x & mask));
+    return tile << 2*shift | within;
+  }
+
+  template<typename Span>
+  void spans (Rect const& r, Span const& span) const {
+    if (r.empty ())
+      return;
+    for (int ty = r.y0 >> shift; ty <= (r.y1 - 1) >> shift; ty++) {
+      for (int tx = r.x0 >> shift; tx <= (r.x1 - 1) >> shift; tx++) {
+        int const
+          x0 = std::max (r.x0, tx << shift), x1 = std::min (r.x1, (tx + 1) << shift),
+          y0 = std::max (r.y0, ty << shift), y1 = std::min (r.y1, (ty + 1) << shift);
+        for (int y = y0; y != y1; y++) {
+          if (Morton) {
+            for (int x = x0; x != x1; x++)
+              span (x, y, offset (x, y), 1);
+          }
+          else {
+            span (x0, y, offset (x0, y), x1 - x0);
+          }
+        }
+      }
+    }
+  }
+};
+
+// constructor tag for an image whose pixels the caller will set
+struct Uninitialized { };
+
+// a 2d array of pixels, laid out in memory as Layout says. storage is
+// 64-byte aligned, and comes from an optional BufferPool that gets it
+// back when the image dies, so canvases of one size can share buffers
+template<typename Pixel, typename Layout = Linear>
 class Image {
-  int const wide, high;
-  Pixel* const data;
+  int wide = 0, high = 0;
+  Layout layout;
+  Pixel* data = nullptr;
+  size_t capacity = 0;
+  BufferPool* pool = nullptr;
+
+  size_t index (P2i32 p) const {
+    assert (p.x >= 0 && p.x < wide && p.y >= 0 && p.y < high);
+    return layout.offset (p.x, p.y);
+  }
 
-  int index (P2i32 p) const {
-    int i = p.y * wide + p.x;
-    assert (i >= 0 && i < size ());
-    return i;
+  void release () {
+    if (pool)
+      pool->give (data, capacity);
+    else
+      free (data);
+    data = nullptr;
   }
 
 public:
-  Image (int w, int h) :
+  // a row pitch, in pixels, only applies to linear images and defaults
+  // to the width rounded up to whole 64-byte lines. a new image is
+  // cleared to Pixel's default
+  Image (int w, int h, BufferPool* pool = nullptr, int row_pitch = 0) :
+    Image (w, h, Uninitialized (), pool, row_pitch)
+  {
+    clear (Pixel ());
+  }
+
+  // leaves the pixels as they come from the allocator, to be cleared
+  // piecewise, say by the threads that draw them
+  Image (int w, int h, Uninitialized, BufferPool* pool = nullptr, int row_pitch = 0) :
     wide (abs (w)),
     high (abs (h)),
-    data (new Pixel[wide * high])
-  { }
+    layout (wide, high, sizeof (Pixel), row_pitch),
+    pool (pool)
+  {
+    size_t const bytes = layout.count * sizeof (Pixel);
+    if (pool) {
+      data = static_cast<Pixel*> (pool->take (bytes, capacity));
+    }
+    else {
+      data = static_cast<Pixel*> (aligned_buffer (bytes));
+      capacity = bytes;
+    }
+  }
+
+  Image () = default;
+
+  Image (Image&& other) {
+    *this = std::move (other);
+  }
+
+  Image& operator = (Image&& other) {
+    if (this != &other) {
+      if (data)
+        release ();
+      wide     = other.wide;
+      high     = other.high;
+      layout   = other.layout;
+      data     = other.data;
+      capacity = other.capacity;
+      pool     = other.pool;
+      other.data = nullptr;
+      other.wide = other.high = 0;
+      other.layout = Layout ();
+    }
+    return *this;
+  }
+
+  Image (Image const&) = delete;
+  Image& operator = (Image const&) = delete;
 
   ~Image () {
-    delete[] data;
+    if (data)
+      release ();
+  }
+
+  // visit the part of r inside the image as runs of adjacent pixels, in
+  // storage order, calling span (x, y, pixels, count)
+  template<typename Span>
+  void spans (Rect const& r, Span const& span) {
+    layout.spans (intersect (r, bounds ()), [&] (int x, int y, size_t offset, int count) {
+      span (x, y, data + offset, count);
+    });
+  }
+
+  template<typename Span>
+  void spans (Rect const& r, Span const& span) const {
+    layout.spans (intersect (r, bounds ()), [&] (int x, int y, size_t offset, int count) {
+      span (x, y, const_cast<Pixel const*> (data + offset), count);
+    });
+  }
+
+  // set every pixel in a rectangle to one colour
+  void clear (Rect const& r, Pixel colour) {
+    spans (r, [colour] (int, int, Pixel* p, int count) {
+      std::fill (p, p + count, colour);
+    });
+  }
+
+  void clear (Pixel colour) {
+    clear (bounds (), colour);
   }
 
   int width () const {
@@ -39,6 +261,10 @@ public:
     return wide * high;
   }
 
+  Rect bounds () const {
+    return Rect { 0, 0, wide, high };
+  }
+
   Pixel& at (P2i32 p) {
     return data[index (p)];
   }
@@ -55,31 +281,47 @@ public:
     return at (P2i32 {x, y});
   }
 
-  Pixel* begin () {
+  // raw storage, laid out as pixel_layout () says
+  Pixel const* storage () const {
     return data;
   }
 
-  Pixel* end () {
-    return data + size ();
+  Layout const& pixel_layout () const {
+    return layout;
   }
 
-  Pixel const* begin () const {
-    return data;
+  // rows and their pitch only exist for linear images
+  int row_pitch () const {
+    return layout.pitch;
   }
 
-  Pixel const* end () const {
-    return data + size ();
+  Pixel* row (int y) {
+    static_assert (Layout::row_major, "Image rows need a linear layout");
+    return data + index (P2i32 {0, y});
   }
-};
 
-template<typename Pixel>
-static void flip_v (Image<Pixel>& im) {
-  int h = im.height (),
-      w = im.width (),
-      l = h / 2;
-  for (int y = 0; y != l; y++) {
-    for (int x = 0; x != w; x++)
-      std::swap (im.at (x, y), im.at (x, h-y-1));
+  Pixel const* row (int y) const {
+    static_assert (Layout::row_major, "Image rows need a linear layout");
+    return data + index (P2i32 {0, y});
   }
+};
+
+// copy a rectangle of a tiled image into the same place in a linear one,
+// a tile's row at a time
+template<typename Pixel, typename Layout>
+void detile (Image<Pixel>& out, Image<Pixel, Layout> const& in, Rect const& r) {
+  assert (out.width () == in.width () && out.height () == in.height ());
+  in.spans (r, [&out] (int x, int y, Pixel const* p, int count) {
+    std::copy (p, p + count, out.row (y) + x);
+  });
 }
 
+// mirrored spans have the same shape in every layout, so rows are
+// swapped a run at a time
+template<typename Pixel, typename Layout>
+static void flip_v (Image<Pixel, Layout>& im) {
+  int const h = im.height ();
+  im.spans (Rect { 0, 0, im.width (), h / 2 }, [&im, h] (int x, int y, Pixel* p, int count) {
+    std::swap_ranges (p, p + count, &im.at (x, h-y-1));
+  });
+}
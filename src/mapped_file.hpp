@@ -0,0 +1,68 @@
+
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// read-only memory mapping of a whole file. advice is passed to madvise,
+// and defaults to reading front to back
+class MappedFile {
+  void*  base   = nullptr;
+  size_t length = 0;
+
+  static std::system_error error (char const* what, char const* path) {
+    return std::system_error (errno, std::generic_category (), std::string (what) + " " + path);
+  }
+
+public:
+  explicit MappedFile (char const* path, int advice = MADV_SEQUENTIAL) {
+    int fd = open (path, O_RDONLY);
+    if (fd < 0)
+      throw error ("Can't open", path);
+
+    struct stat info;
+    if (fstat (fd, &info) < 0) {
+      auto e = error ("Can't stat", path);
+      close (fd);
+      throw e;
+    }
+    length = size_t (info.st_size);
+
+    // mmap refuses empty mappings
+    if (length != 0) {
+      base = mmap (nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (base == MAP_FAILED) {
+        auto e = error ("Can't map", path);
+        close (fd);
+        throw e;
+      }
+      madvise (base, length, advice);
+    }
+
+    close (fd);
+  }
+
+  ~MappedFile () {
+    if (base)
+      munmap (base, length);
+  }
+
+  MappedFile (MappedFile const&) = delete;
+  MappedFile& operator = (MappedFile const&) = delete;
+
+  char const* data () const {
+    return static_cast<char const*> (base);
+  }
+
+  size_t size () const {
+    return length;
+  }
+};
+
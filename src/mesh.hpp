@@ -0,0 +1,123 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "scene.hpp"
+
+// how a run of indices makes triangles
+enum class Topology {
+  list,  // every three indices are a triangle
+  strip, // every index after the first two makes one with the two before it
+  fan    // every index after the second makes one with the first and the one before
+};
+
+// an indexed mesh: each vertex stored once, and triangles as three
+// indices into them. strips and fans are turned into lists as they're
+// added, so everything past here sees only lists
+struct Mesh {
+  std::vector<Vertex>   vertices;
+  std::vector<uint32_t> indices;
+
+  size_t size () const {
+    return indices.size () / 3;
+  }
+
+  // add the triangles of a run of indices. every other triangle of a
+  // strip is turned around, so they all wind the same way as the first
+  void add (Topology topology, uint32_t const* run, size_t count) {
+    auto add = [this] (uint32_t a, uint32_t b, uint32_t c) {
+      indices.insert (indices.end (), { a, b, c });
+    };
+    switch (topology) {
+    case Topology::list:
+      indices.insert (indices.end (), run, run + count / 3 * 3);
+      break;
+    case Topology::strip:
+      for (size_t i = 2; i < count; i++) {
+        if (i & 1)
+          add (run[i-1], run[i-2], run[i]);
+        else
+          add (run[i-2], run[i-1], run[i]);
+      }
+      break;
+    case Topology::fan:
+      for (size_t i = 2; i < count; i++)
+        add (run[0], run[i-1], run[i]);
+      break;
+    }
+  }
+};
+
+// post-transform vertex cache: the last Size vertices a mesh's triangles
+// asked for, by index, with what per-vertex work made of them, so that a
+// vertex shared by nearby triangles is only worked on once. first in,
+// first out, like the caches in hardware; a lookup is a scan of Size keys
+template<typename Value, int Size = 32>
+class VertexCache {
+  static constexpr uint32_t empty = ~uint32_t (0);
+
+  uint32_t keys[Size];
+  Value    values[Size];
+  int      next = 0;
+
+public:
+  uint64_t hits = 0, misses = 0;
+
+  VertexCache () {
+    clear ();
+  }
+
+  void clear () {
+    std::fill (keys, keys + Size, empty);
+    next = 0;
+  }
+
+  // vertex index, from the cache or else from work (index)
+  template<typename Work>
+  Value get (uint32_t index, Work const& work) {
+    for (int i = 0; i != Size; i++) {
+      if (keys[i] == index) {
+        hits++;
+        return values[i];
+      }
+    }
+    misses++;
+    keys[next] = index;
+    values[next] = work (index);
+    Value const value = values[next];
+    next = (next + 1) % Size;
+    return value;
+  }
+};
+
+template<typename Value, int Size>
+constexpr uint32_t VertexCache<Value, Size>::empty;
+
+// draw triangles from a mesh, in order, calling triangle (a, b, c) with
+// each one's vertices after work, which runs once a vertex while it stays
+// in the cache
+template<typename Value, int Size, typename Work, typename Emit>
+void assemble (Mesh const& mesh, VertexCache<Value, Size>& cache, Work const& work, Emit const& triangle) {
+  for (size_t i = 0; i + 3 <= mesh.indices.size (); i += 3) {
+    uint32_t const* t = mesh.indices.data () + i;
+    Value const a = cache.get (t[0], work);
+    Value const b = cache.get (t[1], work);
+    Value const c = cache.get (t[2], work);
+    triangle (a, b, c);
+  }
+}
+
+// vertices a list of triangles would transform through a cache of Size,
+// for measuring orderings. per triangle, that's the usual figure of merit:
+// 3 with no reuse, around 0.5 at best for a regular grid
+template<int Size = 32>
+uint64_t cache_misses (std::vector<uint32_t> const& indices) {
+  VertexCache<bool, Size> cache;
+  for (uint32_t index : indices)
+    cache.get (index, [] (uint32_t) { return true; });
+  return cache.misses;
+}
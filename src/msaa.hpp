@@ -0,0 +1,373 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#if defined (__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "attributes.hpp"
+#include "buffer_pool.hpp"
+#include "draw_triangle.hpp"
+#include "image.hpp"
+#include "pixel.hpp"
+#include "simd.hpp"
+#include "stats.hpp"
+#include "tiles.hpp"
+
+// multisampling: coverage is tested at several points in each pixel, the
+// shader runs once per covered pixel, and each sample keeps the colour of
+// the last triangle to cover it. with depth testing each sample has its
+// own depth too, so a triangle behind another still shows in the samples
+// the other leaves uncovered. the samples are averaged into the canvas
+// once everything is drawn
+
+static constexpr int msaa_max_samples = 8;
+static_assert (msaa_max_samples <= SampledDepthPlane<Linear>::max_samples, "Depth planes must hold every sample");
+
+// sample points, in 16ths of a pixel from the centre, x right and y down.
+// the usual rotated patterns, so near-vertical and near-horizontal edges
+// see every sample at a different distance
+static constexpr int8_t msaa_pattern4[4][2] = {
+  { -2, -6 }, {  6, -2 }, { -6,  2 }, {  2,  6 }
+};
+
+static constexpr int8_t msaa_pattern8[8][2] = {
+  {  1, -3 }, { -1,  3 }, {  5,  1 }, { -3, -5 },
+  { -5,  5 }, { -7, -1 }, {  3,  7 }, {  7, -7 }
+};
+
+// every sample lies within half a pixel of the centre, in sub-pixels
+static constexpr i32 msaa_margin = subpixel_one / 2;
+
+// per-sample colours for a canvas, kept compressed. a pixel holds at most
+// two colours: the canvas has the first, and a mask says which samples
+// take the second. inside triangles every sample is the same, so only the
+// canvas colour is used; along an edge two colours cover most pixels.
+// where a third colour arrives the newest is kept exactly and the two
+// older ones merge into whichever has more samples. that costs five bytes
+// a pixel at any sample count, against four a sample stored whole
+template<typename Layout>
+class MsaaBuffer {
+  int count;
+  Image<Pixelu8, Layout> second;
+  Image<uint8_t, Layout> mask; // samples with the second colour
+
+public:
+  MsaaBuffer (int w, int h, int samples, BufferPool* pool = nullptr) :
+    count  (samples),
+    second (w, h, Uninitialized (), pool),
+    mask   (w, h, Uninitialized (), pool)
+  {
+    if (samples != 4 && samples != 8)
+      throw std::runtime_error ("Multisampling takes 4 or 8 samples");
+    // sample points are in 16ths of a pixel; on a coarser sub-pixel grid
+    // they'd round onto one another and the centre
+    if (subpixel_bits < 4)
+      throw std::runtime_error ("Multisampling needs at least 4 bits of sub-pixel precision");
+  }
+
+  int samples () const {
+    return count;
+  }
+
+  unsigned all () const {
+    return low_lanes (count);
+  }
+
+  // sample s's offset from a pixel centre, in canvas sub-pixels
+  P2i32 offset (int s) const {
+    int8_t const* d = count == 4? msaa_pattern4[s] : msaa_pattern8[s];
+    return P2i32 { d[0] * subpixel_one / 16, -d[1] * subpixel_one / 16 };
+  }
+
+  // reset a rect to one colour per pixel, which is the canvas's
+  void clear (Rect const& r) {
+    mask.clear (r, 0);
+  }
+
+  // colour the samples in cover of pixel x, y
+  template<typename T>
+  void write (Image<T, Layout>& canvas, int x, int y, unsigned cover, T colour) {
+    T& first = canvas.at (x, y);
+    uint8_t& m = mask.at (x, y);
+    if (cover == all ()) {
+      first = colour;
+      m = 0;
+      return;
+    }
+
+    // samples keeping the old colours
+    unsigned const
+      keep_first  = all () & ~m & ~cover,
+      keep_second = m & ~cover;
+    T& other = second.at (x, y);
+    if (keep_second && (!keep_first || __builtin_popcount (keep_second) > __builtin_popcount (keep_first)))
+      first = other;
+    other = colour;
+    m = uint8_t (cover);
+  }
+
+  // average the samples of a rect into the canvas. a run of pixels in the
+  // canvas is one in the others too, since they share its layout
+  template<typename T>
+  void resolve (Image<T, Layout>& canvas, Rect const& r) const {
+    int const shift = count == 4? 2 : 3;
+    canvas.spans (r, [&] (int x, int y, T* first, int n) {
+      resolve_span (first,
+        second.storage () + second.pixel_layout ().offset (x, y),
+        mask.storage () + mask.pixel_layout ().offset (x, y), size_t (n), shift);
+    });
+  }
+
+  // a run of pixels: first = (first * (count - k) + second * k) / count,
+  // rounded, where k is the number of samples in the mask
+  static void resolve_span (Pixelu8* first, Pixelu8 const* other, uint8_t const* m, size_t n, int shift) {
+    int const samples = 1 << shift;
+    size_t i = 0;
+
+#if defined (__SSE2__)
+    // four pixels a time, skipping them where none has a second colour,
+    // which is most of them
+    __m128i const
+      zero  = _mm_setzero_si128 (),
+      total = _mm_set1_epi16 (short (samples)),
+      half  = _mm_set1_epi16 (short (samples / 2)),
+      bits  = _mm_cvtsi32_si128 (shift);
+    auto mix = [&] (__m128i a, __m128i b, int k0, int k1) {
+      __m128i const k = _mm_setr_epi16 (
+        short (k0), short (k0), short (k0), short (k0),
+        short (k1), short (k1), short (k1), short (k1));
+      __m128i const sum = _mm_add_epi16 (
+        _mm_add_epi16 (_mm_mullo_epi16 (a, _mm_sub_epi16 (total, k)), _mm_mullo_epi16 (b, k)), half);
+      return _mm_srl_epi16 (sum, bits);
+    };
+    for (; i + 4 <= n; i += 4) {
+      uint32_t masks;
+      memcpy (&masks, m + i, sizeof masks);
+      if (!masks)
+        continue;
+      int k[4];
+      for (int j = 0; j != 4; j++)
+        k[j] = __builtin_popcount (m[i+j]);
+
+      __m128i const
+        a = _mm_loadu_si128 (reinterpret_cast<__m128i const*> (first + i)),
+        b = _mm_loadu_si128 (reinterpret_cast<__m128i const*> (other + i)),
+        lo = mix (_mm_unpacklo_epi8 (a, zero), _mm_unpacklo_epi8 (b, zero), k[0], k[1]),
+        hi = mix (_mm_unpackhi_epi8 (a, zero), _mm_unpackhi_epi8 (b, zero), k[2], k[3]);
+      _mm_storeu_si128 (reinterpret_cast<__m128i*> (first + i), _mm_packus_epi16 (lo, hi));
+    }
+#endif
+
+    for (; i < n; i++) {
+      int const k = __builtin_popcount (m[i]);
+      if (!k)
+        continue;
+      for (int c = 0; c != 4; c++)
+        first[i].channels[c] = uint8_t ((first[i].channels[c] * (samples - k) + other[i].channels[c] * k + samples / 2) >> shift);
+    }
+  }
+};
+
+// draw_triangle's write for a multisampled canvas
+template<typename Layout>
+struct MsaaWrite {
+  MsaaBuffer<Layout>* buffer;
+};
+
+// the samples of pixels x to x + run - 1 of row y inside a triangle,
+// given each sample's edges, one mask per pixel
+static inline void sample_cover (Edge<i32> const (&e)[msaa_max_samples][3], int samples, int x, int y, int run, unsigned* cover) {
+  int const lanes = I32Lanes::width;
+  std::fill (cover, cover + run, 0u);
+  for (int s = 0; s != samples; s++) {
+    Edge<i32> const (&se)[3] = e[s];
+    for (int k = 0; k < run; k += lanes) {
+      I32Lanes const
+        va = ramp (se[0].at (x+k, y), se[0].dx),
+        vb = ramp (se[1].at (x+k, y), se[1].dx),
+        vc = ramp (se[2].at (x+k, y), se[2].dx);
+      for (unsigned m = ~sign_mask (va | vb | vc) & low_lanes (std::min (lanes, run - k)); m; m &= m - 1)
+        cover[k + lowest_lane (m)] |= 1u << s;
+    }
+  }
+}
+
+static inline void sample_cover (Edge<i64> const (&e)[msaa_max_samples][3], int samples, int x, int y, int run, unsigned* cover) {
+  for (int i = 0; i != run; i++) {
+    cover[i] = 0;
+    for (int s = 0; s != samples; s++) {
+      if ((e[s][0].at (x+i, y) | e[s][1].at (x+i, y) | e[s][2].at (x+i, y)) >= 0)
+        cover[i] |= 1u << s;
+    }
+  }
+}
+
+// walk the bbox r in 8x8 blocks, as draw_edges does, with each sample's
+// edges in e. lo and hi are edges bounding every sample's from below and
+// above: a block inside lo has all its samples covered, and one outside
+// hi has none
+template<typename T, typename L, typename W, size_t N, typename Shader, typename Depth>
+void draw_samples (
+  Image<T, L>& out,
+  Rect const r,
+  Edge<W> const (&e)[msaa_max_samples][3],
+  Edge<W> const (&lo)[3],
+  Edge<W> const (&hi)[3],
+  Planes<N> const& p,
+  Shader const& shader,
+  Depth const& depth,
+  MsaaBuffer<L>& msaa)
+{
+  RasterStats& stats = thread_stats ();
+  int const samples = msaa.samples ();
+
+  // shade a group of pixels along a row, those with a sample covered,
+  // and store the colours to the covered samples that pass the depth test
+  auto group = [&] (int x, int y, Attributes<N>& v, unsigned* cover, int run, bool visible) {
+    // lanes past run are shaded too, so they start out zero
+    Attributes<N> vs[group_size] = { };
+    unsigned mask = 0;
+    for (int i = 0; i != run; i++) {
+      vs[i] = v;
+      v += p.dx;
+      if (cover[i])
+        mask |= 1u << i;
+    }
+
+    for (unsigned m = std::is_same<Depth, NoDepth>::value? 0 : mask; m; m &= m - 1) {
+      int const i = lowest_lane (m);
+      if (visible) {
+        depth.write_samples (x+i, y, cover[i]);
+      }
+      else if (!(cover[i] = depth.test_samples (x+i, y, cover[i]))) {
+        mask &= ~(1u << i);
+        stats.pixels_hidden++;
+      }
+    }
+
+    T pixels[group_size];
+    shade_group (shader, vs, mask, pixels, 0);
+    stats.pixels_shaded += __builtin_popcount (mask);
+    for (; mask; mask &= mask - 1) {
+      int const i = lowest_lane (mask);
+      msaa.write (out, r.x0+x+i, r.y0+y, cover[i], pixels[i]);
+    }
+  };
+
+  for (int by = r.y0 & -block_size; by < r.y1; by += block_size) {
+    for (int bx = r.x0 & -block_size; bx < r.x1; bx += block_size) {
+      int const
+        x0 = std::max (bx, r.x0) - r.x0, x1 = std::min (bx + block_size, r.x1) - r.x0,
+        y0 = std::max (by, r.y0) - r.y0, y1 = std::min (by + block_size, r.y1) - r.y0;
+
+      if (classify (hi, x0, y0, x1-x0, y1-y0) == Cover::none) {
+        stats.blocks_skipped++;
+        continue;
+      }
+      if (depth.occluded (x0, y0, x1, y1)) {
+        stats.blocks_occluded++;
+        continue;
+      }
+
+      bool const full = classify (lo, x0, y0, x1-x0, y1-y0) == Cover::full;
+      bool const visible = full && depth.in_front (x0, y0, x1, y1);
+      if (full) {
+        stats.blocks_filled++;
+      }
+      else {
+        stats.blocks_tested++;
+        stats.pixels_tested += (x1 - x0) * (y1 - y0);
+      }
+
+      unsigned cover[group_size];
+      for (int y = y0; y != y1; y++) {
+        Attributes<N> v = p.at (x0, y);
+        for (int x = x0; x < x1; x += group_size) {
+          int const run = std::min (group_size, x1 - x);
+          if (full)
+            std::fill (cover, cover + run, msaa.all ());
+          else
+            sample_cover (e, samples, x, y, run, cover);
+          group (x, y, v, cover, run, visible);
+        }
+      }
+      depth.drawn (x0, y0, x1, y1);
+    }
+  }
+}
+
+// draw_triangle for a multisampled canvas. attributes are taken at pixel
+// centres, even where only samples off the centre are covered, and depth
+// at each sample
+template<typename T, typename L, size_t N, typename Shader, typename Depth>
+void draw_triangle (
+  Image<T, L>& out,
+  Rect const clip,
+  P2fx const a, P2fx const b, P2fx const c,
+  Attributes<N> const& aa, Attributes<N> const& ba, Attributes<N> const& ca,
+  Shader const& shader,
+  Depth const& depth,
+  MsaaWrite<L> const& write)
+{
+  MsaaBuffer<L>& msaa = *write.buffer;
+  Rect r;
+  if (!triangle_rect (out, a, b, c, r, msaa_margin))
+    return;
+  r = intersect (r, clip);
+  if (r.empty ())
+    return;
+  if (!in_guard_band (a, b, c)) {
+    draw_clipped (out, clip, a, b, c, aa, ba, ca, shader, depth, write);
+    return;
+  }
+  thread_stats ().triangle_draws++;
+
+  float const k = float (subpixel_one) / wf (a, b, c);
+  P2i32 const origin { r.x0 - out.width () / 2, out.height () / 2 - r.y0 };
+  Edge<i64> const e[3] = {
+    make_edge (b, c, origin),
+    make_edge (c, a, origin),
+    make_edge (a, b, origin)
+  };
+  Planes<N> const p = attribute_planes (e, k, aa, ba, ca);
+
+  // each sample's edges, which differ only in their values at the origin
+  int const samples = msaa.samples ();
+  Edge<i64> se[msaa_max_samples][3], lo[3] = { e[0], e[1], e[2] }, hi[3] = { e[0], e[1], e[2] };
+  for (int s = 0; s != samples; s++) {
+    P2i32 const d = msaa.offset (s);
+    se[s][0] = make_edge (b, c, origin, d);
+    se[s][1] = make_edge (c, a, origin, d);
+    se[s][2] = make_edge (a, b, origin, d);
+    for (int i = 0; i != 3; i++) {
+      lo[i].w = s? std::min (lo[i].w, se[s][i].w) : se[s][i].w;
+      hi[i].w = s? std::max (hi[i].w, se[s][i].w) : se[s][i].w;
+    }
+  }
+
+  auto const plane = depth_plane (depth, r, e, k).with_samples (msaa);
+  bool fits = true;
+  for (int i = 0; i != 3; i++)
+    fits = fits && fits_i32 (lo[i], r.width (), r.height ()) && fits_i32 (hi[i], r.width (), r.height ());
+
+  if (fits) {
+    Edge<i32> narrow_se[msaa_max_samples][3];
+    for (int s = 0; s != samples; s++) {
+      for (int i = 0; i != 3; i++)
+        narrow_se[s][i] = narrow (se[s][i]);
+    }
+    Edge<i32> const
+      narrow_lo[3] = { narrow (lo[0]), narrow (lo[1]), narrow (lo[2]) },
+      narrow_hi[3] = { narrow (hi[0]), narrow (hi[1]), narrow (hi[2]) };
+    draw_samples (out, r, narrow_se, narrow_lo, narrow_hi, p, shader, plane, msaa);
+  }
+  else {
+    draw_samples (out, r, se, lo, hi, p, shader, plane, msaa);
+  }
+}
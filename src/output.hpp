@@ -0,0 +1,120 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined (__SSSE3__)
+#include <immintrin.h>
+#endif
+
+#include "pixel.hpp"
+
+// unbuffered output to a file, in as few system calls as the caller
+// manages. a path of "-" means stdout, so output can be piped
+class Output {
+  int  fd;
+  bool owned;
+  std::string path;
+
+  std::system_error error (char const* what) const {
+    return std::system_error (errno, std::generic_category (), std::string (what) + " " + path);
+  }
+
+public:
+  explicit Output (char const* path) :
+    path (path)
+  {
+    if (!strcmp (path, "-")) {
+      fd = STDOUT_FILENO;
+      owned = false;
+    }
+    else {
+      fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      owned = true;
+      if (fd < 0)
+        throw error ("Can't create");
+    }
+  }
+
+  ~Output () {
+    if (owned)
+      close (fd);
+  }
+
+  Output (Output const&) = delete;
+  Output& operator = (Output const&) = delete;
+
+  // gathers several buffers into one call, looping on short writes
+  void write (iovec* parts, int count) {
+    while (count) {
+      ssize_t done = ::writev (fd, parts, std::min (count, IOV_MAX));
+      if (done < 0) {
+        if (errno == EINTR)
+          continue;
+        throw error ("Can't write");
+      }
+
+      // skip past what was written
+      for (; count && size_t (done) >= parts->iov_len; parts++, count--)
+        done -= parts->iov_len;
+      if (count) {
+        parts->iov_base = static_cast<char*> (parts->iov_base) + done;
+        parts->iov_len -= done;
+      }
+    }
+  }
+
+  void write (void const* data, size_t size) {
+    iovec part { const_cast<void*> (data), size };
+    write (&part, 1);
+  }
+
+  // overwrite what's at offset in the file, leaving the rest be. files
+  // only, as pipes can't seek
+  void write_at (void const* data, size_t size, off_t offset) {
+    char const* bytes = static_cast<char const*> (data);
+    while (size) {
+      ssize_t const done = ::pwrite (fd, bytes, size, offset);
+      if (done < 0) {
+        if (errno == EINTR)
+          continue;
+        throw error ("Can't write");
+      }
+      bytes  += done;
+      size   -= done;
+      offset += done;
+    }
+  }
+};
+
+// drop the alpha channel from a run of pixels
+static inline void pack_rgb (uint8_t* out, Pixelu8 const* in, size_t count) {
+  size_t i = 0;
+
+#if defined (__SSSE3__)
+  // four pixels per shuffle. each store writes four bytes past the twelve
+  // it means to, so stop while there's still room for them
+  __m128i const rgb = _mm_setr_epi8 (0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  for (; i + 6 <= count; i += 4) {
+    __m128i const px = _mm_loadu_si128 (reinterpret_cast<__m128i const*> (in + i));
+    _mm_storeu_si128 (reinterpret_cast<__m128i*> (out + i*3), _mm_shuffle_epi8 (px, rgb));
+  }
+#endif
+
+  for (; i != count; i++) {
+    out[i*3+0] = in[i].r;
+    out[i*3+1] = in[i].g;
+    out[i*3+2] = in[i].b;
+  }
+}
+
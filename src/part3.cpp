@@ -1,23 +1,70 @@
 
+#include <atomic>
+#include <cstdio>
+#include <exception>
+#include <mutex>
+#include <string>
 #include <limits>
+#include <cstdlib>
 #include <cstring>
 #include <stdexcept>
 #include <iostream>
 #include <system_error>
 #include <cassert>
+#include <chrono>
 #include <vector>
 #include <fstream>
-#include <sstream>
+#include <memory>
+#include <thread>
 
 #include "vector.hpp"
+#include "encode.hpp"
 #include "image.hpp"
+#include "output.hpp"
+#include "pipeline.hpp"
+#include "rasterize.hpp"
+#include "decode.hpp"
+#include "depth.hpp"
 #include "draw_triangle.hpp"
+#include "scene.hpp"
+#include "scene_file.hpp"
+#include "session.hpp"
+#include "script.hpp"
+#include "texture.hpp"
+#include "tiles.hpp"
+#include "transform.hpp"
+#include "worker_pool.hpp"
+#include "batch.hpp"
 
 // program options
 class Options {
 public:
-//char const* script_path = nullptr;
+  char const* script_path = nullptr;
   char const* output_path = "out.ppm";
+  char const* scene_path = nullptr;
+  char const* format = nullptr;
+  char const* layout = "linear";
+  char const* texture_path = nullptr;
+  char const* trace_path = nullptr;
+  char const* batch_path = nullptr;
+  char const* filter = "bilinear";
+  char const* blend = "replace";
+  std::vector<char const*> revision_paths; // redrawn in turn over the script, for --revise
+  bool premultiply = false;
+  bool offscreen = false;
+  bool reorder = false;
+  bool deferred = false;
+  bool spin = false;
+  float angle = 0;  // of the spinning scene, in degrees
+  float rotate = 0; // degrees anticlockwise, and scale, for 2d scenes
+  float zoom = 1;
+  int samples = 1;
+  int first_frame = 0, last_frame = -1; // for --frames, when last_frame >= first_frame
+  int parse_runs = 0;
+  int state_runs = 0;
+  bool timings = false;
+  bool stats = false;
+  int threads = std::max (1u, std::thread::hardware_concurrency ());
 };
 
 // extract program options from command line arguments
@@ -28,340 +75,707 @@ Options parse_options (char const** args, int arg_count) {
     char const* arg = args[i];
 
     if (!strcmp ("--output", arg) || !strcmp ("-o", arg)) {
-      if (++i == arg_count || args[i][0] == '-')
+      // "-" alone is stdout
+      if (++i == arg_count || (args[i][0] == '-' && args[i][1]))
         throw std::runtime_error ("Need output path");
       opts.output_path = args[i];
     }
-  /*else {
+    else if (!strcmp ("--threads", arg) || !strcmp ("-j", arg)) {
+      if (++i == arg_count || (opts.threads = atoi (args[i])) <= 0)
+        throw std::runtime_error ("Need a positive thread count");
+    }
+    else if (!strcmp ("--write-scene", arg)) {
+      if (++i == arg_count || args[i][0] == '-')
+        throw std::runtime_error ("Need scene path");
+      opts.scene_path = args[i];
+    }
+    else if (!strcmp ("--format", arg) || !strcmp ("-f", arg)) {
+      if (++i == arg_count || args[i][0] == '-')
+        throw std::runtime_error ("Need format name");
+      opts.format = args[i];
+    }
+    else if (!strcmp ("--layout", arg)) {
+      if (++i == arg_count || args[i][0] == '-')
+        throw std::runtime_error ("Need layout name");
+      opts.layout = args[i];
+      if (strcmp (opts.layout, "linear") && strcmp (opts.layout, "tiled") && strcmp (opts.layout, "morton"))
+        throw std::runtime_error (std::string ("Unknown layout ") + opts.layout);
+    }
+    else if (!strcmp ("--texture", arg) || !strcmp ("-t", arg)) {
+      if (++i == arg_count || args[i][0] == '-')
+        throw std::runtime_error ("Need texture path");
+      opts.texture_path = args[i];
+    }
+    else if (!strcmp ("--filter", arg)) {
+      if (++i == arg_count || args[i][0] == '-')
+        throw std::runtime_error ("Need filter name");
+      opts.filter = args[i];
+      filter_named (opts.filter);
+    }
+    else if (!strcmp ("--blend", arg)) {
+      if (++i == arg_count || args[i][0] == '-')
+        throw std::runtime_error ("Need blend mode");
+      opts.blend = args[i];
+      blend_named (opts.blend);
+    }
+    else if (!strcmp ("--premultiply", arg)) {
+      opts.premultiply = true;
+    }
+    else if (!strcmp ("--msaa", arg)) {
+      if (++i == arg_count || ((opts.samples = atoi (args[i])) != 1 && opts.samples != 4 && opts.samples != 8))
+        throw std::runtime_error ("Need 1, 4 or 8 samples");
+    }
+    else if (!strcmp ("--reorder", arg)) {
+      opts.reorder = true;
+    }
+    else if (!strcmp ("--deferred", arg)) {
+      opts.deferred = true;
+    }
+    else if (!strcmp ("--spin", arg)) {
+      if (++i == arg_count)
+        throw std::runtime_error ("Need an angle");
+      opts.spin = true;
+      opts.angle = float (atof (args[i]));
+    }
+    else if (!strcmp ("--rotate", arg)) {
+      if (++i == arg_count)
+        throw std::runtime_error ("Need an angle");
+      opts.rotate = float (atof (args[i]));
+    }
+    else if (!strcmp ("--zoom", arg)) {
+      if (++i == arg_count || (opts.zoom = float (atof (args[i]))) <= 0)
+        throw std::runtime_error ("Need a positive zoom");
+    }
+    else if (!strcmp ("--offscreen", arg)) {
+      opts.offscreen = true;
+    }
+    else if (!strcmp ("--batch", arg)) {
+      if (++i == arg_count || args[i][0] == '-')
+        throw std::runtime_error ("Need batch list path");
+      opts.batch_path = args[i];
+    }
+    else if (!strcmp ("--frames", arg)) {
+      if (++i == arg_count || sscanf (args[i], "%d-%d", &opts.first_frame, &opts.last_frame) != 2 || opts.first_frame > opts.last_frame)
+        throw std::runtime_error ("Need a frame range, first-last");
+    }
+    else if (!strcmp ("--revise", arg)) {
+      if (++i == arg_count || args[i][0] == '-')
+        throw std::runtime_error ("Need revision path");
+      opts.revision_paths.push_back (args[i]);
+    }
+    else if (!strcmp ("--timings", arg)) {
+      opts.timings = true;
+    }
+    else if (!strcmp ("--stats", arg)) {
+      opts.stats = true;
+    }
+    else if (!strcmp ("--trace", arg)) {
+      if (++i == arg_count || args[i][0] == '-')
+        throw std::runtime_error ("Need trace path");
+      opts.trace_path = args[i];
+    }
+    else if (!strcmp ("--bench-states", arg)) {
+      if (++i == arg_count || (opts.state_runs = atoi (args[i])) <= 0)
+        throw std::runtime_error ("Need a positive run count");
+    }
+    else if (!strcmp ("--bench-parse", arg)) {
+      if (++i == arg_count || (opts.parse_runs = atoi (args[i])) <= 0)
+        throw std::runtime_error ("Need a positive run count");
+    }
+    else {
       if (!strcmp ("--script", arg) || !strcmp ("-s", arg)) {
         if (++i == arg_count || args[i][0] == '-')
           throw std::runtime_error ("Need script path");
       }
       opts.script_path = args[i];
-    }*/
+    }
   }
 
-/*if (!opts.script_path)
-    throw std::runtime_error ("No script specified");*/
+  if (opts.parse_runs && !opts.script_path)
+    throw std::runtime_error ("No script specified");
+  if ((opts.offscreen || opts.spin) && opts.script_path)
+    throw std::runtime_error ("Built-in scenes take no script");
+  bool const batch = opts.batch_path || opts.last_frame >= opts.first_frame;
+  if (opts.batch_path && opts.last_frame >= opts.first_frame)
+    throw std::runtime_error ("Batch from a list or a frame range, not both");
+  if (batch && (opts.offscreen || opts.spin || opts.scene_path || opts.state_runs || opts.parse_runs))
+    throw std::runtime_error ("Batches only render scripts and scene files");
+  if (batch && strcmp (opts.layout, "linear"))
+    throw std::runtime_error ("Batches render linear canvases only");
+  if (opts.batch_path && opts.script_path)
+    throw std::runtime_error ("Batch lists name their own scripts");
+  if (opts.last_frame >= opts.first_frame && !opts.script_path)
+    throw std::runtime_error ("Frame ranges need a script path pattern");
+  if (!opts.revision_paths.empty ()) {
+    if (batch || opts.scene_path || opts.state_runs || opts.parse_runs)
+      throw std::runtime_error ("Revisions only render one scene over and over");
+    if (strcmp (opts.layout, "linear"))
+      throw std::runtime_error ("Revisions render linear canvases only");
+    if (!strcmp (opts.output_path, "-") || (opts.format? format_named (opts.format) : format_for (opts.output_path)) != Format::ppm)
+      throw std::runtime_error ("Revisions update a ppm file in place");
+  }
 
   return opts;
 }
 
-// in-memory representation of scene described by script
-struct Vertex {
-  P2i32 position;
-  P2i32 uv;
-};
-
-struct Triangle {
-  Vertex verts[3];
-  Triangle (Vertex a, Vertex b, Vertex c) : verts{a,b,c} { }
-};
-
-/*struct Script {
-  int width, height;
-  std::vector<Triangle> triangles;
-};*/
-
-// tokens - used for lexical analysis
-/*enum class TokenType {
-  word,
-  number,
-  colour,
-  line_end
+static constexpr uint8_t const tex[8][8] = {
+  { 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f },
+  { 0x7f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7f },
+  { 0x7f, 0x00, 0x00, 0xff, 0xff, 0x00, 0x00, 0x7f },
+  { 0x7f, 0x00, 0xff, 0xff, 0xff, 0xff, 0x00, 0x7f },
+  { 0x7f, 0x00, 0xff, 0xff, 0xff, 0xff, 0x00, 0x7f },
+  { 0x7f, 0x00, 0x00, 0xff, 0xff, 0x00, 0x00, 0x7f },
+  { 0x7f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7f },
+  { 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f }
 };
 
-struct Token {
-  TokenType type;
-  char const* spelling;
-  char const* end;
-  size_t length () const {
-    return end - spelling;
+// the texture for textured scenes, when none is given
+Image<Pixelu8> builtin_texture () {
+  Image<Pixelu8> image (8, 8);
+  for (int y = 0; y != 8; y++) {
+    for (int x = 0; x != 8; x++)
+      image.at (x, y) = Pixelu8 (tex[y][x], tex[y][x], tex[y][x]);
   }
-};
-
-// paranoid character class checking for lexer
-bool is_letter (char c) {
-  return (c>='a' && c<='z') || (c>='A' && c<='Z');
+  return image;
 }
 
-bool is_digit (char c) {
-  return c>='0' && c<='9';
+// built-in scene, drawn when no script is given
+Script demo_scene () {
+  Script script;
+  script.width = script.height = 1024;
+  script.shading = Shading::texture;
+  Triangle const triangles[] = {
+    Triangle { { snap (-400,-400), { 0, 0} }, { snap ( 400,-400), {64, 0} }, { snap (-400, 400), {0, 64} } },
+    Triangle { { snap ( 400, 400), {64,64} }, { snap (-400, 400), { 0,64} }, { snap ( 400,-400), {64, 0} } }
+/*  Triangle { { snap (   0, -400), {0,0} }, { snap (  120, -160), {64,0} }, { snap ( -120, -160), {64,64} } },
+    Triangle { { snap (-380, -124), {0,0} }, { snap ( -120, -160), {64,0} }, { snap ( -190,   60), {64,64} } },
+    Triangle { { snap ( 380, -124), {0,0} }, { snap (  190,   60), {64,0} }, { snap (  120, -160), {64,64} } },
+    Triangle { { snap (-236,  324), {0,0} }, { snap ( -190,   60), {64,0} }, { snap (    0,  200), {64,64} } },
+    Triangle { { snap ( 236,  324), {0,0} }, { snap (    0,  200), {64,0} }, { snap (  190,   60), {64,64} } },
+    Triangle { { snap (   0,    0), {0,0} }, { snap ( -120, -160), {64,0} }, { snap (  120, -160), {64,64} } },
+    Triangle { { snap (   0,    0), {0,0} }, { snap ( -190,   60), {64,0} }, { snap ( -120, -160), {64,64} } },
+    Triangle { { snap (   0,    0), {0,0} }, { snap (  120, -160), {64,0} }, { snap (  190,   60), {64,64} } },
+    Triangle { { snap (   0,    0), {0,0} }, { snap (    0,  200), {64,0} }, { snap ( -190,   60), {64,64} } },
+    Triangle { { snap (   0,    0), {0,0} }, { snap (  190,   60), {64,0} }, { snap (    0,  200), {64,64} } }*/
+  };
+  for (Triangle const& tri : triangles)
+    script.add (tri);
+  return script;
 }
 
-bool is_hex_digit (char c) {
-  return is_digit (c) || (c>='a' && c<= 'f') || (c>='A' && c<='F');
-}
+// built-in scene that's mostly off the canvas, as a zoomed-in view is: a
+// mesh spread far past the canvas, of which only a few triangles land on
+// it, over a fan of huge triangles reaching past the guard band
+Script offscreen_scene () {
+  Script script;
+  script.width = script.height = 1024;
+  script.shading = Shading::colour;
+
+  // as far out as fixed point reaches, whatever its precision
+  float const far = float (1 << (30 - subpixel_bits));
+  int const wedges = 12;
+  for (int i = 0; i != wedges; i++) {
+    float const
+      t0 = 6.2831853f * i / wedges,
+      t1 = 6.2831853f * (i+1) / wedges,
+      shade = float (i) / wedges;
+    Vertex o, a, b;
+    o.position = snap (0, 0);
+    a.position = snap (far * std::cos (t0), far * std::sin (t0));
+    b.position = snap (far * std::cos (t1), far * std::sin (t1));
+    o.colour = a.colour = b.colour = Pixelf (shade, 0.5f, 1 - shade);
+    script.add (Triangle { o, a, b });
+  }
 
-// avoid strchr - it considers the terminating null as part of the string
-bool contains (char const* set, char c) {
-  while (*set) {
-    if (*set++ == c)
-      return true;
+  // half of each cell of a 256x256 mesh, 64 canvases across
+  int const cells = 256;
+  float const cell = 256, from = -cells * cell / 2;
+  for (int y = 0; y != cells; y++) {
+    for (int x = 0; x != cells; x++) {
+      float const x0 = from + x*cell, y0 = from + y*cell;
+      Vertex a, b, c;
+      a.position = snap (x0, y0);
+      b.position = snap (x0 + cell, y0);
+      c.position = snap (x0, y0 + cell);
+      a.colour = Pixelf (float (x) / cells, float (y) / cells, 0);
+      b.colour = Pixelf (float (x+1) / cells, float (y) / cells, 0);
+      c.colour = Pixelf (float (x) / cells, float (y+1) / cells, 0);
+      script.add (Triangle { a, b, c });
+    }
   }
-  return false;
+  return script;
 }
 
-// tokenizes source code
-std::vector<Token> lex_script (char const* source, size_t length) {
-  std::vector<Token> tokens;
-
-  char const* end = source + length;
-  char const* ptr = source;
-
-  while (ptr != end) {
-    char const* begin = ptr;
-
-    // skip whitespace
-    if (contains (" \t", *ptr)) {
-      ptr++;
-      continue;
+// built-in 3d scene: a cube turned by an angle in degrees, over a floor
+// that runs from behind the eye into the distance, so it's cut at the
+// near plane, all seen in perspective
+Script spin_scene (float degrees) {
+  Script script;
+  script.width = script.height = 1024;
+  script.shading = Shading::texture;
+  Matrix4 const camera = Matrix4::perspective (800, 0.5f, 100);
+
+  // the floor, a texture's width to a unit
+  Model floor;
+  int const t = 8;
+  uint32_t const
+    a = floor.vertex (-10, -1.5f, -5, P2i32 {   0,    0 }),
+    b = floor.vertex ( 10, -1.5f, -5, P2i32 { 20*t,   0 }),
+    c = floor.vertex ( 10, -1.5f, 40, P2i32 { 20*t, 45*t }),
+    d = floor.vertex (-10, -1.5f, 40, P2i32 {   0,  45*t });
+  floor.triangle (a, b, c);
+  floor.triangle (a, c, d);
+  project_model (floor, camera, script);
+
+  // the cube's faces are its near face turned to each side, so they all
+  // wind the same way seen from outside
+  Model cube;
+  float const half_pi = 1.5707963f;
+  Matrix4 const sides[6] = {
+    Matrix4::identity (),
+    Matrix4::rotation (1, half_pi), Matrix4::rotation (1, 2*half_pi), Matrix4::rotation (1, 3*half_pi),
+    Matrix4::rotation (0, half_pi), Matrix4::rotation (0, -half_pi)
+  };
+  float const near[4][3] = { { -1, -1, -1 }, { 1, -1, -1 }, { 1, 1, -1 }, { -1, 1, -1 } };
+  P2i32 const uvs[4] = { { 0, 0 }, { t, 0 }, { t, t }, { 0, t } };
+  for (Matrix4 const& side : sides) {
+    uint32_t corner[4];
+    for (int i = 0; i != 4; i++) {
+      float const* p = near[i];
+      auto row = [&] (int r) { return side.m[r][0]*p[0] + side.m[r][1]*p[1] + side.m[r][2]*p[2]; };
+      corner[i] = cube.vertex (row (0), row (1), row (2), uvs[i]);
     }
+    cube.triangle (corner[0], corner[1], corner[2]);
+    cube.triangle (corner[0], corner[2], corner[3]);
+  }
+  float const angle = degrees * (half_pi / 90);
+  project_model (cube, camera * Matrix4::translation (0, 0, 6) * Matrix4::rotation (1, angle) * Matrix4::rotation (0, angle / 2), script);
+  return script;
+}
 
-    // lex line endings
-    if (contains ("\r\n", *ptr)) {
-      ptr++;
-
-      // handle crlf
-      if (ptr != end && *begin == '\r' && *ptr == '\n')
-        ptr++;
+// rows of a finished strip, ready to encode. linear canvases are
+// encoded as they are; tiled ones are first copied out to linear
+static inline Image<Pixelu8> const& strip_rows (Image<Pixelu8> const& canvas, Image<Pixelu8>&, int, int) {
+  return canvas;
+}
 
-      tokens.push_back (Token { TokenType::line_end, begin, ptr });
-      continue;
-    }
+template<typename Layout>
+Image<Pixelu8> const& strip_rows (Image<Pixelu8, Layout> const& canvas, Image<Pixelu8>& linear, int y0, int y1) {
+  detile (linear, canvas, Rect { 0, y0, canvas.width (), y1 });
+  return linear;
+}
 
-    // skip comments
-    if (*ptr == '\'') {
-      do { ptr++; } while (ptr != end && !contains ("\r\n", *ptr));
-      continue;
-    }
+// render a scene on a canvas of the given layout, encoding strips as
+// they finish
+template<typename Layout>
+void render (WorkerPool& pool, BufferPool& buffers, SceneView const& scene, RenderSetup const& setup, StripWriter& writer) {
+  Image<Pixelu8> linear;
+  if (!Layout::row_major)
+    linear = Image<Pixelu8> (scene.width, scene.height, Uninitialized (), &buffers);
+
+  rasterize<Layout> (pool, scene, setup, [&] (Image<Pixelu8, Layout> const& image, int strip, int y0, int y1) {
+    writer.encode (strip_rows (image, linear, y0, y1), strip, y0, y1);
+  }, &buffers);
+}
 
-    // lex words
-    if (is_letter (*ptr)) {
-      do { ptr++; } while (ptr != end && is_letter (*ptr));
-      tokens.push_back (Token { TokenType::word, begin, ptr });
-      continue;
-    }
+// parse a script repeatedly, reporting throughput
+void bench_parse (char const* path, int runs) {
+  struct Counter {
+    size_t count = 0;
+    void canvas (int, int) { }
+    void depth_test () { }
+    void vertices (Vertex const*, size_t) { }
+    void triangles (uint32_t const*, size_t n) { count += n; }
+  };
 
-    // lex numbers
-    if (is_digit (*ptr) || contains ("+-", *ptr)) {
-      do { ptr++; } while (ptr != end && is_digit (*ptr));
-      tokens.push_back (Token { TokenType::number, begin, ptr });
-      continue;
-    }
+  MappedFile file (path);
+  Counter counter;
+  auto const start = std::chrono::steady_clock::now ();
+  for (int i = 0; i != runs; i++)
+    parse_script (file.data (), file.size (), counter);
+  std::chrono::duration<double> const took = std::chrono::steady_clock::now () - start;
 
-    // lex colours
-    if (*ptr == '#') {
-      do { ptr++; } while (ptr != end && is_hex_digit (*ptr));
-      if (ptr - begin != 7) // one # plus six digits
-        throw std::runtime_error ("Invalid colour");
-      tokens.push_back (Token { TokenType::colour, begin, ptr });
-      continue;
-    }
+  double const megabytes = double (file.size ()) * runs / (1 << 20);
+  std::cout << counter.count / runs << " triangles, "
+            << megabytes / took.count () << " MB/s\n";
+}
 
-    throw std::runtime_error ("Invalid characters in script");
-  }
+// render a scene repeatedly through the specialized drawers and through
+// the generic one, reporting time per frame. nothing is written out.
+// with deferred shading, that's measured against the specialized drawers
+// shading as they go instead, and images needn't match to the bit
+void bench_states (WorkerPool& pool, BufferPool& buffers, SceneView const& scene, RenderSetup setup, int runs) {
+  using Clock = std::chrono::steady_clock;
+  auto none = [] (Image<Pixelu8> const&, int, int, int) { };
+  bool const deferred = setup.deferred;
+
+  auto time = [&] (bool generic, Image<Pixelu8>& last) {
+    setup.generic  = generic && !deferred;
+    setup.deferred = deferred && !generic;
+    auto const start = Clock::now ();
+    for (int i = 0; i != runs; i++)
+      last = rasterize<Linear> (pool, scene, setup, none, &buffers);
+    std::chrono::duration<double, std::milli> const took = Clock::now () - start;
+    return took.count () / runs;
+  };
 
-  return tokens;
-}
+  Image<Pixelu8> specialized, generic;
+  double const fast = time (false, specialized), slow = time (true, generic);
 
-// parses an integer, and returns its value
-int parse_number (char const* spelling, char const* end) {
-  assert (end > spelling);
+  bool same = true;
+  for (int y = 0; y != scene.height && same; y++)
+    same = !memcmp (specialized.row (y), generic.row (y), scene.width * sizeof (Pixelu8));
 
-  std::istringstream stream (std::string (spelling, end));
-  int value = 0;
-  stream >> value;
-  return value;
+  std::cout << "render state " << render_state (scene, setup) << ": "
+            << (deferred? "deferred " : "specialized ") << fast << " ms, "
+            << (deferred? "forward " : "generic ") << slow << " ms per frame"
+            << (same? "" : ", images differ") << "\n";
 }
 
-// parse a #rrggbb style hex colour
-Pixelf parse_colour (char const* spelling, char const* end) {
-  assert (end - spelling == 7);
-
-  std::istringstream stream (std::string (spelling+1, end));
-  int raw = 0;
-  stream >> std::hex >> raw;
+// print counters for --stats, over a render of so many pixels, and write
+// the trace for --trace. to stderr, since the image may be going to stdout
+void report_stats (Options const& opts, double pixels) {
+  if (opts.stats && !RASTER_STATS)
+    std::cerr << "Built without stats\n";
+  else if (opts.stats) {
+    StatsRegistry& registry = StatsRegistry::get ();
+    RasterStats const stats = registry.total ();
+    std::cerr << stats
+              << "overdraw:     " << double (stats.pixels_shaded) / pixels << "\n";
+
+    // and what each thread did
+    registry.each ([] (int index, RasterStats const& stats) {
+      std::cerr << "thread " << index << ":     "
+                << stats.triangles_submitted << " triangles, "
+                << stats.triangle_draws << " tile draws, "
+                << stats.pixels_shaded << " pixels shaded";
+      for (int s = 0; s != stage_count; s++) {
+        if (stats.stage_ns[s])
+          std::cerr << ", " << stage_names[s] << " " << double (stats.stage_ns[s]) * 1e-6 << " ms";
+      }
+      std::cerr << "\n";
+    });
+  }
 
-  Pixelf colour;
-  for (int i = 0; i != 3; i++) {
-    uint8_t bits = (raw >> ((2-i)*8)) & 0xff;
-    colour.channels[i] = int (bits) * (1.0f/255);
+  if (opts.trace_path) {
+    std::ofstream trace (opts.trace_path);
+    if (!trace)
+      throw std::runtime_error (std::string ("Can't create ") + opts.trace_path);
+    StatsRegistry::get ().write_trace (trace);
   }
-  return colour;
 }
 
-// for reporting parse errors
-class ParseError : public std::runtime_error {
-public:
-  template<typename Arg>
-  ParseError (Arg&& arg) : std::runtime_error (std::forward<Arg> (arg)) { }
+// scripts can be turned and scaled about the canvas centre on the way in
+void turn_script (Options const& opts, Script& script) {
+  if (opts.rotate == 0 && opts.zoom == 1)
+    return;
+  float const
+    r = opts.rotate * (3.14159265f / 180),
+    c = opts.zoom * std::cos (r),
+    s = opts.zoom * std::sin (r);
+  transform_script (script, Matrix4::affine (c, -s, s, c, 0, 0));
+}
+
+// a scene read from a path: binary scenes are mapped as they are,
+// scripts are parsed, and turned if asked
+struct LoadedScene {
+  Script script;
+  std::unique_ptr<SceneFile> file;
+  SceneView view;
 };
 
-// parses a #colour x y vertex from the given tokens
-Token const* parse_vertex (Vertex& vertex, Token const* token, Token const* end) {
-  // colour first
-  if (token == end || token->type != TokenType::colour)
-    throw ParseError ("Expected vertex colour");
-  vertex.colour = parse_colour (token->spelling, token->end);
-  token++;
-
-  // then coords
-  for (int i = 0; i != 2; i++) {
-    if (token == end || token->type != TokenType::number)
-      throw ParseError ("Expected vertex coordinate");
-    vertex.position.components[i] = parse_number (token->spelling, token->end);
-    token++;
+std::unique_ptr<LoadedScene> load_scene (char const* path, Options const& opts) {
+  std::unique_ptr<LoadedScene> loaded (new LoadedScene);
+  if (is_scene_file (path)) {
+    if (opts.rotate != 0 || opts.zoom != 1)
+      throw std::runtime_error ("Only scripts can be rotated or zoomed");
+    loaded->file.reset (new SceneFile (path));
+    loaded->view = loaded->file->view ();
   }
-
-  return token;
+  else {
+    loaded->script = load_script (path, opts.reorder);
+    turn_script (opts, loaded->script);
+    loaded->view = loaded->script.view ();
+  }
+  return loaded;
 }
 
-// parses a triangle command
-Token const* parse_triangle (Script& script, Token const* arguments, Token const* end) {
-  Triangle tri;
-  Token const* ptr = arguments;
-
-  // three vertices
-  for (int i = 0; i != 3; i++)
-    ptr = parse_vertex (tri.verts[i], ptr, end);
-
-  script.triangles.push_back (tri);
-  return ptr;
+// the scene to draw without a script: the off-screen or spinning one if
+// asked for, otherwise the demo. turned like scripts
+std::unique_ptr<LoadedScene> built_in_scene (Options const& opts) {
+  std::unique_ptr<LoadedScene> built (new LoadedScene);
+  if (opts.offscreen)
+    built->script = offscreen_scene ();
+  else if (opts.spin)
+    built->script = spin_scene (opts.angle);
+  else
+    built->script = demo_scene ();
+  turn_script (opts, built->script);
+  built->view = built->script.view ();
+  return built;
 }
 
-// parses a canvas command
-Token const* parse_canvas (Script& script, Token const* arguments, Token const* end) {
-  Token const* width_spec = arguments;
-  if (width_spec == end || width_spec->type != TokenType::number)
-    throw ParseError ("Expected width specification in canvas command");
-  script.width = parse_number (width_spec->spelling, width_spec->end);
-
-  Token const* height_spec = arguments+1;
-  if (height_spec == end || height_spec->type != TokenType::number)
-    throw ParseError ("Expect height specification in canvas command");
-  script.height = parse_number (height_spec->spelling, height_spec->end);
+// render a scene through a session, write it out as a ppm, then draw
+// each revision in turn over it, rewriting only the rows of tiles that
+// changed, and only as much of those as did. returns the pixels drawn,
+// counting the whole of the rect each revision changed
+double render_revisions (WorkerPool& pool, BufferPool& buffers, SceneView const& scene, RenderSetup const& setup, Options const& opts) {
+  using Clock = std::chrono::steady_clock;
+  using Milliseconds = std::chrono::duration<double, std::milli>;
+  RenderSession<Linear> session (pool, setup, &buffers);
+  session.update (scene);
+
+  Output out (opts.output_path);
+  {
+    std::vector<uint8_t> encoded;
+    encode_header (Format::ppm, encoded, scene.width, scene.height);
+    encode_strip (Format::ppm, encoded, session.image (), 0, scene.height);
+    out.write (encoded.data (), encoded.size ());
+  }
 
-  return arguments+2;
+  double pixels = double (scene.width) * scene.height;
+  for (char const* path : opts.revision_paths) {
+    std::unique_ptr<LoadedScene> revision;
+    {
+      StageTimer const timer (stage_parse);
+      revision = load_scene (path, opts);
+    }
+    if (revision->view.width != scene.width || revision->view.height != scene.height)
+      throw std::runtime_error (std::string ("Revisions must keep the canvas size: ") + path);
+
+    auto const start = Clock::now ();
+    Rect const changed = session.update (revision->view);
+    auto const drawn = Clock::now ();
+    for (Rect const& r : session.changed_rows ())
+      update_ppm (out, session.image (), r);
+    auto const written = Clock::now ();
+    pixels += double (changed.width ()) * changed.height ();
+
+    // to stderr, alongside the other timings
+    if (opts.timings) {
+      std::cerr << path << ": " << session.tiles_redrawn () << " tiles redrawn";
+      if (!changed.empty ())
+        std::cerr << ", " << changed.width () << "x" << changed.height () << " at " << changed.x0 << "," << changed.y0;
+      std::cerr << ", render " << Milliseconds (drawn - start).count () << " ms, "
+                << "output " << Milliseconds (written - drawn).count () << " ms\n";
+    }
+  }
+  return pixels;
 }
 
-// parse tokenized source into a script object
-Script parse_script (std::vector<Token> const& tokens) {
-  Script script;
-
-  Token const* token = tokens.data ();
-  Token const* end   = token + tokens.size ();
-
-  while (token != end) {
-    // skip blank lines
-    if (token->type == TokenType::line_end) {
-      token++;
+// render a batch of frames in a pipeline of three stages: a thread reads
+// the scene after the one being drawn, the workers draw, and another
+// thread encodes and writes the one before. stages hand on through
+// queues of one, so a few frames at most are in flight, and a batch
+// takes about as long as its slowest stage rather than the sum of them.
+// the workers, the texture and canvas memory carry over between frames.
+// a frame that fails stops the batch. returns the pixels drawn
+double render_batch (WorkerPool& pool, BufferPool& buffers, std::vector<BatchFrame> const& frames, Options const& opts) {
+  struct Drawn {
+    Image<Pixelu8> image;
+    std::string path;
+  };
+  StageQueue<std::unique_ptr<LoadedScene>> loaded (1);
+  StageQueue<Drawn> drawn (1);
+
+  // the first failure in any stage closes both queues, which winds the
+  // others down, and is rethrown once they have
+  std::mutex lock;
+  std::exception_ptr failure;
+  auto stage = [&] (auto const& run) {
+    try {
+      run ();
     }
-    // parse commands
-    else if (token->type == TokenType::word) {
-      if (!strncmp (token->spelling, "canvas", token->length ()))
-        token = parse_canvas (script, token+1, end);
-      else if (!strncmp (token->spelling, "triangle", token->length ()))
-        token = parse_triangle (script, token+1, end);
-      else
-        throw ParseError ("Unknown command");
-
-      // every command ends with a line break
-      if (token != end && token->type != TokenType::line_end)
-        throw ParseError ("Expected newline after command");
-      token++;
+    catch (...) {
+      std::lock_guard<std::mutex> guard (lock);
+      if (!failure)
+        failure = std::current_exception ();
+      loaded.close ();
+      drawn.close ();
     }
-    else {
-      throw ParseError ("Expected command");
+  };
+
+  std::thread reader ([&] {
+    stage ([&] {
+      for (BatchFrame const& frame : frames) {
+        std::unique_ptr<LoadedScene> scene;
+        {
+          StageTimer const timer (stage_parse);
+          scene = load_scene (frame.scene_path.c_str (), opts);
+        }
+        if (!loaded.push (std::move (scene)))
+          break;
+      }
+      loaded.close ();
+    });
+  });
+
+  // strips as a single render's, since qoi strips are encoded apart
+  std::thread writer ([&] {
+    stage ([&] {
+      Drawn frame;
+      while (drawn.pop (frame)) {
+        Format const format = opts.format? format_named (opts.format) : format_for (frame.path.c_str ());
+        Output out (frame.path.c_str ());
+        TileGrid const grid (frame.image.width (), frame.image.height ());
+        StripWriter strips (out, format, frame.image.width (), frame.image.height (), grid.rows);
+        for (int row = 0; row != grid.rows; row++) {
+          Rect const rows = grid.rect (row * grid.columns);
+          strips.encode (frame.image, row, rows.y0, rows.y1);
+        }
+        strips.finish ();
+        frame = Drawn ();
+      }
+    });
+  });
+
+  using Clock = std::chrono::steady_clock;
+  auto const start = Clock::now ();
+  double pixels = 0;
+  stage ([&] {
+    RenderSetup setup;
+    setup.filter      = filter_named (opts.filter);
+    setup.blend       = blend_named (opts.blend);
+    setup.premultiply = opts.premultiply;
+    setup.samples     = opts.samples;
+    setup.deferred    = opts.deferred;
+
+    std::unique_ptr<Texture> texture;
+    std::unique_ptr<LoadedScene> scene;
+    auto none = [] (Image<Pixelu8> const&, int, int, int) { };
+    for (size_t i = 0; loaded.pop (scene); i++) {
+      pixels += double (scene->view.width) * scene->view.height;
+      if (scene->view.shading == Shading::texture && !texture)
+        texture.reset (new Texture (opts.texture_path? load_image (opts.texture_path) : builtin_texture (), opts.premultiply));
+      setup.texture = texture.get ();
+      Drawn frame { rasterize<Linear> (pool, scene->view, setup, none, &buffers), frames[i].output_path };
+      scene.reset ();
+      if (!drawn.push (std::move (frame)))
+        break;
     }
+    drawn.close ();
+  });
+
+  reader.join ();
+  writer.join ();
+  if (failure)
+    std::rethrow_exception (failure);
+
+  if (opts.timings) {
+    std::chrono::duration<double, std::milli> const took = Clock::now () - start;
+    std::cerr << frames.size () << " frames in " << took.count () << " ms, "
+              << frames.size () / (took.count () * 1e-3) << " frames/s\n";
   }
-
-  return script;
-}
-*/
-// load a file in one go
-std::vector<char> load_file (char const* path) {
-  std::ifstream file (path);
-
-  file.seekg (0, std::ios_base::end);
-  auto size = file.tellg ();
-  file.seekg (0, std::ios_base::beg);
-  std::vector<char> buffer (size);
-
-  file.read (buffer.data (), size);
-  return buffer;
+  return pixels;
 }
 
-// load and process a script
-/*Script load_script (char const* path) {
-  auto source = load_file (path);
-  auto tokens = lex_script (source.data (), source.size ());
-  return parse_script (tokens);
-}*/
+int main (int arg_count, char const** args) try {
+  auto opts = parse_options (args, arg_count);
+  if (opts.parse_runs) {
+    bench_parse (opts.script_path, opts.parse_runs);
+    return 0;
+  }
 
-static constexpr uint8_t const tex[8][8] = {
-  { 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f },
-  { 0x7f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7f },
-  { 0x7f, 0x00, 0x00, 0xff, 0xff, 0x00, 0x00, 0x7f },
-  { 0x7f, 0x00, 0xff, 0xff, 0xff, 0xff, 0x00, 0x7f },
-  { 0x7f, 0x00, 0xff, 0xff, 0xff, 0xff, 0x00, 0x7f },
-  { 0x7f, 0x00, 0x00, 0xff, 0xff, 0x00, 0x00, 0x7f },
-  { 0x7f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7f },
-  { 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f }
-};
+  if (opts.trace_path) {
+    if (!RASTER_STATS)
+      throw std::runtime_error ("Built without stats, so can't trace");
+    StatsRegistry::get ().start_trace ();
+  }
 
-void draw_triangle (Image<Pixelu8>& canvas, Triangle const& tri) {
-  auto shader = [&tri] (float a, float b, float c) {
-    Point2<float> uv = tri.verts[0].uv*a + tri.verts[1].uv*b + tri.verts[2].uv*c;
-    uint8_t t = tex[7-(int(uv.y+.5f)&7)][int(uv.x+.5f)&7];
-    return Pixelu8{t,t,t};
-  };
+  if (opts.batch_path || opts.last_frame >= opts.first_frame) {
+    std::vector<BatchFrame> const frames = opts.batch_path?
+      read_batch_list (opts.batch_path) :
+      frame_range (opts.script_path, opts.output_path, opts.first_frame, opts.last_frame);
+    WorkerPool pool (opts.threads);
+    BufferPool buffers;
+    double const pixels = render_batch (pool, buffers, frames, opts);
+    report_stats (opts, pixels);
+    return 0;
+  }
 
-  draw_triangle (
-    canvas,
-    tri.verts[0].position,
-    tri.verts[1].position,
-    tri.verts[2].position,
-    shader
-  );
-}
+  // the built-in scenes, or one from a path as batches and revisions load
+  // theirs
+  std::unique_ptr<LoadedScene> loaded;
+  {
+    StageTimer const parsing (stage_parse);
+    if (opts.offscreen || opts.spin || !opts.script_path)
+      loaded = built_in_scene (opts);
+    else
+      loaded = load_scene (opts.script_path, opts);
+  }
+  SceneView const& scene = loaded->view;
 
-// compute an 8-bit image from a script object
-Image<Pixelu8> rasterize (int w, int h, std::vector<Triangle> const& triangles) {
-  Image<Pixelu8> canvas (w, h);
-  for (Triangle const& triangle : triangles)
-    draw_triangle (canvas, triangle);
-  return canvas;
-}
+  // convert rather than render
+  if (opts.scene_path) {
+    write_scene (opts.scene_path, scene);
+    return 0;
+  }
 
-// save image as a .ppm
-void write_image (char const* path, Image<Pixelu8> const& image) {
-  std::ofstream out (path, std::ios_base::binary);
-  out << "P6\n" << image.width () << " " << image.height () << "\n"
-      << "255\n";
-  for (Pixelu8 const& pixel : image)
-    out.write ((char const*) pixel.channels, 3);
-}
+  // textures are only built for scenes that use them, or whose revisions might
+  std::unique_ptr<Texture> texture;
+  if (scene.shading == Shading::texture || !opts.revision_paths.empty ())
+    texture.reset (new Texture (opts.texture_path? load_image (opts.texture_path) : builtin_texture (), opts.premultiply));
+  RenderSetup setup;
+  setup.texture     = texture.get ();
+  setup.filter      = filter_named (opts.filter);
+  setup.blend       = blend_named (opts.blend);
+  setup.premultiply = opts.premultiply;
+  setup.samples     = opts.samples;
+  setup.deferred    = opts.deferred;
+
+  using Clock = std::chrono::steady_clock;
+  WorkerPool pool (opts.threads);
+  BufferPool buffers;
+
+  if (opts.state_runs) {
+    bench_states (pool, buffers, scene, setup, opts.state_runs);
+    return 0;
+  }
 
-int main (int arg_count, char const** args) try {
-  auto opts = parse_options (args, arg_count);
-//auto script = load_script (opts.script_path);
-  std::vector<Triangle> tris {
-    Triangle { { {-400,-400}, { 0, 0} }, { { 400,-400}, {64, 0} }, { {-400, 400}, {0, 64} } },
-    Triangle { { { 400, 400}, {64,64} }, { {-400, 400}, { 0,64} }, { { 400,-400}, {64, 0} } }
-/*  Triangle { { {   0, -400}, {0,0} }, { {  120, -160}, {64,0} }, { { -120, -160}, {64,64} } },
-    Triangle { { {-380, -124}, {0,0} }, { { -120, -160}, {64,0} }, { { -190,   60}, {64,64} } },
-    Triangle { { { 380, -124}, {0,0} }, { {  190,   60}, {64,0} }, { {  120, -160}, {64,64} } },
-    Triangle { { {-236,  324}, {0,0} }, { { -190,   60}, {64,0} }, { {    0,  200}, {64,64} } },
-    Triangle { { { 236,  324}, {0,0} }, { {    0,  200}, {64,0} }, { {  190,   60}, {64,64} } },
-    Triangle { { {   0,    0}, {0,0} }, { { -120, -160}, {64,0} }, { {  120, -160}, {64,64} } },
-    Triangle { { {   0,    0}, {0,0} }, { { -190,   60}, {64,0} }, { { -120, -160}, {64,64} } },
-    Triangle { { {   0,    0}, {0,0} }, { {  120, -160}, {64,0} }, { {  190,   60}, {64,64} } },
-    Triangle { { {   0,    0}, {0,0} }, { {    0,  200}, {64,0} }, { { -190,   60}, {64,64} } },
-    Triangle { { {   0,    0}, {0,0} }, { {  190,   60}, {64,0} }, { {    0,  200}, {64,64} } }*/
-  };
-  auto image = rasterize (1024, 1024, tris);
-  write_image (opts.output_path, image);
+  if (!opts.revision_paths.empty ()) {
+    double const pixels = render_revisions (pool, buffers, scene, setup, opts);
+    report_stats (opts, pixels);
+    return 0;
+  }
+
+  // strips are compressed and written by the workers as they finish
+  // rendering them, so most output time overlaps the render
+  Format const format = opts.format? format_named (opts.format) : format_for (opts.output_path);
+  Output out (opts.output_path);
+  TileGrid const grid (scene.width, scene.height);
+
+  auto const start = Clock::now ();
+  StripWriter writer (out, format, scene.width, scene.height, grid.rows);
+  auto const headed = Clock::now ();
+  // tiled layouts are there to measure the cost of cache and tlb misses
+  if (!strcmp (opts.layout, "linear"))
+    render<Linear> (pool, buffers, scene, setup, writer);
+  else if (!strcmp (opts.layout, "tiled"))
+    render<Tiled<8>> (pool, buffers, scene, setup, writer);
+  else
+    render<Tiled<8, true>> (pool, buffers, scene, setup, writer);
+  auto const rendered = Clock::now ();
+  writer.finish ();
+  auto const written = Clock::now ();
+
+  // to stderr, since the image may be going to stdout. output is what
+  // the header and footer took, around the render. strips are encoded and
+  // written while the render goes on, so theirs are the stage timers'
+  // totals over the workers, as --stats has them, and overlap the rest
+  if (opts.timings) {
+    std::chrono::duration<double, std::milli> const
+      render = rendered - headed,
+      output = (headed - start) + (written - rendered);
+    std::cerr << "render and encode " << render.count () << " ms, output " << output.count () << " ms";
+#if RASTER_STATS
+    RasterStats const stats = StatsRegistry::get ().total ();
+    std::cerr << "; strips took encoding " << double (stats.stage_ns[stage_encode]) * 1e-6 << " ms and "
+              << "output " << double (stats.stage_ns[stage_write]) * 1e-6 << " ms over the workers";
+#endif
+    std::cerr << "\n";
+  }
+
+  report_stats (opts, double (scene.width) * scene.height);
 }
 catch (std::exception const& e) {
   std::cerr << e.what () << "\n";
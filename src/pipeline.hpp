@@ -0,0 +1,606 @@
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "attributes.hpp"
+#include "blend.hpp"
+#include "depth.hpp"
+#include "draw_triangle.hpp"
+#include "image.hpp"
+#include "msaa.hpp"
+#include "pixel.hpp"
+#include "scene.hpp"
+#include "texture.hpp"
+#include "visibility.hpp"
+
+// a render state is a set of features, one bit each. every state gets
+// its own instantiation of the rasterizer, so the hot loops carry no
+// tests of features they don't use
+using RenderState = unsigned;
+
+enum : RenderState {
+  state_texture     = 1u << 0, // sample the texture at interpolated uvs, else interpolate vertex colours
+  state_bilinear    = 1u << 1, // filter texture samples bilinearly, else take the nearest texel
+  state_depth       = 1u << 2, // test and write depth
+  state_blend       = 1u << 3, // blend pixels into the canvas, else write them over it
+  state_msaa        = 1u << 4, // cover and store samples, resolved into the canvas after; never with state_blend
+  state_perspective = 1u << 5, // interpolate attributes over w, and divide them back at each pixel
+  state_count       = 1u << 6
+};
+
+// what a render uses besides the scene
+struct RenderSetup {
+  Texture const* texture = nullptr;
+  Filter filter = Filter::bilinear;
+  Blend blend = Blend::replace;
+  bool premultiply = false; // premultiply colours by alpha at setup, and the texture when it's built
+  int samples = 1;          // per pixel, 4 or 8 to multisample
+  bool generic = false;  // test the state at every pixel instead, for comparison
+  bool deferred = false; // draw a visibility buffer, and shade each pixel once after
+};
+
+static inline RenderState render_state (SceneView const& scene, RenderSetup const& setup) {
+  RenderState state = 0;
+  if (scene.shading == Shading::texture) {
+    state |= state_texture;
+    if (setup.filter == Filter::bilinear)
+      state |= state_bilinear;
+  }
+  if (scene.depths)
+    state |= state_depth;
+  if (setup.blend != Blend::replace)
+    state |= state_blend;
+  if (setup.samples > 1)
+    state |= state_msaa;
+  if (scene.rhws)
+    state |= state_perspective;
+  if ((state & state_blend) && (state & state_msaa))
+    throw std::runtime_error ("Blending can't be multisampled");
+  // a visibility buffer keeps one triangle a pixel
+  if (setup.deferred && (state & (state_blend | state_msaa)))
+    throw std::runtime_error ("Blending and multisampling can't be deferred");
+  return state;
+}
+
+// everything a batch of draws into one canvas shares
+template<typename Layout>
+struct DrawContext {
+  Image<Pixelu8, Layout>& canvas;
+  SceneView const& scene;
+  Texture const* texture;
+  DepthBuffer<Layout>* depth; // when the state has state_depth
+  Blender blend;              // when the state has state_blend
+  MsaaBuffer<Layout>* msaa;   // when the state has state_msaa
+  Image<uint32_t, Layout>* ids; // when shading is deferred
+};
+
+// samples a texture at interpolated uvs, a pixel or a group at a time
+template<Filter F>
+struct TextureShader {
+  LevelSampler<F> sampler;
+
+  Pixelu8 operator () (Attributes<2> const& uv) const {
+    return sampler (uv[0], uv[1]);
+  }
+
+  void lanes (Attributes<2> const* uv, unsigned mask, Pixelu8* out) const {
+    float u[group_size] = { }, v[group_size] = { };
+    for (unsigned m = mask; m; m &= m - 1) {
+      int const i = lowest_lane (m);
+      u[i] = uv[i][0];
+      v[i] = uv[i][1];
+    }
+    sampler.lanes (u, v, mask, out);
+  }
+};
+
+// samples a texture at uvs interpolated with perspective, over w, at the
+// level of detail of each pixel. lanes are divided back as
+// perspective_divide does, and those at one level sampled together,
+// which is usually the whole group
+template<Filter F>
+struct PerspectiveTextureShader {
+  Texture const* texture;
+  PerspectiveLod lod;
+
+  Pixelu8 operator () (Attributes<3> const& a) const {
+    float const w = 1 / a[2], u = a[0] * w, v = a[1] * w;
+    return LevelSampler<F> (*texture, lod.level (u, v, w)) (u, v);
+  }
+
+  void lanes (Attributes<3> const* a, unsigned mask, Pixelu8* out) const {
+    float u[group_size] = { }, v[group_size] = { };
+    int level[group_size] = { };
+    for (unsigned m = mask; m; m &= m - 1) {
+      int const i = lowest_lane (m);
+      float const w = 1 / a[i][2];
+      u[i] = a[i][0] * w;
+      v[i] = a[i][1] * w;
+      level[i] = lod.level (u[i], v[i], w);
+    }
+
+    // sampling writes every lane, so where levels differ within a group
+    // each level's lanes are sampled aside and copied over
+    for (unsigned left = mask; left; ) {
+      int const at = level[lowest_lane (left)];
+      unsigned these = 0;
+      for (unsigned m = left; m; m &= m - 1) {
+        if (level[lowest_lane (m)] == at)
+          these |= 1u << lowest_lane (m);
+      }
+      if (these == mask) {
+        LevelSampler<F> (*texture, at).lanes (u, v, mask, out);
+        return;
+      }
+      Pixelu8 sampled[group_size];
+      LevelSampler<F> (*texture, at).lanes (u, v, these, sampled);
+      for (unsigned m = these; m; m &= m - 1)
+        out[lowest_lane (m)] = sampled[lowest_lane (m)];
+      left &= ~these;
+    }
+  }
+};
+
+// interpolates vertex colours, converted to bytes a group at a time
+struct ColourShader {
+  Pixelu8 operator () (Attributes<4> const& c) const {
+    return convert_pixel (Pixelf (c[0], c[1], c[2], c[3]));
+  }
+
+  // the attributes are laid out like Pixelfs. lanes past the last in
+  // mask may not be set, so they're left out
+  void lanes (Attributes<4> const* c, unsigned mask, Pixelu8* out) const {
+    static_assert (sizeof (Attributes<4>) == 4 * sizeof (float), "Attributes are packed");
+    if (mask)
+      convert_pixels (c[0].data (), out, size_t (32 - __builtin_clz (mask)));
+  }
+};
+
+static inline Attributes<2> uv_attributes (P2i32 uv) {
+  return Attributes<2> {{ float (uv.x), float (uv.y) }};
+}
+
+static inline Attributes<4> colour_attributes (Pixelf const& c, bool premultiply) {
+  if (premultiply)
+    return Attributes<4> {{ c.r*c.a, c.g*c.a, c.b*c.a, c.a }};
+  return Attributes<4> {{ c.r, c.g, c.b, c.a }};
+}
+
+// attributes are linear in the canvas once divided by w, and so is 1/w;
+// interpolating those and dividing them back at each pixel gives
+// attributes with perspective
+template<size_t N>
+Attributes<N+1> over_w (Attributes<N> const& a, float rhw) {
+  Attributes<N+1> r;
+  for (size_t i = 0; i != N; i++)
+    r[i] = a[i] * rhw;
+  r[N] = rhw;
+  return r;
+}
+
+template<size_t N>
+Attributes<N> perspective_divide (Attributes<N+1> const& a) {
+  float const w = 1 / a[N];
+  Attributes<N> r;
+  for (size_t i = 0; i != N; i++)
+    r[i] = a[i] * w;
+  return r;
+}
+
+// shades attributes interpolated over w, dividing them back first. lanes
+// outside mask may be past the triangle, where 1/w can be anything, so
+// they're left at zero
+template<typename Shader, size_t N>
+struct PerspectiveShader {
+  Shader shader;
+
+  Pixelu8 operator () (Attributes<N+1> const& a) const {
+    return shader (perspective_divide<N> (a));
+  }
+
+  void lanes (Attributes<N+1> const* a, unsigned mask, Pixelu8* out) const {
+    Attributes<N> divided[group_size] = { };
+    for (unsigned m = mask; m; m &= m - 1) {
+      int const i = lowest_lane (m);
+      divided[i] = perspective_divide<N> (a[i]);
+    }
+    shade_group (shader, divided, mask, out, 0);
+  }
+};
+
+// pass a triangle to the rasterizer, its attributes interpolated with
+// perspective when the state says so
+template<typename Layout, size_t N, typename Shader, typename Depth, typename Write>
+void draw_attributes (DrawContext<Layout> const& ctx, Rect const& clip, size_t tri, Attributes<N> const (&a)[3], Shader const& shader, Depth const& depth, Write const& write, std::false_type) {
+  auto const p = ctx.scene.corners (ctx.scene.positions, tri);
+  draw_triangle (ctx.canvas, clip, p[0], p[1], p[2], a[0], a[1], a[2], shader, depth, write);
+}
+
+template<typename Layout, size_t N, typename Shader, typename Depth, typename Write>
+void draw_attributes (DrawContext<Layout> const& ctx, Rect const& clip, size_t tri, Attributes<N> const (&a)[3], Shader const& shader, Depth const& depth, Write const& write, std::true_type) {
+  auto const p = ctx.scene.corners (ctx.scene.positions, tri);
+  auto const w = ctx.scene.corners (ctx.scene.rhws,      tri);
+  draw_triangle (ctx.canvas, clip, p[0], p[1], p[2],
+    over_w (a[0], w[0]), over_w (a[1], w[1]), over_w (a[2], w[2]), PerspectiveShader<Shader, N> { shader }, depth, write);
+}
+
+// the texture level a triangle samples, when its uvs are affine
+static inline int texture_level (Texture const& texture, SceneView const& scene, size_t tri) {
+  auto const p  = scene.corners (scene.positions, tri);
+  auto const uv = scene.corners (scene.uvs,       tri);
+  return texture.level_for (texture_lod (p[0], p[1], p[2], uv[0], uv[1], uv[2]));
+}
+
+// a triangle's uvs over w, and what its pixels need to pick a level from
+static inline void uvs_over_w (SceneView const& scene, size_t tri, Attributes<3> (&a)[3]) {
+  for (int i = 0; i != 3; i++) {
+    size_t const v = scene.corner (tri, i);
+    a[i] = over_w (uv_attributes (scene.uvs[v]), scene.rhws[v]);
+  }
+}
+
+static inline PerspectiveLod perspective_lod (Texture const& texture, SceneView const& scene, size_t tri, Attributes<3> const (&a)[3]) {
+  auto const p = scene.corners (scene.positions, tri);
+  Planes<3> const planes = triangle_planes (p[0], p[1], p[2], a[0], a[1], a[2], P2i32 { 0, 0 });
+  return PerspectiveLod {
+    { planes.dx[0], planes.dy[0] }, { planes.dx[1], planes.dy[1] }, { planes.dx[2], planes.dy[2] },
+    texture.levels ()
+  };
+}
+
+// textured triangles. with affine uvs one mip level does for the whole
+// triangle; with perspective each pixel picks its own
+template<Filter F, typename Layout, typename Depth, typename Write>
+void draw_textured (DrawContext<Layout> const& ctx, Rect const& clip, size_t tri, Depth const& depth, Write const& write, std::false_type) {
+  auto const p  = ctx.scene.corners (ctx.scene.positions, tri);
+  auto const uv = ctx.scene.corners (ctx.scene.uvs,       tri);
+  TextureShader<F> const shader { LevelSampler<F> (*ctx.texture, texture_level (*ctx.texture, ctx.scene, tri)) };
+  draw_triangle (ctx.canvas, clip, p[0], p[1], p[2], uv_attributes (uv[0]), uv_attributes (uv[1]), uv_attributes (uv[2]), shader, depth, write);
+}
+
+template<Filter F, typename Layout, typename Depth, typename Write>
+void draw_textured (DrawContext<Layout> const& ctx, Rect const& clip, size_t tri, Depth const& depth, Write const& write, std::true_type) {
+  auto const p = ctx.scene.corners (ctx.scene.positions, tri);
+  Attributes<3> a[3];
+  uvs_over_w (ctx.scene, tri, a);
+  PerspectiveTextureShader<F> const shader { ctx.texture, perspective_lod (*ctx.texture, ctx.scene, tri, a) };
+  draw_triangle (ctx.canvas, clip, p[0], p[1], p[2], a[0], a[1], a[2], shader, depth, write);
+}
+
+template<RenderState S, typename Layout, typename Depth, typename Write>
+void draw_shaded (DrawContext<Layout> const& ctx, Rect const& clip, size_t tri, Depth const& depth, Write const& write, std::true_type) {
+  constexpr Filter filter = (S & state_bilinear)? Filter::bilinear : Filter::nearest;
+  using perspective = std::integral_constant<bool, (S & state_perspective) != 0>;
+  draw_textured<filter> (ctx, clip, tri, depth, write, perspective ());
+}
+
+// triangles with interpolated vertex colours
+template<RenderState S, typename Layout, typename Depth, typename Write>
+void draw_shaded (DrawContext<Layout> const& ctx, Rect const& clip, size_t tri, Depth const& depth, Write const& write, std::false_type) {
+  using perspective = std::integral_constant<bool, (S & state_perspective) != 0>;
+  auto const c = ctx.scene.corners (ctx.scene.colours, tri);
+  bool const pre = ctx.blend.premultiplied;
+
+  Attributes<4> const a[3] = { colour_attributes (c[0], pre), colour_attributes (c[1], pre), colour_attributes (c[2], pre) };
+  draw_attributes (ctx, clip, tri, a, ColourShader (), depth, write, perspective ());
+}
+
+template<typename Layout>
+NoDepth triangle_depth (DrawContext<Layout> const&, size_t, std::false_type) {
+  return NoDepth ();
+}
+
+template<typename Layout>
+DepthTest<Layout> triangle_depth (DrawContext<Layout> const& ctx, size_t tri, std::true_type) {
+  auto const z = ctx.scene.corners (ctx.scene.depths, tri);
+  return DepthTest<Layout> { *ctx.depth, z[0], z[1], z[2] };
+}
+
+// how pixels are written, for the state's bits of state_blend | state_msaa
+template<typename Layout>
+Overwrite triangle_write (DrawContext<Layout> const&, std::integral_constant<RenderState, 0>) {
+  return Overwrite ();
+}
+
+template<typename Layout>
+Blender triangle_write (DrawContext<Layout> const& ctx, std::integral_constant<RenderState, state_blend>) {
+  return ctx.blend;
+}
+
+template<typename Layout>
+MsaaWrite<Layout> triangle_write (DrawContext<Layout> const& ctx, std::integral_constant<RenderState, state_msaa>) {
+  return MsaaWrite<Layout> { ctx.msaa };
+}
+
+// draw a batch of triangles, by index, clipped to a rect
+template<typename Layout>
+using DrawBatch = void (*) (DrawContext<Layout> const& ctx, Rect const& clip, uint32_t const* begin, uint32_t const* end);
+
+template<typename Layout, RenderState S>
+void draw_batch (DrawContext<Layout> const& ctx, Rect const& clip, uint32_t const* begin, uint32_t const* end) {
+  using textured = std::integral_constant<bool, (S & state_texture) != 0>;
+  using depth    = std::integral_constant<bool, (S & state_depth)   != 0>;
+  using writes   = std::integral_constant<RenderState, S & (state_blend | state_msaa)>;
+  auto const write = triangle_write (ctx, writes ());
+  for (; begin != end; begin++)
+    draw_shaded<S> (ctx, clip, *begin, triangle_depth (ctx, *begin, depth ()), write, textured ());
+}
+
+template<typename Layout, RenderState... S>
+std::array<DrawBatch<Layout>, sizeof... (S)> batch_table (std::integer_sequence<RenderState, S...>) {
+  // blending and multisampling don't go together, and render_state never
+  // asks for both, so those states needn't be built
+  return {{ draw_batch<Layout, (S & state_msaa)? S & ~state_blend : S>... }};
+}
+
+// the specialized batch drawer for a render state
+template<typename Layout>
+DrawBatch<Layout> batch_for (RenderState state) {
+  static std::array<DrawBatch<Layout>, state_count> const table =
+    batch_table<Layout> (std::make_integer_sequence<RenderState, state_count> ());
+  return table[state];
+}
+
+// deferred shading's first pass: triangle indices into ctx.ids, depth
+// tested when the state has state_depth
+template<typename Layout, bool Depth>
+void draw_ids (DrawContext<Layout> const& ctx, Rect const& clip, uint32_t const* begin, uint32_t const* end) {
+  using depth = std::integral_constant<bool, Depth>;
+  Attributes<0> const none { };
+  for (; begin != end; begin++) {
+    auto const p = ctx.scene.corners (ctx.scene.positions, *begin);
+    draw_triangle (*ctx.ids, clip, p[0], p[1], p[2], none, none, none, IdShader { *begin }, triangle_depth (ctx, *begin, depth ()), Overwrite ());
+  }
+}
+
+template<typename Layout>
+DrawBatch<Layout> ids_for (RenderState state) {
+  return (state & state_depth)? draw_ids<Layout, true> : draw_ids<Layout, false>;
+}
+
+// the second pass's attributes and shader for a triangle, textured or not
+template<RenderState S, bool Textured = (S & state_texture) != 0>
+struct DeferredShading {
+  static constexpr Filter filter = (S & state_bilinear)? Filter::bilinear : Filter::nearest;
+  static constexpr size_t size = 2;
+  using Shader = TextureShader<filter>;
+
+  // with perspective, over w, and the level picked at each pixel
+  using ShaderOverW = PerspectiveTextureShader<filter>;
+
+  template<typename Layout>
+  static Shader shader (DrawContext<Layout> const& ctx, size_t tri) {
+    return Shader { LevelSampler<filter> (*ctx.texture, texture_level (*ctx.texture, ctx.scene, tri)) };
+  }
+
+  template<typename Layout>
+  static ShaderOverW shader_over_w (DrawContext<Layout> const& ctx, size_t tri, Attributes<size + 1> const (&a)[3]) {
+    return ShaderOverW { ctx.texture, perspective_lod (*ctx.texture, ctx.scene, tri, a) };
+  }
+
+  template<typename Layout>
+  static void attributes (DrawContext<Layout> const& ctx, size_t tri, Attributes<size> (&a)[3]) {
+    for (int i = 0; i != 3; i++)
+      a[i] = uv_attributes (ctx.scene.uvs[ctx.scene.corner (tri, i)]);
+  }
+};
+
+template<RenderState S>
+struct DeferredShading<S, false> {
+  static constexpr size_t size = 4;
+  using Shader = ColourShader;
+  using ShaderOverW = PerspectiveShader<Shader, size>;
+
+  template<typename Layout>
+  static Shader shader (DrawContext<Layout> const&, size_t) {
+    return Shader ();
+  }
+
+  template<typename Layout>
+  static ShaderOverW shader_over_w (DrawContext<Layout> const&, size_t, Attributes<size + 1> const (&)[3]) {
+    return ShaderOverW { Shader () };
+  }
+
+  template<typename Layout>
+  static void attributes (DrawContext<Layout> const& ctx, size_t tri, Attributes<size> (&a)[3]) {
+    for (int i = 0; i != 3; i++)
+      a[i] = colour_attributes (ctx.scene.colours[ctx.scene.corner (tri, i)], ctx.blend.premultiplied);
+  }
+};
+
+// a triangle as the second pass sees it, planes from canvas pixel o,
+// with perspective when the state says so
+template<typename Of, typename Layout>
+Visible<Of::size, typename Of::Shader> visible_triangle (DrawContext<Layout> const& ctx, uint32_t tri, P2i32 o, std::false_type) {
+  auto const p = ctx.scene.corners (ctx.scene.positions, tri);
+  Attributes<Of::size> a[3];
+  Of::attributes (ctx, tri, a);
+
+  Visible<Of::size, typename Of::Shader> v;
+  v.id = tri;
+  v.planes = triangle_planes (p[0], p[1], p[2], a[0], a[1], a[2], o);
+  v.shader = Of::shader (ctx, tri);
+  return v;
+}
+
+template<typename Of, typename Layout>
+Visible<Of::size + 1, typename Of::ShaderOverW> visible_triangle (DrawContext<Layout> const& ctx, uint32_t tri, P2i32 o, std::true_type) {
+  auto const p = ctx.scene.corners (ctx.scene.positions, tri);
+  auto const w = ctx.scene.corners (ctx.scene.rhws,      tri);
+  Attributes<Of::size> a[3];
+  Of::attributes (ctx, tri, a);
+  Attributes<Of::size + 1> const aw[3] = { over_w (a[0], w[0]), over_w (a[1], w[1]), over_w (a[2], w[2]) };
+
+  Visible<Of::size + 1, typename Of::ShaderOverW> v;
+  v.id = tri;
+  v.planes = triangle_planes (p[0], p[1], p[2], aw[0], aw[1], aw[2], o);
+  v.shader = Of::shader_over_w (ctx, tri, aw);
+  return v;
+}
+
+// deferred shading's second pass over a rect, for the state's bits of
+// state_texture | state_bilinear | state_perspective
+template<typename Layout>
+using ShadeVisible = void (*) (DrawContext<Layout> const& ctx, Rect const& clip);
+
+template<typename Layout, RenderState S>
+void shade_rect (DrawContext<Layout> const& ctx, Rect const& clip) {
+  using Of = DeferredShading<S>;
+  using perspective = std::integral_constant<bool, (S & state_perspective) != 0>;
+
+  P2i32 const o { clip.x0 - ctx.canvas.width () / 2, ctx.canvas.height () / 2 - clip.y0 };
+  shade_visible (ctx.canvas, *ctx.ids, clip, [&] (uint32_t tri) {
+    return visible_triangle<Of> (ctx, tri, o, perspective ());
+  });
+}
+
+template<typename Layout, RenderState... S>
+std::array<ShadeVisible<Layout>, sizeof... (S)> shade_table (std::integer_sequence<RenderState, S...>) {
+  // only the shading bits matter after the first pass
+  return {{ shade_rect<Layout, S & (state_texture | state_bilinear | state_perspective)>... }};
+}
+
+template<typename Layout>
+ShadeVisible<Layout> shade_for (RenderState state) {
+  static std::array<ShadeVisible<Layout>, state_count> const table =
+    shade_table<Layout> (std::make_integer_sequence<RenderState, state_count> ());
+  return table[state];
+}
+
+// the same features, the way they'd be without specializing: one shader
+// that interpolates every attribute and tests the state at each pixel,
+// and a depth test that checks whether it's on. kept to measure against
+struct GenericShader {
+  RenderState state;
+  LevelSampler<Filter::nearest>  nearest;
+  LevelSampler<Filter::bilinear> bilinear;
+  Texture const* texture; // for levels picked at each pixel, with perspective
+  PerspectiveLod lod;
+
+  // uvs, colour, and 1/w when the state has perspective
+  Pixelu8 operator () (Attributes<7> const& w) const {
+    Attributes<6> a;
+    if (state & state_perspective)
+      a = perspective_divide<6> (w);
+    else
+      std::copy (w.begin (), w.begin () + 6, a.begin ());
+
+    if ((state & state_texture) && (state & state_perspective)) {
+      int const level = lod.level (a[0], a[1], 1 / w[6]);
+      if (state & state_bilinear)
+        return LevelSampler<Filter::bilinear> (*texture, level) (a[0], a[1]);
+      return LevelSampler<Filter::nearest> (*texture, level) (a[0], a[1]);
+    }
+    if (state & state_texture) {
+      if (state & state_bilinear)
+        return bilinear (a[0], a[1]);
+      return nearest (a[0], a[1]);
+    }
+    return convert_pixel (Pixelf (a[2], a[3], a[4], a[5]));
+  }
+};
+
+// depth testing when the state says so, with the buffer null otherwise
+template<typename Layout>
+struct GenericDepthTest {
+  DepthBuffer<Layout>* buffer;
+  float a, b, c;
+};
+
+template<typename Layout, typename Plane = DepthPlane<Layout>>
+struct GenericDepth {
+  bool on;
+  Plane plane;
+
+  bool tracked () const { return on; }
+  bool occluded (int x0, int y0, int x1, int y1) const { return on && plane.occluded (x0, y0, x1, y1); }
+  bool in_front (int x0, int y0, int x1, int y1) const { return !on || plane.in_front (x0, y0, x1, y1); }
+  bool test (int x, int y) const { return !on || plane.test (x, y); }
+  void write (int x, int y) const { if (on) plane.write (x, y); }
+  void drawn (int x0, int y0, int x1, int y1) const { if (on) plane.drawn (x0, y0, x1, y1); }
+
+  template<typename Samples>
+  GenericDepth<Layout, SampledDepthPlane<Layout>> with_samples (Samples const& msaa) const {
+    if (!on)
+      return GenericDepth<Layout, SampledDepthPlane<Layout>> { false, SampledDepthPlane<Layout> () };
+    return GenericDepth<Layout, SampledDepthPlane<Layout>> { true, plane.with_samples (msaa) };
+  }
+  unsigned test_samples (int x, int y, unsigned cover) const { return on? plane.test_samples (x, y, cover) : cover; }
+  void write_samples (int x, int y, unsigned cover) const { if (on) plane.write_samples (x, y, cover); }
+};
+
+template<typename Layout>
+GenericDepth<Layout> depth_plane (GenericDepthTest<Layout> const& t, Rect r, Edge<i64> const (&e)[3], float k) {
+  if (!t.buffer)
+    return GenericDepth<Layout> { false, DepthPlane<Layout> () };
+  return GenericDepth<Layout> { true, depth_plane (DepthTest<Layout> { *t.buffer, t.a, t.b, t.c }, r, e, k) };
+}
+
+template<typename Layout>
+GenericDepthTest<Layout> clipped_depth (GenericDepthTest<Layout> const& t, ClipVertex const& u, ClipVertex const& v, ClipVertex const& w) {
+  auto z = [&t] (ClipVertex const& c) { return c.w[0]*t.a + c.w[1]*t.b + c.w[2]*t.c; };
+  return GenericDepthTest<Layout> { t.buffer, z (u), z (v), z (w) };
+}
+
+// blending when the state says so, else a plain copy
+struct GenericWrite {
+  bool on;
+  Blender blend;
+
+  void operator () (Pixelu8* under, Pixelu8 const* pixels, size_t count) const {
+    if (on)
+      blend (under, pixels, count);
+    else
+      std::copy (pixels, pixels + count, under);
+  }
+};
+
+template<typename Layout>
+void draw_batch_generic (DrawContext<Layout> const& ctx, RenderState state, Rect const& clip, uint32_t const* begin, uint32_t const* end) {
+  GenericWrite const write { (state & state_blend) != 0, ctx.blend };
+  for (; begin != end; begin++) {
+    size_t const tri = *begin;
+    auto const p  = ctx.scene.corners (ctx.scene.positions, tri);
+    auto const uv = ctx.scene.corners (ctx.scene.uvs,       tri);
+    auto const c  = ctx.scene.corners (ctx.scene.colours,   tri);
+
+    auto attributes = [&] (int i) {
+      Attributes<4> const colour = colour_attributes (c[i], ctx.blend.premultiplied);
+      Attributes<6> const a {{ float (uv[i].x), float (uv[i].y), colour[0], colour[1], colour[2], colour[3] }};
+      if (state & state_perspective)
+        return over_w (a, ctx.scene.rhws[ctx.scene.corner (tri, i)]);
+      return Attributes<7> {{ a[0], a[1], a[2], a[3], a[4], a[5], 1 }};
+    };
+
+    GenericShader shader { state, { }, { }, ctx.texture, { } };
+    if ((state & state_texture) && (state & state_perspective)) {
+      Attributes<3> a[3];
+      uvs_over_w (ctx.scene, tri, a);
+      shader.lod = perspective_lod (*ctx.texture, ctx.scene, tri, a);
+    }
+    else if (state & state_texture) {
+      int const level = texture_level (*ctx.texture, ctx.scene, tri);
+      shader.nearest  = LevelSampler<Filter::nearest>  (*ctx.texture, level);
+      shader.bilinear = LevelSampler<Filter::bilinear> (*ctx.texture, level);
+    }
+
+    GenericDepthTest<Layout> depth { nullptr, 0, 0, 0 };
+    if (state & state_depth) {
+      auto const z = ctx.scene.corners (ctx.scene.depths, tri);
+      depth = GenericDepthTest<Layout> { ctx.depth, z[0], z[1], z[2] };
+    }
+
+    if (state & state_msaa)
+      draw_triangle (ctx.canvas, clip, p[0], p[1], p[2], attributes (0), attributes (1), attributes (2), shader, depth, MsaaWrite<Layout> { ctx.msaa });
+    else
+      draw_triangle (ctx.canvas, clip, p[0], p[1], p[2], attributes (0), attributes (1), attributes (2), shader, depth, write);
+  }
+}
+
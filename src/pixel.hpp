@@ -1,9 +1,16 @@
 
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <limits>
 #include <type_traits>
 
+#if defined (__SSE2__)
+#include <immintrin.h>
+#endif
+
 template<typename T>
 struct ColourMax {
   static constexpr T value = std::numeric_limits<T>::max ();
@@ -66,14 +73,51 @@ Pixel<T>& operator += (Pixel<T>& a, Pixel<T> b) {
 using Pixelf = Pixel<float>;
 using Pixelu8 = Pixel<uint8_t>;
 
+// a float pixel fills an sse register exactly, channels in order
+#if defined (__SSE2__)
+static inline __m128 pixel_lanes (Pixelf p) {
+  return _mm_loadu_ps (p.channels);
+}
+
+static inline Pixelf lanes_pixel (__m128 v) {
+  Pixelf p;
+  _mm_storeu_ps (p.channels, v);
+  return p;
+}
+
+static inline Pixelf operator * (float a, Pixelf v) {
+  return lanes_pixel (_mm_mul_ps (_mm_set1_ps (a), pixel_lanes (v)));
+}
+
+static inline Pixelf operator * (Pixelf v, float a) {
+  return a * v;
+}
+
+static inline Pixelf operator + (Pixelf a, Pixelf b) {
+  return lanes_pixel (_mm_add_ps (pixel_lanes (a), pixel_lanes (b)));
+}
+
+static inline Pixelf& operator += (Pixelf& a, Pixelf b) {
+  a = a + b;
+  return a;
+}
+#endif
+
+// a channel from [0, 1] to [0, 255], rounded to nearest. out of range
+// values saturate, and NaN goes to 0, the same as the vector versions
+static inline uint8_t convert_channel (float x) {
+  x = x > 0? x : 0;
+  x = x < 1? x : 1;
+  return uint8_t (int (x * 255 + 0.5f));
+}
+
 // require format conversions to be explicit
-// HACKHACKHACK: just work for the cases we need
 static inline Pixelu8 convert_pixel (Pixelf p) {
   return Pixelu8 (
-    uint8_t (p.r*255),
-    uint8_t (p.g*255),
-    uint8_t (p.b*255),
-    uint8_t (p.a*255)
+    convert_channel (p.r),
+    convert_channel (p.g),
+    convert_channel (p.b),
+    convert_channel (p.a)
   );
 }
 
@@ -86,3 +130,66 @@ static inline T convert_pixel (T p) {
   return p;
 }
 
+// convert a run of pixels, as convert_pixel does one. in holds four
+// channels a pixel, red first, the way Pixelf lays them out
+static inline void convert_pixels (float const* in, Pixelu8* out, size_t count) {
+  size_t i = 0;
+
+#if defined (__AVX2__)
+  {
+    // two pixels per register. packing works within 128-bit halves, leaving
+    // even pixels in the low half and odd in the high, so a final permute
+    // puts them back in order
+    __m256 const
+      zero = _mm256_setzero_ps (), one = _mm256_set1_ps (1),
+      scale = _mm256_set1_ps (255), half = _mm256_set1_ps (0.5f);
+    __m256i const order = _mm256_setr_epi32 (0, 4, 1, 5, 2, 6, 3, 7);
+    auto fixed = [&] (size_t at) {
+      __m256 const x = _mm256_min_ps (_mm256_max_ps (_mm256_loadu_ps (in + at*4), zero), one);
+      return _mm256_cvttps_epi32 (_mm256_add_ps (_mm256_mul_ps (x, scale), half));
+    };
+    for (; i + 8 <= count; i += 8) {
+      __m256i const
+        lo = _mm256_packs_epi32 (fixed (i+0), fixed (i+2)),
+        hi = _mm256_packs_epi32 (fixed (i+4), fixed (i+6)),
+        bytes = _mm256_packus_epi16 (lo, hi);
+      _mm256_storeu_si256 (reinterpret_cast<__m256i*> (out + i), _mm256_permutevar8x32_epi32 (bytes, order));
+    }
+  }
+#endif
+
+#if defined (__SSE2__)
+  {
+    // a pixel per register, four to a store, then the rest one by one
+    __m128 const
+      zero = _mm_setzero_ps (), one = _mm_set1_ps (1),
+      scale = _mm_set1_ps (255), half = _mm_set1_ps (0.5f);
+    auto fixed = [&] (size_t at) {
+      __m128 const x = _mm_min_ps (_mm_max_ps (_mm_loadu_ps (in + at*4), zero), one);
+      return _mm_cvttps_epi32 (_mm_add_ps (_mm_mul_ps (x, scale), half));
+    };
+    for (; i + 4 <= count; i += 4) {
+      __m128i const
+        lo = _mm_packs_epi32 (fixed (i+0), fixed (i+1)),
+        hi = _mm_packs_epi32 (fixed (i+2), fixed (i+3));
+      _mm_storeu_si128 (reinterpret_cast<__m128i*> (out + i), _mm_packus_epi16 (lo, hi));
+    }
+    for (; i != count; i++) {
+      __m128i const words = _mm_packs_epi32 (fixed (i), fixed (i));
+      int const bytes = _mm_cvtsi128_si32 (_mm_packus_epi16 (words, words));
+      memcpy (out[i].channels, &bytes, sizeof out[i].channels);
+    }
+  }
+#endif
+
+  for (; i != count; i++) {
+    float const* p = in + i*4;
+    out[i] = Pixelu8 (convert_channel (p[0]), convert_channel (p[1]), convert_channel (p[2]), convert_channel (p[3]));
+  }
+}
+
+static inline void convert_pixels (Pixelf const* in, Pixelu8* out, size_t count) {
+  static_assert (sizeof (Pixelf) == 4 * sizeof (float), "Pixelf channels are packed");
+  convert_pixels (in->channels, out, count);
+}
+
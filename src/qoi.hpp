@@ -0,0 +1,192 @@
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "image.hpp"
+#include "pixel.hpp"
+
+// "quite ok image" format encoder and decoder. images are written as
+// opaque rgb
+//
+// a qoi stream is normally one long chain, each op depending on the pixels
+// before it. strips here are encoded independently instead, so they can be
+// compressed in parallel and in any order:
+//   - each strip opens with a literal rgb op, so it needs no previous pixel
+//   - index ops only refer to slots the strip itself has filled, since only
+//     those are sure to match the decoder's table
+//   - runs end at the strip boundary
+// concatenated, the strips still form a single valid stream
+
+static constexpr uint8_t
+  qoi_op_index = 0x00,
+  qoi_op_diff  = 0x40,
+  qoi_op_luma  = 0x80,
+  qoi_op_run   = 0xc0,
+  qoi_op_rgb   = 0xfe;
+
+static inline void qoi_put32 (std::vector<uint8_t>& out, uint32_t x) {
+  out.push_back (uint8_t (x >> 24));
+  out.push_back (uint8_t (x >> 16));
+  out.push_back (uint8_t (x >>  8));
+  out.push_back (uint8_t (x));
+}
+
+static inline void qoi_header (std::vector<uint8_t>& out, int width, int height) {
+  out.insert (out.end (), { 'q', 'o', 'i', 'f' });
+  qoi_put32 (out, uint32_t (width));
+  qoi_put32 (out, uint32_t (height));
+  out.push_back (3); // channels
+  out.push_back (0); // srgb
+}
+
+static inline void qoi_footer (std::vector<uint8_t>& out) {
+  out.insert (out.end (), { 0, 0, 0, 0, 0, 0, 0, 1 });
+}
+
+// encode rows [y0, y1) of an image
+static inline void qoi_strip (std::vector<uint8_t>& out, Image<Pixelu8> const& image, int y0, int y1) {
+  // alpha is always opaque, so it takes no part in comparisons
+  auto rgb  = [] (Pixelu8 p) { return uint32_t (p.r) | uint32_t (p.g) << 8 | uint32_t (p.b) << 16; };
+  auto hash = [] (Pixelu8 p) { return (p.r*3 + p.g*5 + p.b*7 + 255*11) % 64; };
+
+  uint32_t index[64];
+  uint64_t filled = 0; // slots set within this strip
+  Pixelu8 prev;
+  bool first = true;
+  int run = 0;
+
+  size_t const count = size_t (y1 - y0) * image.width ();
+  out.reserve (out.size () + count / 2);
+
+  for (int y = y0; y != y1; y++) {
+    Pixelu8 const* row = image.row (y);
+    for (int x = 0; x != image.width (); x++) {
+      Pixelu8 const px = row[x];
+
+      if (!first && rgb (px) == rgb (prev)) {
+        if (++run == 62) {
+          out.push_back (qoi_op_run | (run - 1));
+          run = 0;
+        }
+        continue;
+      }
+
+      if (run) {
+        out.push_back (qoi_op_run | (run - 1));
+        run = 0;
+      }
+
+      int const h = hash (px);
+      int const
+        dr = px.r - prev.r,
+        dg = px.g - prev.g,
+        db = px.b - prev.b,
+        dr_dg = dr - dg,
+        db_dg = db - dg;
+
+      if ((filled >> h & 1) && index[h] == rgb (px)) {
+        out.push_back (qoi_op_index | h);
+      }
+      else if (first) {
+        out.insert (out.end (), { qoi_op_rgb, px.r, px.g, px.b });
+      }
+      // differences wrap, as in the decoder
+      else if (int8_t (dr) >= -2 && int8_t (dr) <= 1 &&
+               int8_t (dg) >= -2 && int8_t (dg) <= 1 &&
+               int8_t (db) >= -2 && int8_t (db) <= 1)
+      {
+        out.push_back (qoi_op_diff | (int8_t (dr) + 2) << 4 | (int8_t (dg) + 2) << 2 | (int8_t (db) + 2));
+      }
+      else if (int8_t (dg) >= -32 && int8_t (dg) <= 31 &&
+               int8_t (dr_dg) >= -8 && int8_t (dr_dg) <= 7 &&
+               int8_t (db_dg) >= -8 && int8_t (db_dg) <= 7)
+      {
+        out.push_back (qoi_op_luma | (int8_t (dg) + 32));
+        out.push_back ((int8_t (dr_dg) + 8) << 4 | (int8_t (db_dg) + 8));
+      }
+      else {
+        out.insert (out.end (), { qoi_op_rgb, px.r, px.g, px.b });
+      }
+
+      index[h] = rgb (px);
+      filled |= uint64_t (1) << h;
+      prev = px;
+      first = false;
+    }
+  }
+
+  if (run)
+    out.push_back (qoi_op_run | (run - 1));
+}
+
+// decode a whole qoi file
+static inline Image<Pixelu8> qoi_decode (uint8_t const* data, size_t size) {
+  auto get32 = [data] (size_t at) {
+    return uint32_t (data[at]) << 24 | uint32_t (data[at+1]) << 16 | uint32_t (data[at+2]) << 8 | data[at+3];
+  };
+
+  size_t const header = 14;
+  if (size < header || memcmp (data, "qoif", 4))
+    throw std::runtime_error ("Not a qoi image");
+  uint32_t const width = get32 (4), height = get32 (8);
+  if (width == 0 || height == 0 || width > 1u << 16 || height > 1u << 16)
+    throw std::runtime_error ("Bad qoi image size");
+
+  Image<Pixelu8> image (static_cast<int> (width), static_cast<int> (height));
+  Pixelu8 index[64] = { };
+  for (Pixelu8& p : index)
+    p.a = 0;
+  Pixelu8 px;
+  int run = 0;
+  size_t at = header;
+
+  auto next = [&] () {
+    if (at == size)
+      throw std::runtime_error ("Truncated qoi image");
+    return data[at++];
+  };
+
+  for (uint32_t y = 0; y != height; y++) {
+    Pixelu8* row = image.row (int (y));
+    for (uint32_t x = 0; x != width; x++) {
+      if (run) {
+        run--;
+      }
+      else {
+        uint8_t const op = next ();
+        if (op == qoi_op_rgb) {
+          px.r = next (); px.g = next (); px.b = next ();
+        }
+        else if (op == 0xff) {
+          px.r = next (); px.g = next (); px.b = next (); px.a = next ();
+        }
+        else if ((op & 0xc0) == qoi_op_index) {
+          px = index[op];
+        }
+        else if ((op & 0xc0) == qoi_op_diff) {
+          px.r += ((op >> 4) & 3) - 2;
+          px.g += ((op >> 2) & 3) - 2;
+          px.b += ( op       & 3) - 2;
+        }
+        else if ((op & 0xc0) == qoi_op_luma) {
+          uint8_t const b = next ();
+          int const dg = (op & 0x3f) - 32;
+          px.r += dg - 8 + (b >> 4);
+          px.g += dg;
+          px.b += dg - 8 + (b & 0x0f);
+        }
+        else {
+          run = op & 0x3f;
+        }
+        index[(px.r*3 + px.g*5 + px.b*7 + px.a*11) % 64] = px;
+      }
+      row[x] = px;
+    }
+  }
+  return image;
+}
+
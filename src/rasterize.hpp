@@ -0,0 +1,203 @@
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "buffer_pool.hpp"
+#include "depth.hpp"
+#include "image.hpp"
+#include "msaa.hpp"
+#include "pipeline.hpp"
+#include "scene.hpp"
+#include "stats.hpp"
+#include "tiles.hpp"
+#include "worker_pool.hpp"
+
+// where a frame's time went, in milliseconds. bin and tiles are on the
+// clock; draw and shade are summed over the workers, so with several
+// they add up to more than tiles. drawing covers and shades pixels as it
+// goes, unless shading is deferred, when shade is the second pass
+struct FrameTimes {
+  double bin = 0, tiles = 0, draw = 0, shade = 0;
+};
+
+// the buffers a render draws into besides the canvas, those its scene
+// and setup call for
+template<typename Layout>
+struct RenderBuffers {
+  std::unique_ptr<DepthBuffer<Layout>>     depth;
+  std::unique_ptr<MsaaBuffer<Layout>>      msaa; // resolved into the canvas tile by tile
+  std::unique_ptr<Image<uint32_t, Layout>> ids;  // when shading is deferred
+
+  RenderBuffers (SceneView const& scene, RenderSetup const& setup, BufferPool* buffers) {
+    if (scene.depths)
+      depth.reset (new DepthBuffer<Layout> (scene.width, scene.height, buffers, setup.samples));
+    if (setup.samples > 1)
+      msaa.reset (new MsaaBuffer<Layout> (scene.width, scene.height, setup.samples, buffers));
+    if (setup.deferred)
+      ids.reset (new Image<uint32_t, Layout> (scene.width, scene.height, Uninitialized (), buffers));
+  }
+
+  // how far past its pixels a triangle's samples reach
+  i32 margin () const {
+    return msaa? msaa_margin : 0;
+  }
+};
+
+// nanoseconds a tile took drawing and shading
+struct TileTimes {
+  int64_t draw = 0, shade = 0;
+};
+
+// draws tiles of a render from scratch, with the drawer its scene's
+// render state picks
+template<typename Layout>
+class TileDrawer {
+  DrawContext<Layout> const ctx;
+  RenderSetup const& setup;
+  RenderState const state;
+  DrawBatch<Layout> const draw;
+
+public:
+  TileDrawer (Image<Pixelu8, Layout>& canvas, SceneView const& scene, RenderSetup const& setup, RenderBuffers<Layout> const& buffers) :
+    ctx { canvas, scene, setup.texture, buffers.depth.get (), Blender { setup.blend, setup.premultiply }, buffers.msaa.get (), buffers.ids.get () },
+    setup (setup),
+    state (render_state (scene, setup)),
+    draw (setup.deferred? ids_for<Layout> (state) : batch_for<Layout> (state))
+  { }
+
+  // clear the tile at clip, draw each run of triangle indices over it in
+  // turn, then resolve samples, or shade what's visible when shading is
+  // deferred. each_run (f) calls f (begin, end) for the runs, in order.
+  // timed, returns where the time went
+  template<typename EachRun>
+  TileTimes operator () (Rect const& clip, EachRun const& each_run, bool timed = false) const {
+    using Clock = std::chrono::steady_clock;
+    ctx.canvas.clear (clip, Pixelu8 ());
+    if (ctx.depth)
+      ctx.depth->clear (clip);
+    if (ctx.msaa)
+      ctx.msaa->clear (clip);
+    if (ctx.ids)
+      ctx.ids->clear (clip, no_triangle);
+
+    auto const start = timed? Clock::now () : Clock::time_point ();
+    {
+      StageTimer const timer (stage_draw);
+      each_run ([&] (uint32_t const* begin, uint32_t const* end) {
+        if (setup.generic && !setup.deferred)
+          draw_batch_generic (ctx, state, clip, begin, end);
+        else
+          draw (ctx, clip, begin, end);
+      });
+      if (ctx.msaa)
+        ctx.msaa->resolve (ctx.canvas, clip);
+    }
+    auto const drawn = timed? Clock::now () : Clock::time_point ();
+    if (ctx.ids) {
+      StageTimer const timer (stage_shade);
+      shade_for<Layout> (state) (ctx, clip);
+    }
+
+    TileTimes times;
+    if (timed) {
+      times.draw  = std::chrono::duration_cast<std::chrono::nanoseconds> (drawn - start).count ();
+      times.shade = std::chrono::duration_cast<std::chrono::nanoseconds> (Clock::now () - drawn).count ();
+    }
+    return times;
+  }
+};
+
+// pixel bounds of triangle i, for binning, counted in the calling
+// thread's stats; false if it draws nothing
+template<typename Layout>
+bool triangle_bounds (Image<Pixelu8, Layout> const& canvas, SceneView const& scene, i32 margin, uint32_t i, Rect& rect) {
+  auto const p = scene.corners (scene.positions, i);
+  RasterStats& stats = thread_stats ();
+  stats.triangles_submitted++;
+  if (triangle_rect (canvas, p[0], p[1], p[2], rect, margin))
+    return true;
+  if (rect.empty ())
+    stats.triangles_offscreen++;
+  else
+    stats.triangles_culled++;
+  return false;
+}
+
+// compute an 8-bit image from a scene.
+// triangles are binned into screen tiles, then the tiles are rasterized in
+// parallel. every tile is drawn by one worker, in submission order, so the
+// result is the same as drawing the triangles one after another.
+// once every tile in a row of tiles is drawn, the worker that finished it
+// calls strip_done (image, strip, y0, y1) for the rows it covers.
+// the canvas is taken from buffers, when given, so renders of the same
+// size can recycle one another's memory. the scene's render state picks
+// one specialized drawer for every batch of triangles. shading deferred,
+// the batches draw triangle indices instead, and each tile is shaded
+// from those once they're all drawn. with times, where the time went is
+// added to them
+template<typename Layout, typename StripDone>
+Image<Pixelu8, Layout> rasterize (WorkerPool& pool, SceneView const& scene, RenderSetup const& setup, StripDone const& strip_done, BufferPool* buffers = nullptr, FrameTimes* times = nullptr) {
+  using Clock = std::chrono::steady_clock;
+  using Milliseconds = std::chrono::duration<double, std::milli>;
+  auto const start = Clock::now ();
+
+  // each tile is cleared by the worker that draws it
+  Image<Pixelu8, Layout> canvas (scene.width, scene.height, Uninitialized (), buffers);
+  TileGrid const grid (scene.width, scene.height);
+  RenderBuffers<Layout> const targets (scene, setup, buffers);
+  TileDrawer<Layout> const draw_tile (canvas, scene, setup, targets);
+  i32 const margin = targets.margin ();
+
+  auto bounds = [&] (uint32_t i, Rect& rect) {
+    return triangle_bounds (canvas, scene, margin, i, rect);
+  };
+
+  // bin contiguous runs of triangles in parallel
+  int const runs = pool.size ();
+  std::vector<TileBins> bins (runs);
+  pool.run (runs, [&] (int run, int) {
+    uint32_t const
+      begin = uint32_t (uint64_t (scene.count) *  run    / runs),
+      end   = uint32_t (uint64_t (scene.count) * (run+1) / runs);
+    StageTimer const timer (stage_bin);
+    bins[run].fill (grid, begin, end, bounds);
+  });
+
+  auto const binned = Clock::now ();
+  std::atomic<int64_t> drawing { 0 }, shading { 0 };
+
+  // tiles left to draw in each row of tiles
+  std::unique_ptr<std::atomic<int>[]> left (new std::atomic<int>[grid.rows]);
+  for (int row = 0; row != grid.rows; row++)
+    left[row] = grid.columns;
+
+  // draw each tile's triangles, visiting runs in order
+  pool.run (grid.count (), [&] (int tile, int) {
+    Rect const clip = grid.rect (tile);
+    TileTimes const tile_times = draw_tile (clip, [&] (auto const& draw) {
+      for (TileBins const& run : bins)
+        draw (run.begin (tile), run.end (tile));
+    }, times != nullptr);
+    if (times) {
+      drawing += tile_times.draw;
+      shading += tile_times.shade;
+    }
+
+    int const row = tile / grid.columns;
+    if (--left[row] == 0)
+      strip_done (canvas, row, clip.y0, clip.y1);
+  });
+
+  if (times) {
+    times->bin   += Milliseconds (binned - start).count ();
+    times->tiles += Milliseconds (Clock::now () - binned).count ();
+    times->draw  += drawing * 1e-6;
+    times->shade += shading * 1e-6;
+  }
+  return canvas;
+}
@@ -0,0 +1,132 @@
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "fixed.hpp"
+#include "pixel.hpp"
+#include "vector.hpp"
+
+// in-memory representation of scene described by script
+struct Vertex {
+  P2fx   position;
+  P2i32  uv;
+  Pixelf colour = Pixelf (1, 1, 1);
+  float  depth  = 0; // smaller is nearer; used when the scene tests depth
+  float  rhw    = 1; // 1/w after projection; used when the scene has perspective
+};
+
+struct Triangle {
+  Vertex verts[3];
+  Triangle (Vertex a, Vertex b, Vertex c) : verts{a,b,c} { }
+};
+
+// how a scene's triangles are shaded
+enum class Shading {
+  colour,  // interpolated vertex colours
+  texture  // texture lookup at interpolated uvs
+};
+
+// the arrays the rasterizer draws from. vertex attributes are kept in
+// separate arrays, so they can point straight into a mapped scene file
+// as well as into a Script. with indices, triangles are three indices
+// each into the arrays, so shared vertices are kept once; without, the
+// arrays hold three entries per triangle
+struct SceneView {
+  int width = 0, height = 0;
+  Shading shading = Shading::colour;
+  size_t count = 0;    // triangles
+  size_t vertices = 0; // entries in each vertex array
+
+  P2fx     const* positions = nullptr;
+  P2i32    const* uvs       = nullptr;
+  Pixelf   const* colours   = nullptr;
+  float    const* depths    = nullptr; // null unless the scene tests depth
+  float    const* rhws      = nullptr; // null unless attributes are interpolated with perspective
+  uint32_t const* indices   = nullptr; // null unless the scene is indexed
+
+  // where corner k of a triangle is in the vertex arrays
+  size_t corner (size_t triangle, int k) const {
+    size_t const i = triangle*3 + k;
+    return indices? indices[i] : i;
+  }
+
+  // a vertex array's entries for the corners of a triangle
+  template<typename T>
+  std::array<T, 3> corners (T const* array, size_t triangle) const {
+    return {{ array[corner (triangle, 0)], array[corner (triangle, 1)], array[corner (triangle, 2)] }};
+  }
+
+  Vertex vertex (size_t triangle, int k) const {
+    size_t const i = corner (triangle, k);
+    return Vertex { positions[i], uvs[i], colours[i], depths? depths[i] : 0, rhws? rhws[i] : 1 };
+  }
+
+  Triangle triangle (size_t i) const {
+    return Triangle { vertex (i, 0), vertex (i, 1), vertex (i, 2) };
+  }
+};
+
+// a scene held in memory, indexed: each vertex stored once, and
+// triangles as indices into them
+struct Script {
+  int width = 0, height = 0;
+  Shading shading = Shading::colour;
+  bool depth_test = false;
+  bool perspective = false;
+
+  std::vector<P2fx>     positions;
+  std::vector<P2i32>    uvs;
+  std::vector<Pixelf>   colours;
+  std::vector<float>    depths;
+  std::vector<float>    rhws;
+  std::vector<uint32_t> indices;
+
+  size_t size () const {
+    return indices.size () / 3;
+  }
+
+  size_t vertex_count () const {
+    return positions.size ();
+  }
+
+  uint32_t vertex (Vertex const& v) {
+    positions.push_back (v.position);
+    uvs.push_back (v.uv);
+    colours.push_back (v.colour);
+    depths.push_back (v.depth);
+    rhws.push_back (v.rhw);
+    return uint32_t (positions.size () - 1);
+  }
+
+  void triangle (uint32_t a, uint32_t b, uint32_t c) {
+    indices.insert (indices.end (), { a, b, c });
+  }
+
+  // a triangle with vertices of its own
+  void add (Triangle const& tri) {
+    uint32_t const a = vertex (tri.verts[0]);
+    uint32_t const b = vertex (tri.verts[1]);
+    uint32_t const c = vertex (tri.verts[2]);
+    triangle (a, b, c);
+  }
+
+  SceneView view () const {
+    SceneView view;
+    view.width     = width;
+    view.height    = height;
+    view.shading   = shading;
+    view.count     = size ();
+    view.vertices  = vertex_count ();
+    view.positions = positions.data ();
+    view.uvs       = uvs.data ();
+    view.colours   = colours.data ();
+    view.depths    = depth_test? depths.data () : nullptr;
+    view.rhws      = perspective? rhws.data () : nullptr;
+    view.indices   = indices.data ();
+    return view;
+  }
+};
@@ -0,0 +1,191 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "scene.hpp"
+
+// binary scene format. a fixed header, then the SceneView arrays as they
+// sit in memory, unindexed, each starting on a 64-byte boundary:
+//   positions  3*count P2fx    (i32 x, y in fixed point)
+//   uvs        3*count P2i32
+//   colours    3*count Pixelf  (float r, g, b, a)
+//   depths     3*count float   (only if the scene tests depth)
+//   rhws       3*count float   (only if the scene has perspective)
+// the file is native-endian; the byte order mark rejects foreign files.
+// version 1 files are the same without depths, and version 2 without
+// rhws, each with a header cut short before them
+struct SceneHeader {
+  char     magic[4];
+  uint32_t byte_order;
+  uint32_t version;
+  uint32_t subpixel_bits;
+  int32_t  width, height;
+  uint32_t shading;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t positions, uvs, colours; // byte offsets from start of file
+  uint64_t depths;                  // since version 2; 0 for none
+  uint64_t rhws;                    // since version 3; 0 for none
+};
+
+static constexpr char     scene_magic[4]     = { 'R', 'S', 'C', 'N' };
+static constexpr uint32_t scene_byte_order   = 0x01020304;
+static constexpr uint32_t scene_version      = 3;
+static constexpr size_t   scene_v1_header    = offsetof (SceneHeader, depths);
+static constexpr size_t   scene_v2_header    = offsetof (SceneHeader, rhws);
+static constexpr uint64_t scene_array_align  = 64;
+
+static_assert (sizeof (P2fx)   ==  8, "Scene file layout assumes packed positions");
+static_assert (sizeof (P2i32)  ==  8, "Scene file layout assumes packed uvs");
+static_assert (sizeof (Pixelf) == 16, "Scene file layout assumes packed colours");
+
+static inline uint64_t align_up (uint64_t x, uint64_t a) {
+  return (x + a - 1) / a * a;
+}
+
+// whether a file starts like a binary scene
+static inline bool is_scene_file (char const* path) {
+  char magic[sizeof (scene_magic)] = { };
+  std::ifstream (path, std::ios_base::binary).read (magic, sizeof (magic));
+  return !memcmp (magic, scene_magic, sizeof (magic));
+}
+
+// save a scene in the binary format
+static inline void write_scene (char const* path, SceneView const& scene) {
+  uint64_t const n = scene.count * 3;
+
+  SceneHeader header;
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, scene_magic, sizeof (scene_magic));
+  header.byte_order    = scene_byte_order;
+  header.version       = scene_version;
+  header.subpixel_bits = subpixel_bits;
+  header.width         = scene.width;
+  header.height        = scene.height;
+  header.shading       = uint32_t (scene.shading);
+  header.count         = scene.count;
+  header.positions     = align_up (sizeof (header),                    scene_array_align);
+  header.uvs           = align_up (header.positions + n*sizeof (P2fx), scene_array_align);
+  header.colours       = align_up (header.uvs + n*sizeof (P2i32),      scene_array_align);
+  header.depths        = scene.depths? align_up (header.colours + n*sizeof (Pixelf), scene_array_align) : 0;
+  // rhws follow whichever array came before them
+  uint64_t const last  = header.depths? header.depths + n*sizeof (float) : header.colours + n*sizeof (Pixelf);
+  header.rhws          = scene.rhws? align_up (last, scene_array_align) : 0;
+
+  std::ofstream out (path, std::ios_base::binary);
+  if (!out)
+    throw std::runtime_error (std::string ("Can't create ") + path);
+
+  uint64_t at = 0;
+  auto put = [&] (uint64_t offset, void const* data, uint64_t size) {
+    static char const zeros[scene_array_align] = { };
+    out.write (zeros, std::streamsize (offset - at));
+    out.write (static_cast<char const*> (data), std::streamsize (size));
+    at = offset + size;
+  };
+
+  // files hold three vertices a triangle, so an indexed scene's
+  // vertices are written out once for each corner they're at
+  auto put_array = [&] (uint64_t offset, auto const* array) {
+    using T = std::remove_const_t<std::remove_pointer_t<decltype (array)>>;
+    if (!scene.indices) {
+      put (offset, array, n*sizeof (T));
+      return;
+    }
+    std::vector<T> corners (n);
+    for (size_t i = 0; i != n; i++)
+      corners[i] = array[scene.indices[i]];
+    put (offset, corners.data (), n*sizeof (T));
+  };
+
+  put (0, &header, sizeof (header));
+  put_array (header.positions, scene.positions);
+  put_array (header.uvs,       scene.uvs);
+  put_array (header.colours,   scene.colours);
+  if (scene.depths)
+    put_array (header.depths,  scene.depths);
+  if (scene.rhws)
+    put_array (header.rhws,    scene.rhws);
+
+  if (!out.flush ())
+    throw std::runtime_error (std::string ("Can't write ") + path);
+}
+
+// a binary scene, mapped into memory. the view points straight at the
+// mapping, so nothing is read until the rasterizer touches it
+class SceneFile {
+  MappedFile file;
+  SceneView  scene;
+
+public:
+  explicit SceneFile (char const* path) :
+    file (path, MADV_NORMAL)
+  {
+    auto invalid = [path] (char const* why) {
+      return std::runtime_error (std::string (path) + ": " + why);
+    };
+
+    if (file.size () < scene_v1_header || memcmp (file.data (), scene_magic, sizeof (scene_magic)))
+      throw invalid ("not a scene file");
+
+    SceneHeader header;
+    memset (&header, 0, sizeof (header));
+    memcpy (&header, file.data (), scene_v1_header);
+    if (header.byte_order != scene_byte_order)
+      throw invalid ("scene file has the wrong byte order");
+    if (header.version < 1 || header.version > scene_version)
+      throw invalid ("unsupported scene file version");
+    if (header.version >= 2) {
+      size_t const size = header.version == 2? scene_v2_header : sizeof (SceneHeader);
+      if (file.size () < size)
+        throw invalid ("truncated scene file");
+      memcpy (&header, file.data (), size);
+    }
+    if (header.subpixel_bits != uint32_t (subpixel_bits))
+      throw invalid ("scene file has a different sub-pixel precision");
+    if (header.width <= 0 || header.height <= 0 || header.shading > uint32_t (Shading::texture))
+      throw invalid ("bad scene header");
+
+    // every array must be aligned and lie inside the file
+    uint64_t const n = header.count * 3;
+    auto check = [&] (uint64_t offset, uint64_t element) {
+      if (offset % scene_array_align != 0
+       || header.count > file.size () / (3*element)
+       || offset > file.size () - n*element)
+        throw invalid ("truncated scene file");
+    };
+    check (header.positions, sizeof (P2fx));
+    check (header.uvs,       sizeof (P2i32));
+    check (header.colours,   sizeof (Pixelf));
+    if (header.depths)
+      check (header.depths,  sizeof (float));
+    if (header.rhws)
+      check (header.rhws,    sizeof (float));
+
+    char const* base = file.data ();
+    scene.width     = header.width;
+    scene.height    = header.height;
+    scene.shading   = Shading (header.shading);
+    scene.count     = size_t (header.count);
+    scene.vertices  = scene.count * 3;
+    scene.positions = reinterpret_cast<P2fx   const*> (base + header.positions);
+    scene.uvs       = reinterpret_cast<P2i32  const*> (base + header.uvs);
+    scene.colours   = reinterpret_cast<Pixelf const*> (base + header.colours);
+    scene.depths    = header.depths? reinterpret_cast<float const*> (base + header.depths) : nullptr;
+    scene.rhws      = header.rhws?   reinterpret_cast<float const*> (base + header.rhws)   : nullptr;
+  }
+
+  SceneView const& view () const {
+    return scene;
+  }
+};
+
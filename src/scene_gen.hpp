@@ -0,0 +1,276 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "fixed.hpp"
+
+// scripts generated for benchmarks. each kind of scene stresses one part
+// of the rasterizer, and has about as much in it per pixel whatever the
+// canvas size. the same kind, size and seed always make the same script,
+// on any platform, as the random numbers come from a generator of our own
+enum class SceneKind {
+  small,     // many random triangles a few pixels across
+  quads,     // a few large quads, overlapping deeply
+  slivers,   // long thin triangles, mostly edge
+  strips,    // a grid of strip meshes, sharing vertices
+  offscreen  // a mesh spread far past the canvas, and triangles past the guard band
+};
+
+static constexpr SceneKind scene_kinds[] = {
+  SceneKind::small, SceneKind::quads, SceneKind::slivers, SceneKind::strips, SceneKind::offscreen
+};
+
+static inline char const* scene_kind_name (SceneKind kind) {
+  switch (kind) {
+  case SceneKind::small:     return "small";
+  case SceneKind::quads:     return "quads";
+  case SceneKind::slivers:   return "slivers";
+  case SceneKind::strips:    return "strips";
+  case SceneKind::offscreen: return "offscreen";
+  }
+  return "";
+}
+
+static inline SceneKind scene_kind_named (char const* name) {
+  for (SceneKind kind : scene_kinds) {
+    if (!strcmp (name, scene_kind_name (kind)))
+      return kind;
+  }
+  throw std::runtime_error (std::string ("Unknown scene ") + name);
+}
+
+// splitmix64
+class SceneRandom {
+  uint64_t state;
+
+public:
+  explicit SceneRandom (uint64_t seed) : state (seed) { }
+
+  uint64_t next () {
+    uint64_t z = (state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+  }
+
+  // uniform in [lo, hi)
+  double uniform (double lo, double hi) {
+    return lo + (hi - lo) * double (next () >> 11) * (1.0 / 9007199254740992.0);
+  }
+};
+
+// builds a script a command at a time
+class ScriptWriter {
+  std::string text;
+  char line[160];
+
+  void colour (uint32_t rgba) {
+    snprintf (line, sizeof line, "#%08x", unsigned (rgba));
+    text += line;
+  }
+
+  // coordinates to two places, as a script would have them
+  void point (double x, double y) {
+    snprintf (line, sizeof line, " %.2f %.2f", x, y);
+    text += line;
+  }
+
+public:
+  explicit ScriptWriter (int width, int height) {
+    snprintf (line, sizeof line, "canvas %d %d\n", width, height);
+    text += line;
+  }
+
+  void triangle (uint32_t const (&c)[3], double const (&p)[6]) {
+    text += "triangle";
+    for (int i = 0; i != 3; i++) {
+      text += ' ';
+      colour (c[i]);
+      point (p[2*i], p[2*i + 1]);
+    }
+    text += '\n';
+  }
+
+  void vertex (uint32_t c, double x, double y) {
+    text += "vertex ";
+    colour (c);
+    point (x, y);
+    text += '\n';
+  }
+
+  void strip (uint32_t first, uint32_t count) {
+    text += "strip";
+    for (uint32_t i = 0; i != count; i++) {
+      snprintf (line, sizeof line, " %u", unsigned (first + i));
+      text += line;
+    }
+    text += '\n';
+  }
+
+  std::string done () {
+    return std::move (text);
+  }
+};
+
+// a scene of a kind as script text, on a canvas of width by height
+static inline std::string generate_scene (SceneKind kind, int width, int height, uint64_t seed = 1) {
+  SceneRandom random (seed ^ (uint64_t (kind) << 32));
+  ScriptWriter script (width, height);
+  double const
+    hw = width / 2.0,
+    hh = height / 2.0,
+    area = double (width) * height,
+    tau = 6.283185307179586;
+
+  // opaque, random
+  auto colour = [&random] () {
+    return uint32_t (random.next () >> 40) << 8 | 0xff;
+  };
+
+  // a triangle wound to face the viewer
+  auto facing = [&] (double (&p)[6]) {
+    double const cross = (p[2] - p[0]) * (p[5] - p[1]) - (p[3] - p[1]) * (p[4] - p[0]);
+    if (cross < 0) {
+      std::swap (p[2], p[4]);
+      std::swap (p[3], p[5]);
+    }
+    uint32_t const c[3] = { colour (), colour (), colour () };
+    script.triangle (c, p);
+  };
+
+  switch (kind) {
+  case SceneKind::small: {
+    // one for every 16 pixels, each a few pixels in area
+    long const count = long (area / 16);
+    for (long i = 0; i != count; i++) {
+      double const x = random.uniform (-hw, hw), y = random.uniform (-hh, hh);
+      double p[6];
+      for (int k = 0; k != 3; k++) {
+        p[2*k]     = x + random.uniform (-4, 4);
+        p[2*k + 1] = y + random.uniform (-4, 4);
+      }
+      facing (p);
+    }
+    break;
+  }
+
+  case SceneKind::quads: {
+    // each around a quarter of the canvas, so 32 cover it about eight deep
+    for (int i = 0; i != 32; i++) {
+      double const
+        x = random.uniform (-hw, hw) * 0.5,
+        y = random.uniform (-hh, hh) * 0.5,
+        rx = hw * random.uniform (0.3, 0.7),
+        ry = hh * random.uniform (0.3, 0.7),
+        turn = random.uniform (0, tau),
+        c = std::cos (turn), s = std::sin (turn);
+      double corner[8];
+      double const ex[4] = { -rx, rx, rx, -rx }, ey[4] = { -ry, -ry, ry, ry };
+      for (int k = 0; k != 4; k++) {
+        corner[2*k]     = x + ex[k]*c - ey[k]*s;
+        corner[2*k + 1] = y + ex[k]*s + ey[k]*c;
+      }
+      double a[6] = { corner[0], corner[1], corner[2], corner[3], corner[4], corner[5] };
+      double b[6] = { corner[0], corner[1], corner[4], corner[5], corner[6], corner[7] };
+      facing (a);
+      facing (b);
+    }
+    break;
+  }
+
+  case SceneKind::slivers: {
+    // spanning much of the canvas, and up to two pixels wide
+    long const count = long (area / 1024);
+    double const reach = std::min (hw, hh);
+    for (long i = 0; i != count; i++) {
+      double const
+        x = random.uniform (-hw, hw),
+        y = random.uniform (-hh, hh),
+        turn = random.uniform (0, tau),
+        length = reach * random.uniform (0.2, 1),
+        thick = random.uniform (0.2, 2),
+        c = std::cos (turn), s = std::sin (turn);
+      double p[6] = {
+        x - c*length/2, y - s*length/2,
+        x + c*length/2, y + s*length/2,
+        x - s*thick,    y + c*thick
+      };
+      facing (p);
+    }
+    break;
+  }
+
+  case SceneKind::strips: {
+    // a strip per row of 16 pixel cells, each row's vertices jittered and
+    // shared with the rows either side, so the strips meet
+    int const cell = 16, columns = width / cell, rows = height / cell;
+    std::vector<double> below (columns + 1), above (columns + 1);
+    for (double& y : below)
+      y = random.uniform (-2, 2);
+    uint32_t next = 0;
+    for (int row = 0; row != rows; row++) {
+      double const y0 = -hh + row*cell, y1 = y0 + cell;
+      for (int i = 0; i <= columns; i++) {
+        double const x = -hw + i*cell;
+        above[i] = random.uniform (-2, 2);
+        script.vertex (colour (), x, y1 + above[i]);
+        script.vertex (colour (), x, y0 + below[i]);
+      }
+      script.strip (next, uint32_t (2 * (columns + 1)));
+      next += uint32_t (2 * (columns + 1));
+      below.swap (above);
+    }
+    break;
+  }
+
+  case SceneKind::offscreen: {
+    // a view zoomed well into a large mesh: cells a quarter of the canvas
+    // wide, 16 canvases across, of which the canvas sees a few
+    int const cells = 64;
+    double const cell = std::max (hw, hh) / 2, from = -cells * cell / 2;
+    for (int y = 0; y != cells; y++) {
+      for (int x = 0; x != cells; x++) {
+        double p[6] = {
+          from + x*cell, from + y*cell,
+          from + (x+1)*cell, from + y*cell,
+          from + x*cell, from + (y+1)*cell
+        };
+        facing (p);
+      }
+    }
+
+    // and a fan of triangles reaching past the guard band, as far out as
+    // fixed point goes
+    double const far = double (1 << (30 - subpixel_bits)) * 0.99;
+    for (int i = 0; i != 8; i++) {
+      double p[6] = {
+        0, 0,
+        far * std::cos (tau * i / 8), far * std::sin (tau * i / 8),
+        far * std::cos (tau * (i+1) / 8), far * std::sin (tau * (i+1) / 8)
+      };
+      facing (p);
+    }
+
+    // plus a spray of small triangles all over the mesh, nearly all
+    // rejected by their bounds
+    long const count = long (area / 64);
+    for (long i = 0; i != count; i++) {
+      double const x = random.uniform (from, -from), y = random.uniform (from, -from);
+      double p[6] = { x, y, x + 6, y, x, y + 6 };
+      facing (p);
+    }
+    break;
+  }
+  }
+
+  return script.done ();
+}
@@ -0,0 +1,488 @@
+
+#pragma once
+
+#include <cstdint>
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "fixed.hpp"
+#include "mapped_file.hpp"
+#include "mesh.hpp"
+#include "pixel.hpp"
+#include "scene.hpp"
+#include "stats.hpp"
+#include "vector.hpp"
+#include "vertex_order.hpp"
+
+// tokens - used for lexical analysis
+enum class TokenType {
+  word,
+  number,
+  colour,
+  line_end,
+  end
+};
+
+struct Token {
+  TokenType type;
+  char const* spelling;
+  char const* end;
+  size_t length () const {
+    return end - spelling;
+  }
+};
+
+// paranoid character class checking for lexer
+static inline bool is_letter (char c) {
+  return (c>='a' && c<='z') || (c>='A' && c<='Z');
+}
+
+static inline bool is_digit (char c) {
+  return c>='0' && c<='9';
+}
+
+static inline bool is_hex_digit (char c) {
+  return is_digit (c) || (c>='a' && c<= 'f') || (c>='A' && c<='F');
+}
+
+// for reporting parse errors
+class ParseError : public std::runtime_error {
+public:
+  template<typename Arg>
+  ParseError (Arg&& arg) : std::runtime_error (std::forward<Arg> (arg)) { }
+};
+
+// tokenizes source code on demand. tokens point into the source,
+// so nothing is allocated or copied
+class Lexer {
+  char const* ptr;
+  char const* const end;
+  int line = 1, token_line = 1;
+
+public:
+  Lexer (char const* source, size_t length) :
+    ptr (source),
+    end (source + length)
+  { }
+
+  // line of the last token lexed
+  int line_number () const {
+    return token_line;
+  }
+
+  // the next token, without moving past it
+  Token peek () {
+    char const* const at = ptr;
+    int const at_line = line, at_token_line = token_line;
+    Token const token = next ();
+    ptr = at;
+    line = at_line;
+    token_line = at_token_line;
+    return token;
+  }
+
+  ParseError error (char const* what) const {
+    return ParseError ("line " + std::to_string (token_line) + ": " + what);
+  }
+
+  Token next () {
+    for (;;) {
+      if (ptr == end)
+        return Token { TokenType::end, ptr, ptr };
+
+      char const* begin = ptr;
+      token_line = line;
+
+      // skip whitespace
+      if (*ptr == ' ' || *ptr == '\t') {
+        ptr++;
+        continue;
+      }
+
+      // lex line endings
+      if (*ptr == '\r' || *ptr == '\n') {
+        ptr++;
+
+        // handle crlf
+        if (ptr != end && *begin == '\r' && *ptr == '\n')
+          ptr++;
+
+        line++;
+        return Token { TokenType::line_end, begin, ptr };
+      }
+
+      // skip comments
+      if (*ptr == '\'') {
+        do { ptr++; } while (ptr != end && *ptr != '\r' && *ptr != '\n');
+        continue;
+      }
+
+      // lex words
+      if (is_letter (*ptr)) {
+        do { ptr++; } while (ptr != end && is_letter (*ptr));
+        return Token { TokenType::word, begin, ptr };
+      }
+
+      // lex numbers, with an optional fraction
+      if (is_digit (*ptr) || *ptr == '+' || *ptr == '-') {
+        do { ptr++; } while (ptr != end && is_digit (*ptr));
+        if (ptr != end && *ptr == '.') {
+          do { ptr++; } while (ptr != end && is_digit (*ptr));
+        }
+        return Token { TokenType::number, begin, ptr };
+      }
+
+      // lex colours
+      if (*ptr == '#') {
+        do { ptr++; } while (ptr != end && is_hex_digit (*ptr));
+        if (ptr - begin != 7 && ptr - begin != 9) // one # plus six digits, or eight with alpha
+          throw error ("Invalid colour");
+        return Token { TokenType::colour, begin, ptr };
+      }
+
+      throw error ("Invalid characters in script");
+    }
+  }
+};
+
+// parses the whole part of a number; returns the end of the digits
+static inline char const* parse_digits (char const* ptr, char const* end, i64& value) {
+  value = 0;
+  for (; ptr != end && is_digit (*ptr); ptr++) {
+    value = value*10 + (*ptr - '0');
+    if (value > std::numeric_limits<i32>::max ())
+      throw ParseError ("Number out of range");
+  }
+  return ptr;
+}
+
+// parses an integer, and returns its value
+static inline int parse_number (char const* spelling, char const* end) {
+  bool const negative = *spelling == '-';
+  if (*spelling == '-' || *spelling == '+')
+    spelling++;
+
+  i64 value;
+  if (spelling == end || parse_digits (spelling, end, value) != end)
+    throw ParseError ("Expected an integer");
+  return int (negative? -value : value);
+}
+
+// parses a coordinate, which may have a fraction, straight to fixed point
+static inline i32 parse_coordinate (char const* spelling, char const* end) {
+  bool const negative = *spelling == '-';
+  if (*spelling == '-' || *spelling == '+')
+    spelling++;
+
+  i64 whole;
+  char const* ptr = parse_digits (spelling, end, whole);
+  if (ptr == spelling)
+    throw ParseError ("Expected a coordinate");
+
+  // round the fraction to the sub-pixel grid, ignoring digits
+  // beyond what could make a difference
+  i64 fraction = 0, scale = 1;
+  if (ptr != end) {
+    for (ptr++; ptr != end && scale < 1000000000; ptr++) {
+      fraction = fraction*10 + (*ptr - '0');
+      scale *= 10;
+    }
+  }
+
+  // signed before the range check, which isn't symmetric: the least
+  // coordinate, -2^(31 - subpixel_bits), has no positive counterpart
+  i64 const magnitude = whole * subpixel_one + (fraction * subpixel_one + scale/2) / scale;
+  i64 const value = negative? -magnitude : magnitude;
+  if (value < std::numeric_limits<i32>::min () || value > std::numeric_limits<i32>::max ())
+    throw ParseError ("Coordinate out of range");
+  return i32 (value);
+}
+
+// parses a number with an optional fraction as a float
+static inline float parse_real (char const* spelling, char const* end) {
+  bool const negative = *spelling == '-';
+  if (*spelling == '-' || *spelling == '+')
+    spelling++;
+
+  i64 whole;
+  char const* ptr = parse_digits (spelling, end, whole);
+  if (ptr == spelling)
+    throw ParseError ("Expected a number");
+
+  double value = double (whole), scale = 1;
+  if (ptr != end) {
+    for (ptr++; ptr != end; ptr++)
+      value += (*ptr - '0') * (scale *= 0.1);
+  }
+  return float (negative? -value : value);
+}
+
+static inline int hex_value (char c) {
+  return is_digit (c)? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+// parse a #rrggbb or #rrggbbaa style hex colour, opaque unless given
+static inline Pixelf parse_colour (char const* spelling, char const* end) {
+  assert (end - spelling == 7 || end - spelling == 9);
+
+  Pixelf colour = Pixelf (1, 1, 1);
+  int const channels = int (end - spelling - 1) / 2;
+  for (int i = 0; i != channels; i++) {
+    int bits = hex_value (spelling[1 + 2*i]) * 16 + hex_value (spelling[2 + 2*i]);
+    colour.channels[i] = bits * (1.0f/255);
+  }
+  return colour;
+}
+
+// streams a script's commands to a sink, which receives
+//   sink.canvas (width, height)
+//   sink.depth_test (), once, on the first vertex given a depth
+//   sink.vertices (Vertex const* vertices, size_t count)
+//   sink.triangles (uint32_t const* indices, size_t count)
+// vertices are numbered in the order they're passed on, from 0, and
+// triangles are three of those numbers each; a triangle's vertices are
+// always passed on before it. both come in chunks, so no token list or
+// full triangle list is ever built here.
+// a triangle command passes on three vertices of its own. vertex
+// commands fill a vertex buffer, and triangles, strip and fan commands
+// make triangles from indices into it. a run of those commands is
+// gathered into a mesh and passed on, through a vertex cache, when
+// something else comes: a buffer vertex is passed on when it misses the
+// cache, and triangles reuse the one passed on while it stays there, so
+// the sink's per-vertex work, and what it keeps, is once a miss rather
+// than once a corner. the hits and misses are counted in the thread's
+// stats. with reorder, each run is first reordered for the cache, which
+// changes the order triangles are drawn in
+template<typename Sink>
+class ScriptParser {
+  Lexer lex;
+  Sink& sink;
+  std::vector<Vertex> vertices;  // passed on at the next flush
+  std::vector<uint32_t> indices; // likewise
+  uint32_t passed = 0;           // vertices passed on so far
+  bool depth = false;
+  bool reorder = false;
+  Mesh mesh;
+  VertexCache<uint32_t> cache;   // a buffer vertex's number as passed on
+  std::vector<uint32_t> run;
+
+  static constexpr size_t chunk_size = 4096;
+
+  Token expect (TokenType type, char const* what) {
+    Token token = lex.next ();
+    if (token.type != type)
+      throw lex.error (what);
+    return token;
+  }
+
+  // number conversions don't know the line, so tag their errors here
+  template<typename Convert>
+  auto convert (Token token, Convert convert) -> decltype (convert (token.spelling, token.end)) {
+    try {
+      return convert (token.spelling, token.end);
+    }
+    catch (ParseError const& e) {
+      throw lex.error (e.what ());
+    }
+  }
+
+  // parses a #colour x y [depth] vertex
+  Vertex parse_vertex () {
+    Vertex vertex;
+
+    // colour first
+    Token token = expect (TokenType::colour, "Expected vertex colour");
+    vertex.colour = parse_colour (token.spelling, token.end);
+
+    // then coords
+    for (int i = 0; i != 2; i++) {
+      token = expect (TokenType::number, "Expected vertex coordinate");
+      vertex.position.components[i] = convert (token, parse_coordinate);
+    }
+
+    // then maybe depth, which turns on depth testing
+    if (lex.peek ().type == TokenType::number) {
+      vertex.depth = convert (lex.next (), parse_real);
+      if (!depth)
+        sink.depth_test ();
+      depth = true;
+    }
+
+    return vertex;
+  }
+
+  // queue a vertex to pass on, returning its number
+  uint32_t pass_vertex (Vertex const& vertex) {
+    vertices.push_back (vertex);
+    return passed++;
+  }
+
+  void pass_triangle (uint32_t a, uint32_t b, uint32_t c) {
+    indices.insert (indices.end (), { a, b, c });
+    if (indices.size () >= chunk_size*3 || vertices.size () >= chunk_size)
+      flush ();
+  }
+
+  // parses a triangle command
+  void parse_triangle () {
+    uint32_t const a = pass_vertex (parse_vertex ());
+    uint32_t const b = pass_vertex (parse_vertex ());
+    uint32_t const c = pass_vertex (parse_vertex ());
+    pass_triangle (a, b, c);
+  }
+
+  // parses a vertex command, adding to the vertex buffer
+  void parse_buffer_vertex () {
+    mesh.vertices.push_back (parse_vertex ());
+  }
+
+  // parses the indices of a triangles, strip or fan command
+  void parse_indexed (Topology topology) {
+    run.clear ();
+    while (lex.peek ().type == TokenType::number) {
+      int const index = convert (lex.next (), parse_number);
+      if (index < 0 || size_t (index) >= mesh.vertices.size ())
+        throw lex.error ("Vertex index out of range");
+      run.push_back (uint32_t (index));
+    }
+    if (run.size () < 3 || (topology == Topology::list && run.size () % 3))
+      throw lex.error ("Expected whole triangles of indices");
+    mesh.add (topology, run.data (), run.size ());
+  }
+
+  // passes on the triangles of the indexed commands so far
+  void flush_mesh () {
+    if (mesh.indices.empty ())
+      return;
+    if (reorder)
+      optimize_vertex_order (mesh.indices, mesh.vertices.size ());
+    auto vertex = [this] (uint32_t i) { return pass_vertex (mesh.vertices[i]); };
+    assemble (mesh, cache, vertex, [this] (uint32_t a, uint32_t b, uint32_t c) {
+      pass_triangle (a, b, c);
+    });
+    mesh.indices.clear ();
+  }
+
+  // parses a canvas command
+  void parse_canvas () {
+    Token width_spec = expect (TokenType::number, "Expected width specification in canvas command");
+    Token height_spec = expect (TokenType::number, "Expected height specification in canvas command");
+    sink.canvas (convert (width_spec, parse_number), convert (height_spec, parse_number));
+  }
+
+  void flush () {
+    if (!vertices.empty ())
+      sink.vertices (vertices.data (), vertices.size ());
+    if (!indices.empty ())
+      sink.triangles (indices.data (), indices.size () / 3);
+    vertices.clear ();
+    indices.clear ();
+  }
+
+public:
+  ScriptParser (char const* source, size_t length, Sink& sink, bool reorder = false) :
+    lex (source, length),
+    sink (sink),
+    reorder (reorder)
+  {
+    vertices.reserve (chunk_size + 3);
+    indices.reserve (chunk_size*3);
+  }
+
+  void parse () {
+    for (;;) {
+      Token token = lex.next ();
+
+      // skip blank lines
+      if (token.type == TokenType::line_end)
+        continue;
+      if (token.type == TokenType::end)
+        break;
+
+      // parse commands
+      if (token.type != TokenType::word)
+        throw lex.error ("Expected command");
+
+      auto is = [&token] (char const* word) {
+        return token.length () == strlen (word) && !strncmp (token.spelling, word, token.length ());
+      };
+
+      bool const indexed = is ("vertex") || is ("triangles") || is ("strip") || is ("fan");
+      if (!indexed)
+        flush_mesh ();
+
+      if (is ("triangle"))
+        parse_triangle ();
+      else if (is ("vertex"))
+        parse_buffer_vertex ();
+      else if (is ("triangles"))
+        parse_indexed (Topology::list);
+      else if (is ("strip"))
+        parse_indexed (Topology::strip);
+      else if (is ("fan"))
+        parse_indexed (Topology::fan);
+      else if (is ("canvas"))
+        parse_canvas ();
+      else
+        throw lex.error ("Unknown command");
+
+      // every command ends with a line break
+      token = lex.next ();
+      if (token.type == TokenType::end)
+        break;
+      if (token.type != TokenType::line_end)
+        throw lex.error ("Expected newline after command");
+    }
+
+    flush_mesh ();
+    flush ();
+
+    RasterStats& stats = thread_stats ();
+    stats.vertex_hits   += cache.hits;
+    stats.vertex_misses += cache.misses;
+  }
+};
+
+template<typename Sink>
+void parse_script (char const* source, size_t length, Sink& sink, bool reorder = false) {
+  ScriptParser<Sink> (source, length, sink, reorder).parse ();
+}
+
+// collects a parsed script into a Script object
+struct ScriptBuilder {
+  Script& script;
+
+  void canvas (int w, int h) {
+    script.width = w;
+    script.height = h;
+  }
+
+  void depth_test () {
+    script.depth_test = true;
+  }
+
+  void vertices (Vertex const* vertices, size_t count) {
+    for (size_t i = 0; i != count; i++)
+      script.vertex (vertices[i]);
+  }
+
+  void triangles (uint32_t const* indices, size_t count) {
+    script.indices.insert (script.indices.end (), indices, indices + count*3);
+  }
+};
+
+// load and process a script, reordering its indexed triangles if asked
+static inline Script load_script (char const* path, bool reorder = false) {
+  MappedFile file (path);
+  Script script;
+  ScriptBuilder builder { script };
+  parse_script (file.data (), file.size (), builder, reorder);
+  if (script.width <= 0 || script.height <= 0)
+    throw ParseError ("Script needs a canvas command");
+  return script;
+}
+
@@ -0,0 +1,323 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+#include "buffer_pool.hpp"
+#include "image.hpp"
+#include "pipeline.hpp"
+#include "rasterize.hpp"
+#include "scene.hpp"
+#include "stats.hpp"
+#include "tiles.hpp"
+#include "worker_pool.hpp"
+
+// a render kept from one revision of a scene to the next, for redrawing
+// after small edits. the session holds its canvas, a copy of the scene
+// last drawn and each tile's triangles. a revision is compared with that
+// copy for the triangles removed, added or changed, and only the tiles
+// those land on are drawn again, from scratch and in order, so the
+// canvas always matches a full render of the latest revision
+template<typename Layout = Linear>
+class RenderSession {
+  WorkerPool& pool;
+  BufferPool* buffers;
+  RenderSetup const setup;
+
+  Script    last;  // the scene drawn
+  SceneView scene; // of last
+  std::unique_ptr<Image<Pixelu8, Layout>> canvas;
+  std::unique_ptr<TileGrid>               grid;
+  std::unique_ptr<RenderBuffers<Layout>>  targets;
+  std::vector<std::vector<uint32_t>>      bins; // each tile's triangles, in order
+  std::vector<int> redrawn;
+
+  // whether triangle i of the last scene is triangle j of next
+  bool same_triangle (size_t i, SceneView const& next, size_t j) const {
+    auto same = [&] (auto const* a, auto const* b) {
+      for (int k = 0; k != 3; k++) {
+        if (memcmp (a + scene.corner (i, k), b + next.corner (j, k), sizeof *a))
+          return false;
+      }
+      return true;
+    };
+    return
+      same (scene.positions, next.positions) &&
+      same (scene.uvs, next.uvs) &&
+      same (scene.colours, next.colours) &&
+      (!scene.depths || same (scene.depths, next.depths)) &&
+      (!scene.rhws || same (scene.rhws, next.rhws));
+  }
+
+  // whether next can be drawn over what's drawn, or needs a fresh start
+  bool fits (SceneView const& next) const {
+    return canvas &&
+      next.width == scene.width && next.height == scene.height &&
+      next.shading == scene.shading &&
+      !next.depths == !scene.depths &&
+      !next.rhws == !scene.rhws;
+  }
+
+  // a run of triangles replaced: old [old_begin, old_end) by next's
+  // [new_begin, new_end)
+  struct Edit {
+    size_t old_begin, old_end, new_begin, new_end;
+  };
+
+  // how next differs from the last scene, as edits in order. past what
+  // the two share at the start and at the end, the rest is compared with
+  // myers' diff, for up to max_steps triangles removed and added in all.
+  // past that it's one edit, unless there are as many triangles as there
+  // were, when they're compared a pair at a time as edits in place
+  std::vector<Edit> diff (SceneView const& next) const {
+    static constexpr long max_steps = 64;
+    size_t const old_count = scene.count, new_count = next.count;
+    size_t begin = 0, tail = 0;
+    while (begin != std::min (old_count, new_count) && same_triangle (begin, next, begin))
+      begin++;
+    while (tail != std::min (old_count, new_count) - begin && same_triangle (old_count-1 - tail, next, new_count-1 - tail))
+      tail++;
+    size_t const old_end = old_count - tail, new_end = new_count - tail;
+    long const n = long (old_end - begin), m = long (new_end - begin);
+
+    // after each step, how far along the old triangles each diagonal
+    // k = x - y reaches, x counting old triangles and y new
+    long const steps = std::min (n + m, max_steps), mid = max_steps + 1;
+    std::vector<long> v (2*max_steps + 3, 0);
+    std::vector<std::vector<long>> trace;
+    auto down = [&] (std::vector<long> const& u, long k, long d) {
+      return k == -d || (k != d && u[mid+k-1] < u[mid+k+1]);
+    };
+    for (long d = 0; d <= steps; d++) {
+      trace.push_back (v);
+      for (long k = -d; k <= d; k += 2) {
+        long x = down (v, k, d)? v[mid+k+1] : v[mid+k-1] + 1, y = x - k;
+        while (x < n && y < m && same_triangle (begin + x, next, begin + y)) {
+          x++;
+          y++;
+        }
+        v[mid+k] = x;
+        if (x < n || y < m)
+          continue;
+
+        // back from the end, step by step, for the runs that match,
+        // each as where it starts and its length
+        struct Match {
+          long x, y, size;
+        };
+        std::vector<Match> matches;
+        for (long e = d; e >= 0; e--) {
+          long px = 0, py = 0, sx = 0, sy = 0;
+          if (e) {
+            bool const from_above = down (trace[e], x - y, e);
+            long const pk = from_above? x - y + 1 : x - y - 1;
+            px = trace[e][mid+pk];
+            py = px - pk;
+            sx = from_above? px : px + 1;
+            sy = from_above? py + 1 : py;
+          }
+          if (x != sx)
+            matches.push_back (Match { sx, sy, x - sx });
+          x = px;
+          y = py;
+        }
+
+        // the edits are what's between them
+        std::vector<Edit> edits;
+        long ox = 0, oy = 0;
+        for (auto i = matches.rbegin (); i != matches.rend (); i++) {
+          if (i->x != ox || i->y != oy)
+            edits.push_back (Edit { begin + ox, begin + i->x, begin + oy, begin + i->y });
+          ox = i->x + i->size;
+          oy = i->y + i->size;
+        }
+        if (ox != n || oy != m)
+          edits.push_back (Edit { begin + ox, old_end, begin + oy, new_end });
+        return edits;
+      }
+    }
+
+    if (n != m)
+      return std::vector<Edit> { Edit { begin, old_end, begin, new_end } };
+    std::vector<Edit> edits;
+    for (size_t i = begin; i != old_end; i++) {
+      if (same_triangle (i, next, i))
+        continue;
+      if (!edits.empty () && edits.back ().old_end == i)
+        edits.back ().old_end = edits.back ().new_end = i + 1;
+      else
+        edits.push_back (Edit { i, i + 1, i, i + 1 });
+    }
+    return edits;
+  }
+
+  // make last a copy of next. triangles share vertices, so it's copied
+  // whole rather than edited a run of triangles at a time
+  void keep (SceneView const& next) {
+    auto copy = [&next] (auto& v, auto const* array) {
+      if (array)
+        v.assign (array, array + next.vertices);
+    };
+    copy (last.positions, next.positions);
+    copy (last.uvs,       next.uvs);
+    copy (last.colours,   next.colours);
+    copy (last.depths,    next.depths);
+    copy (last.rhws,      next.rhws);
+    if (next.indices) {
+      last.indices.assign (next.indices, next.indices + next.count*3);
+    }
+    else {
+      last.indices.resize (next.count*3);
+      std::iota (last.indices.begin (), last.indices.end (), uint32_t (0));
+    }
+    scene = last.view ();
+  }
+
+  // start over with an empty scene the size of next, and nothing drawn
+  void reset (SceneView const& next) {
+    last = Script ();
+    last.width       = next.width;
+    last.height      = next.height;
+    last.shading     = next.shading;
+    last.depth_test  = next.depths != nullptr;
+    last.perspective = next.rhws != nullptr;
+    scene = last.view ();
+
+    // each tile is cleared by the worker that draws it
+    canvas.reset ();
+    canvas.reset (new Image<Pixelu8, Layout> (next.width, next.height, Uninitialized (), buffers));
+    grid.reset (new TileGrid (next.width, next.height));
+    targets.reset ();
+    targets.reset (new RenderBuffers<Layout> (next, setup, buffers));
+    bins.assign (grid->count (), std::vector<uint32_t> ());
+  }
+
+public:
+  RenderSession (WorkerPool& pool, RenderSetup const& setup, BufferPool* buffers = nullptr) :
+    pool (pool), buffers (buffers), setup (setup)
+  { }
+
+  RenderSession (RenderSession const&) = delete;
+  RenderSession& operator = (RenderSession const&) = delete;
+
+  // draw a revision of the scene, and return the rect of the canvas that
+  // changed, in whole tiles; empty when nothing did. all of it is drawn
+  // the first time, and whenever the size, shading, depth testing or
+  // perspective change
+  Rect update (SceneView const& next) {
+    redrawn.clear ();
+    bool const fresh = !fits (next);
+    if (fresh)
+      reset (next);
+    std::vector<Edit> const edits = diff (next);
+
+    // bin the triangles added, all edits' together, in parallel runs
+    std::vector<uint32_t> added;
+    for (Edit const& e : edits) {
+      for (size_t i = e.new_begin; i != e.new_end; i++)
+        added.push_back (uint32_t (i));
+    }
+    i32 const margin = targets->margin ();
+    int const runs = pool.size ();
+    std::vector<TileBins> added_bins (runs);
+    pool.run (runs, [&] (int run, int) {
+      uint32_t const
+        from = uint32_t (uint64_t (added.size ()) *  run    / runs),
+        to   = uint32_t (uint64_t (added.size ()) * (run+1) / runs);
+      StageTimer const timer (stage_bin);
+      added_bins[run].fill (*grid, from, to, [&] (uint32_t k, Rect& rect) {
+        return triangle_bounds (*canvas, next, margin, added[k], rect);
+      });
+    });
+
+    // then in each tile's list, drop the triangles removed, renumber the
+    // rest and merge in those added. a tile changes if it loses or gains
+    // any; lists are in order, so tiles with none past the first edit and
+    // none added are left be
+    std::vector<char> dirty (grid->count (), fresh);
+    if (!edits.empty ()) {
+      pool.run (grid->count (), [&] (int tile, int) {
+        std::vector<uint32_t>& bin = bins[tile];
+        auto const first = std::lower_bound (bin.begin (), bin.end (), uint32_t (edits.front ().old_begin));
+        std::vector<uint32_t> gained;
+        for (TileBins const& run : added_bins) {
+          for (uint32_t const* k = run.begin (tile); k != run.end (tile); k++)
+            gained.push_back (added[*k]);
+        }
+        if (first == bin.end () && gained.empty ())
+          return;
+
+        std::vector<uint32_t> kept (bin.begin (), first);
+        size_t e = 0;
+        for (auto i = first; i != bin.end (); i++) {
+          while (e != edits.size () && edits[e].old_end <= *i)
+            e++;
+          if (e != edits.size () && *i >= edits[e].old_begin)
+            dirty[tile] = true;
+          else
+            kept.push_back (e? uint32_t (*i - edits[e-1].old_end + edits[e-1].new_end) : *i);
+        }
+        if (!gained.empty ())
+          dirty[tile] = true;
+        bin.resize (kept.size () + gained.size ());
+        std::merge (kept.begin (), kept.end (), gained.begin (), gained.end (), bin.begin ());
+      });
+    }
+
+    // last becomes next
+    if (!edits.empty ())
+      keep (next);
+
+    Rect changed { 0, 0, 0, 0 };
+    for (int tile = 0; tile != grid->count (); tile++) {
+      if (!dirty[tile])
+        continue;
+      Rect const r = grid->rect (tile);
+      changed = redrawn.empty ()? r : Rect {
+        std::min (changed.x0, r.x0), std::min (changed.y0, r.y0),
+        std::max (changed.x1, r.x1), std::max (changed.y1, r.y1)
+      };
+      redrawn.push_back (tile);
+    }
+
+    TileDrawer<Layout> const draw_tile (*canvas, scene, setup, *targets);
+    pool.run (int (redrawn.size ()), [&] (int i, int) {
+      int const tile = redrawn[i];
+      std::vector<uint32_t> const& bin = bins[tile];
+      draw_tile (grid->rect (tile), [&] (auto const& draw) {
+        draw (bin.data (), bin.data () + bin.size ());
+      });
+    });
+    return changed;
+  }
+
+  Image<Pixelu8, Layout> const& image () const {
+    return *canvas;
+  }
+
+  // tiles drawn by the last update
+  size_t tiles_redrawn () const {
+    return redrawn.size ();
+  }
+
+  // what the last update drew, closer than its rect: for each row of
+  // tiles with any drawn, from the first of them to the last
+  std::vector<Rect> changed_rows () const {
+    std::vector<Rect> rows;
+    int row = -1;
+    for (int tile : redrawn) {
+      Rect const r = grid->rect (tile);
+      if (tile / grid->columns != row)
+        rows.push_back (r);
+      else
+        rows.back ().x1 = r.x1;
+      row = tile / grid->columns;
+    }
+    return rows;
+  }
+};
@@ -0,0 +1,114 @@
+
+#pragma once
+
+#include <cstdint>
+
+#include "vector.hpp"
+
+#if defined (__AVX2__) || defined (__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+// a group of i32 lanes, as wide as the target allows: 8 with AVX2,
+// 4 with SSE4.1, otherwise a single lane. picked at compile time
+#if defined (__AVX2__)
+
+struct I32Lanes {
+  static constexpr int width = 8;
+  __m256i v;
+};
+
+static inline I32Lanes splat (i32 x) {
+  return I32Lanes { _mm256_set1_epi32 (x) };
+}
+
+// { base, base+step, base+2*step, ... }
+static inline I32Lanes ramp (i32 base, i32 step) {
+  __m256i const index = _mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7);
+  return I32Lanes { _mm256_add_epi32 (_mm256_set1_epi32 (base),
+                    _mm256_mullo_epi32 (index, _mm256_set1_epi32 (step))) };
+}
+
+static inline I32Lanes operator + (I32Lanes a, I32Lanes b) {
+  return I32Lanes { _mm256_add_epi32 (a.v, b.v) };
+}
+
+static inline I32Lanes operator | (I32Lanes a, I32Lanes b) {
+  return I32Lanes { _mm256_or_si256 (a.v, b.v) };
+}
+
+// bit i set if lane i is negative
+static inline unsigned sign_mask (I32Lanes a) {
+  return unsigned (_mm256_movemask_ps (_mm256_castsi256_ps (a.v)));
+}
+
+#elif defined (__SSE4_1__)
+
+struct I32Lanes {
+  static constexpr int width = 4;
+  __m128i v;
+};
+
+static inline I32Lanes splat (i32 x) {
+  return I32Lanes { _mm_set1_epi32 (x) };
+}
+
+static inline I32Lanes ramp (i32 base, i32 step) {
+  __m128i const index = _mm_setr_epi32 (0, 1, 2, 3);
+  return I32Lanes { _mm_add_epi32 (_mm_set1_epi32 (base),
+                    _mm_mullo_epi32 (index, _mm_set1_epi32 (step))) };
+}
+
+static inline I32Lanes operator + (I32Lanes a, I32Lanes b) {
+  return I32Lanes { _mm_add_epi32 (a.v, b.v) };
+}
+
+static inline I32Lanes operator | (I32Lanes a, I32Lanes b) {
+  return I32Lanes { _mm_or_si128 (a.v, b.v) };
+}
+
+static inline unsigned sign_mask (I32Lanes a) {
+  return unsigned (_mm_movemask_ps (_mm_castsi128_ps (a.v)));
+}
+
+#else
+
+struct I32Lanes {
+  static constexpr int width = 1;
+  i32 v;
+};
+
+static inline I32Lanes splat (i32 x) {
+  return I32Lanes { x };
+}
+
+static inline I32Lanes ramp (i32 base, i32) {
+  return I32Lanes { base };
+}
+
+// wrapping, as vector lanes do. a row's lane is stepped once past its
+// last pixel, where the value needn't fit
+static inline I32Lanes operator + (I32Lanes a, I32Lanes b) {
+  return I32Lanes { i32 (uint32_t (a.v) + uint32_t (b.v)) };
+}
+
+static inline I32Lanes operator | (I32Lanes a, I32Lanes b) {
+  return I32Lanes { a.v | b.v };
+}
+
+static inline unsigned sign_mask (I32Lanes a) {
+  return a.v < 0? 1u : 0u;
+}
+
+#endif
+
+// mask with the low n lanes set
+static inline unsigned low_lanes (int n) {
+  return n >= 32? ~0u : (1u << n) - 1;
+}
+
+// index of the lowest set bit of a nonzero mask
+static inline int lowest_lane (unsigned mask) {
+  return __builtin_ctz (mask);
+}
+
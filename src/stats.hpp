@@ -0,0 +1,326 @@
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined (__x86_64__) || defined (__i386__)
+#include <x86intrin.h>
+#endif
+
+// rasterizer counters and stage timers. built with RASTER_STATS 0 they
+// compile to nothing, counts and all, for builds that must not pay for
+// them; they're on otherwise
+#ifndef RASTER_STATS
+#define RASTER_STATS 1
+#endif
+
+#if RASTER_STATS
+using StatCount = uint64_t;
+#else
+// a count that's never kept. everything done to one is dropped, so the
+// code making the counts needn't change
+struct StatCount {
+  StatCount& operator ++ () { return *this; }
+  StatCount  operator ++ (int) { return *this; }
+  template<typename T> StatCount& operator += (T) { return *this; }
+  operator uint64_t () const { return 0; }
+};
+#endif
+
+// parts of a render timed on their own, on whichever threads do them
+enum Stage {
+  stage_parse,  // reading the scene
+  stage_bin,    // triangle setup: bounds, culling and binning into tiles
+  stage_draw,   // covering pixels, shading them as they go unless deferred
+  stage_shade,  // the deferred second pass
+  stage_encode, // compressing finished strips
+  stage_write,  // writing them out
+  stage_count
+};
+
+static char const* const stage_names[stage_count] = {
+  "parse", "bin", "draw", "shade", "encode", "write"
+};
+
+// timestamp counter, where there is one
+static inline uint64_t read_cycles () {
+#if defined (__x86_64__) || defined (__i386__)
+  return __rdtsc ();
+#else
+  return 0;
+#endif
+}
+
+// each thread bumps its own copy, and the copies are only summed while
+// the workers are idle
+struct RasterStats {
+  // triangles binned, and of those, the ones turned away or wholly off
+  // the canvas. the rest are drawn once for each tile they land on
+  StatCount triangles_submitted, triangles_culled, triangles_offscreen, triangle_draws;
+
+  // outcome of testing 64x64 and 8x8 blocks against a triangle's edges:
+  // skipped blocks are wholly outside, filled blocks are wholly inside and
+  // shaded without per-pixel tests, tested blocks straddle an edge
+  StatCount coarse_skipped, coarse_filled, coarse_tested;
+  StatCount blocks_skipped, blocks_filled, blocks_tested;
+
+  // with depth testing: blocks skipped as hidden behind what's drawn, by
+  // their depth bounds, and pixels that failed the per-pixel test
+  StatCount coarse_occluded, blocks_occluded, pixels_hidden;
+
+  // pixels tested against edges one by one, in tested blocks, and pixels
+  // shaded; more shaded than the canvas holds means overdraw. shading
+  // deferred, shaded pixels are the ones given a triangle in the
+  // visibility buffer, and pixels_deferred the ones shaded after, once each
+  StatCount pixels_tested, pixels_shaded, pixels_deferred;
+
+  // draws of triangles reaching past the guard band, as clipped fans;
+  // a triangle is drawn once for each tile it lands on
+  StatCount triangles_clipped;
+
+  // indexed vertices the script parser found in its vertex cache, and
+  // those it missed and passed on again
+  StatCount vertex_hits, vertex_misses;
+
+  // time spent in each stage, in nanoseconds and in timestamp cycles
+  StatCount stage_ns[stage_count], stage_cycles[stage_count];
+
+  RasterStats () :
+    triangles_submitted (), triangles_culled (), triangles_offscreen (), triangle_draws (),
+    coarse_skipped (), coarse_filled (), coarse_tested (),
+    blocks_skipped (), blocks_filled (), blocks_tested (),
+    coarse_occluded (), blocks_occluded (), pixels_hidden (),
+    pixels_tested (), pixels_shaded (), pixels_deferred (),
+    triangles_clipped (),
+    vertex_hits (), vertex_misses (),
+    stage_ns (), stage_cycles ()
+  { }
+
+  RasterStats& operator += (RasterStats const& other) {
+    triangles_submitted += other.triangles_submitted;
+    triangles_culled    += other.triangles_culled;
+    triangles_offscreen += other.triangles_offscreen;
+    triangle_draws      += other.triangle_draws;
+    coarse_skipped += other.coarse_skipped;
+    coarse_filled  += other.coarse_filled;
+    coarse_tested  += other.coarse_tested;
+    blocks_skipped += other.blocks_skipped;
+    blocks_filled  += other.blocks_filled;
+    blocks_tested  += other.blocks_tested;
+    coarse_occluded += other.coarse_occluded;
+    blocks_occluded += other.blocks_occluded;
+    pixels_hidden   += other.pixels_hidden;
+    pixels_tested   += other.pixels_tested;
+    pixels_shaded   += other.pixels_shaded;
+    pixels_deferred += other.pixels_deferred;
+    triangles_clipped += other.triangles_clipped;
+    vertex_hits   += other.vertex_hits;
+    vertex_misses += other.vertex_misses;
+    for (int s = 0; s != stage_count; s++) {
+      stage_ns[s]     += other.stage_ns[s];
+      stage_cycles[s] += other.stage_cycles[s];
+    }
+    return *this;
+  }
+};
+
+template<typename OutStream>
+OutStream& operator << (OutStream& stream, RasterStats const& stats) {
+  stream
+    << "triangles:    " << stats.triangles_submitted << " submitted, "
+                        << stats.triangles_culled    << " culled, "
+                        << stats.triangles_offscreen << " off the canvas, "
+                        << stats.triangle_draws      << " tile draws\n"
+    << "64x64 blocks: " << stats.coarse_skipped << " skipped, "
+                        << stats.coarse_filled  << " filled, "
+                        << stats.coarse_tested  << " tested\n"
+    << "8x8 blocks:   " << stats.blocks_skipped << " skipped, "
+                        << stats.blocks_filled  << " filled, "
+                        << stats.blocks_tested  << " tested\n"
+    << "occluded:     " << stats.coarse_occluded << " 64x64 blocks, "
+                        << stats.blocks_occluded << " 8x8 blocks, "
+                        << stats.pixels_hidden   << " pixels\n"
+    << "pixels:       " << stats.pixels_tested   << " tested, "
+                        << stats.pixels_shaded   << " shaded, "
+                        << stats.pixels_deferred << " deferred\n"
+    << "clipped:      " << stats.triangles_clipped << " triangles\n";
+
+  // only scripts with indexed triangles go through the cache
+  if (uint64_t const looked_up = stats.vertex_hits + stats.vertex_misses) {
+    stream << "vertex cache: " << stats.vertex_hits   << " hits, "
+                               << stats.vertex_misses << " misses, "
+                               << 100.0 * double (stats.vertex_hits) / double (looked_up) << "% hit\n";
+  }
+
+  // stage times are summed over threads
+  for (int s = 0; s != stage_count; s++) {
+    if (!stats.stage_ns[s])
+      continue;
+    stream << stage_names[s] << ":" << std::string (13 - strlen (stage_names[s]), ' ')
+           << double (stats.stage_ns[s]) * 1e-6 << " ms, "
+           << double (stats.stage_cycles[s]) * 1e-6 << " Mcycles\n";
+  }
+  return stream;
+}
+
+// a timed stage, for the trace. times are from the trace's start
+struct TraceEvent {
+  Stage stage;
+  int64_t start_ns, end_ns;
+};
+
+// a thread's counters, and its events while a trace is kept
+struct ThreadStats : RasterStats {
+  int index; // in the order threads first counted something
+  std::vector<TraceEvent> events;
+
+  ThreadStats ();
+  ~ThreadStats ();
+};
+
+// keeps track of every thread's counters, so they can be totalled, and
+// of the trace, when one is kept
+class StatsRegistry {
+  std::mutex                 lock;
+  std::vector<ThreadStats*>  live;
+  RasterStats                retired;
+  std::vector<std::pair<int, TraceEvent>> retired_events;
+  int threads = 0;
+  bool tracing = false;
+  std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now ();
+
+public:
+  static StatsRegistry& get () {
+    static StatsRegistry registry;
+    return registry;
+  }
+
+  int add (ThreadStats* stats) {
+    std::lock_guard<std::mutex> guard (lock);
+    live.push_back (stats);
+    return threads++;
+  }
+
+  // folds a finished thread's counts into the total
+  void remove (ThreadStats* stats) {
+    std::lock_guard<std::mutex> guard (lock);
+    retired += *stats;
+    for (TraceEvent const& event : stats->events)
+      retired_events.emplace_back (stats->index, event);
+    live.erase (std::find (live.begin (), live.end (), stats));
+  }
+
+  RasterStats total () {
+    std::lock_guard<std::mutex> guard (lock);
+    RasterStats sum = retired;
+    for (RasterStats const* stats : live)
+      sum += *stats;
+    return sum;
+  }
+
+  // visit (index, stats) for every thread still running
+  template<typename Visit>
+  void each (Visit const& visit) {
+    std::lock_guard<std::mutex> guard (lock);
+    std::vector<ThreadStats*> sorted = live;
+    std::sort (sorted.begin (), sorted.end (), [] (ThreadStats const* a, ThreadStats const* b) { return a->index < b->index; });
+    for (ThreadStats const* stats : sorted)
+      visit (stats->index, static_cast<RasterStats const&> (*stats));
+  }
+
+  // start keeping stage events, timed from now. only while the workers
+  // are idle, as they read the flag unlocked
+  void start_trace () {
+    epoch = std::chrono::steady_clock::now ();
+    tracing = RASTER_STATS;
+  }
+
+  bool traced () const {
+    return tracing;
+  }
+
+  int64_t since_epoch (std::chrono::steady_clock::time_point t) const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds> (t - epoch).count ();
+  }
+
+  // every event so far in chrome's trace event format, a complete event
+  // per stage with a track per thread, for chrome://tracing or Perfetto
+  template<typename OutStream>
+  void write_trace (OutStream& out) {
+    std::lock_guard<std::mutex> guard (lock);
+    std::vector<std::pair<int, TraceEvent>> events = retired_events;
+    for (ThreadStats const* stats : live) {
+      for (TraceEvent const& event : stats->events)
+        events.emplace_back (stats->index, event);
+    }
+
+    out << "{\"traceEvents\":[\n";
+    for (size_t i = 0; i != events.size (); i++) {
+      TraceEvent const& e = events[i].second;
+      out << (i? ",\n" : "")
+          << "{\"name\":\"" << stage_names[e.stage] << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << events[i].first
+          << ",\"ts\":" << double (e.start_ns) * 1e-3 << ",\"dur\":" << double (e.end_ns - e.start_ns) * 1e-3 << "}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  }
+};
+
+inline ThreadStats::ThreadStats () {
+  index = StatsRegistry::get ().add (this);
+}
+
+inline ThreadStats::~ThreadStats () {
+  StatsRegistry::get ().remove (this);
+}
+
+// counters for the calling thread
+static inline ThreadStats& thread_stats () {
+#if RASTER_STATS
+  static thread_local ThreadStats stats;
+#else
+  // nothing's kept in them, so all threads can share
+  static ThreadStats stats;
+#endif
+  return stats;
+}
+
+// times a stage, from construction to destruction, into the calling
+// thread's counters, and into the trace when one is kept
+class StageTimer {
+#if RASTER_STATS
+  Stage stage;
+  uint64_t cycles;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  explicit StageTimer (Stage stage) :
+    stage (stage),
+    cycles (read_cycles ()),
+    start (std::chrono::steady_clock::now ())
+  { }
+
+  ~StageTimer () {
+    auto const end = std::chrono::steady_clock::now ();
+    ThreadStats& stats = thread_stats ();
+    stats.stage_cycles[stage] += read_cycles () - cycles;
+    stats.stage_ns[stage] += std::chrono::duration_cast<std::chrono::nanoseconds> (end - start).count ();
+
+    StatsRegistry& registry = StatsRegistry::get ();
+    if (registry.traced ())
+      stats.events.push_back (TraceEvent { stage, registry.since_epoch (start), registry.since_epoch (end) });
+  }
+#else
+public:
+  explicit StageTimer (Stage) { }
+#endif
+
+  StageTimer (StageTimer const&) = delete;
+  StageTimer& operator = (StageTimer const&) = delete;
+};
@@ -0,0 +1,366 @@
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <type_traits>
+#include <vector>
+
+#include "draw_triangle.hpp"
+#include "fixed.hpp"
+#include "image.hpp"
+#include "pixel.hpp"
+#include "scene_gen.hpp"
+#include "tiles.hpp"
+
+// coverage tests: the lane-parallel edge test in test_row, and block
+// classification, checked pixel by pixel against coverage_mask and
+// against the fill rule worked out from the edge functions in full
+// precision. over random triangles, and over the cases that trip
+// rasterizers up: edges through pixel centres, where the top-left rule
+// decides, edges shared by neighbouring triangles, degenerate and sliver
+// triangles, and vertices far enough out that edge values no longer fit
+// 32 bits, up to the guard band. exits nonzero if anything disagrees
+
+// what's been checked, and what failed
+struct Tally {
+  long triangles = 0, rejected = 0, narrow = 0, wide = 0, pixels = 0;
+  long failures = 0;
+};
+
+static Tally tally;
+
+static void fail (char const* what, P2fx a, P2fx b, P2fx c, int x, int y) {
+  if (tally.failures++ < 20) {
+    std::cerr << what << ": triangle "
+              << "(" << a.x << ", " << a.y << ") "
+              << "(" << b.x << ", " << b.y << ") "
+              << "(" << c.x << ", " << c.y << ") "
+              << "at pixel " << x << ", " << y << "\n";
+  }
+}
+
+// whether pixel x, y of a canvas is covered by the fill rule: every edge
+// function at its centre positive, or zero on a top or left edge
+static bool covers (Image<Pixelu8> const& canvas, P2fx a, P2fx b, P2fx c, int x, int y) {
+  P2fx const p { (x - canvas.width () / 2) * subpixel_one, (canvas.height () / 2 - y) * subpixel_one };
+  auto inside = [&p] (P2fx u, P2fx v) {
+    return wf (u, v, p) + (top_left (u, v)? 0 : -1) >= 0;
+  };
+  return inside (b, c) && inside (c, a) && inside (a, b);
+}
+
+// blocks of a size, aligned in image space, over the bbox r, as
+// draw_edges walks them; visit (x0, y0, x1, y1) relative to r
+template<typename Visit>
+static void each_block (Rect const& r, int size, Visit const& visit) {
+  for (int by = r.y0 & -size; by < r.y1; by += size) {
+    for (int bx = r.x0 & -size; bx < r.x1; bx += size) {
+      visit (std::max (bx, r.x0) - r.x0, std::max (by, r.y0) - r.y0,
+             std::min (bx + size, r.x1) - r.x0, std::min (by + size, r.y1) - r.y0);
+    }
+  }
+}
+
+// the pixels test_row finds covered along row y of the bbox, from x0 to
+// x1, as flags from x0. with narrow edges, each lane group's mask is
+// checked against coverage_mask on the way
+template<typename W>
+static std::vector<char> row_coverage (Edge<W> const (&e)[3], int x0, int x1, int y, P2fx a, P2fx b, P2fx c) {
+  std::vector<char> row (x1 - x0, 0);
+  Planes<0> const planes { };
+  test_row (e, planes, x0, x1, y, [&] (int x, int, Attributes<0>&, unsigned mask, int run) {
+    if (std::is_same<W, i32>::value) {
+      unsigned const reference = coverage_mask (
+        i32 (e[0].at (x, y)), i32 (e[1].at (x, y)), i32 (e[2].at (x, y)),
+        i32 (e[0].dx), i32 (e[1].dx), i32 (e[2].dx), run);
+      if (mask != reference)
+        fail ("lane mask differs from coverage_mask", a, b, c, x, y);
+    }
+    for (int i = 0; i != run; i++)
+      row[x - x0 + i] |= (mask >> i) & 1;
+  });
+  return row;
+}
+
+// check a triangle every way, counting each pixel test_row covers into
+// counts, one per canvas pixel, when given
+static void check (Image<Pixelu8> const& canvas, P2fx a, P2fx b, P2fx c, std::vector<int>* counts = nullptr) {
+  tally.triangles++;
+
+  // triangles turned away must cover nothing
+  Rect r;
+  if (!triangle_rect (canvas, a, b, c, r)) {
+    tally.rejected++;
+    for (int y = r.y0; y < r.y1; y++) {
+      for (int x = r.x0; x < r.x1; x++) {
+        if (covers (canvas, a, b, c, x, y))
+          fail ("rejected triangle covers a pixel", a, b, c, x, y);
+      }
+    }
+    return;
+  }
+
+  P2i32 const origin { r.x0 - canvas.width () / 2, canvas.height () / 2 - r.y0 };
+  Edge<i64> const e[3] = {
+    make_edge (b, c, origin),
+    make_edge (c, a, origin),
+    make_edge (a, b, origin)
+  };
+  bool const fits =
+    fits_i32 (e[0], r.width (), r.height ()) &&
+    fits_i32 (e[1], r.width (), r.height ()) &&
+    fits_i32 (e[2], r.width (), r.height ());
+  Edge<i32> const n[3] = { narrow (e[0]), narrow (e[1]), narrow (e[2]) };
+  (fits? tally.narrow : tally.wide)++;
+
+  // whole blocks must be classified rightly, narrow or wide
+  for (int size : { coarse_block_size, block_size }) {
+    each_block (r, size, [&] (int x0, int y0, int x1, int y1) {
+      Cover const cover = classify (e, x0, y0, x1-x0, y1-y0);
+      if (fits && classify (n, x0, y0, x1-x0, y1-y0) != cover)
+        fail ("narrow and wide blocks classified differently", a, b, c, r.x0+x0, r.y0+y0);
+      for (int y = y0; y != y1; y++) {
+        for (int x = x0; x != x1; x++) {
+          bool const covered = covers (canvas, a, b, c, r.x0+x, r.y0+y);
+          if ((cover == Cover::none && covered) || (cover == Cover::full && !covered))
+            fail ("block misclassified", a, b, c, r.x0+x, r.y0+y);
+        }
+      }
+    });
+  }
+
+  // rows tested whole, and in the 8-pixel spans of tested blocks, must
+  // cover exactly the pixels the fill rule does
+  for (int y = 0; y != r.height (); y++) {
+    auto compare = [&] (std::vector<char> const& row, int x0) {
+      for (size_t i = 0; i != row.size (); i++) {
+        int const x = r.x0 + x0 + int (i);
+        if (bool (row[i]) != covers (canvas, a, b, c, x, r.y0+y))
+          fail ("row coverage differs from the fill rule", a, b, c, x, r.y0+y);
+      }
+    };
+
+    std::vector<char> const whole = fits?
+      row_coverage (n, 0, r.width (), y, a, b, c) :
+      row_coverage (e, 0, r.width (), y, a, b, c);
+    compare (whole, 0);
+    if (fits)
+      compare (row_coverage (e, 0, r.width (), y, a, b, c), 0);
+
+    for (int bx = r.x0 & -block_size; bx < r.x1; bx += block_size) {
+      int const x0 = std::max (bx, r.x0) - r.x0, x1 = std::min (bx + block_size, r.x1) - r.x0;
+      compare (fits? row_coverage (n, x0, x1, y, a, b, c) : row_coverage (e, x0, x1, y, a, b, c), x0);
+    }
+
+    tally.pixels += r.width ();
+    if (counts) {
+      for (int x = 0; x != r.width (); x++)
+        (*counts)[size_t (r.y0+y) * canvas.width () + r.x0+x] += whole[x];
+    }
+  }
+}
+
+// a random coordinate in [lo, hi) sub-pixels
+static i32 coordinate (SceneRandom& random, double lo, double hi) {
+  return i32 (std::floor (random.uniform (lo, hi)));
+}
+
+// triangles with vertices anywhere on and around the canvas, of either
+// winding, at any sub-pixel position or only on pixel centres and half
+// pixels, where edges go through centres and the fill rule decides
+static void random_triangles (Image<Pixelu8> const& canvas, SceneRandom& random, int count) {
+  double const
+    hw = (canvas.width ()  / 2 + 16) * double (subpixel_one),
+    hh = (canvas.height () / 2 + 16) * double (subpixel_one);
+  i32 const half = std::max (subpixel_one / 2, 1);
+  for (int i = 0; i != count; i++) {
+    P2fx v[3];
+    for (P2fx& p : v)
+      p = P2fx { coordinate (random, -hw, hw), coordinate (random, -hh, hh) };
+    if (i % 2) {
+      for (P2fx& p : v)
+        p = P2fx { p.x / half * half, p.y / half * half };
+    }
+    check (canvas, v[0], v[1], v[2]);
+  }
+}
+
+// right triangles and rectangles with every edge through pixel centres,
+// in each orientation, so every edge is decided by the top-left rule
+static void aligned_triangles (Image<Pixelu8> const& canvas) {
+  auto at = [] (int x, int y) { return P2fx { x * subpixel_one, y * subpixel_one }; };
+  int const sizes[] = { 1, 2, 3, 7, 8, 9, 16, 33 };
+  for (int s : sizes) {
+    for (int x : { -20, -3, 0, 5 }) {
+      for (int y : { -17, -1, 0, 6 }) {
+        P2fx const
+          p00 = at (x, y),     p10 = at (x + s, y),
+          p01 = at (x, y + s), p11 = at (x + s, y + s);
+        // a square as two triangles each way, and every corner's
+        // triangle turned both ways round
+        std::vector<int> counts (size_t (canvas.width ()) * canvas.height (), 0);
+        check (canvas, p00, p10, p11, &counts);
+        check (canvas, p00, p11, p01, &counts);
+        for (int i = 0; i != canvas.width () * canvas.height (); i++) {
+          if (counts[i] > 1)
+            fail ("square's halves overlap", p00, p10, p11, i % canvas.width (), i / canvas.width ());
+        }
+        check (canvas, p00, p10, p01);
+        check (canvas, p10, p11, p01);
+        check (canvas, p00, p01, p10);
+        check (canvas, p10, p01, p11);
+        // flat topped and flat bottomed
+        check (canvas, p00, p10, at (x + s/2, y + s));
+        check (canvas, p01, at (x + s/2, y), p11);
+      }
+    }
+  }
+}
+
+// a jittered grid of quads, two triangles each, sharing every edge:
+// no pixel may be covered twice, and none inside the grid missed
+static void shared_edges (Image<Pixelu8> const& canvas, SceneRandom& random) {
+  int const cells = 12;
+  i32 const cell = 5 * subpixel_one + subpixel_one / 3;
+  i32 const from = -cells * cell / 2;
+  std::vector<P2fx> grid ((cells + 1) * (cells + 1));
+  for (int y = 0; y <= cells; y++) {
+    for (int x = 0; x <= cells; x++) {
+      // moved less than would turn any triangle over
+      bool const edge = x == 0 || y == 0 || x == cells || y == cells;
+      i32 const jitter = edge? 0 : cell / 5;
+      grid[y * (cells + 1) + x] = P2fx {
+        from + x*cell + coordinate (random, -jitter, jitter + 1),
+        from + y*cell + coordinate (random, -jitter, jitter + 1)
+      };
+    }
+  }
+
+  std::vector<int> counts (size_t (canvas.width ()) * canvas.height (), 0);
+  for (int y = 0; y != cells; y++) {
+    for (int x = 0; x != cells; x++) {
+      P2fx const
+        a = grid[y * (cells + 1) + x],     b = grid[y * (cells + 1) + x + 1],
+        c = grid[(y+1) * (cells + 1) + x], d = grid[(y+1) * (cells + 1) + x + 1];
+      // split either way, wound to face the viewer
+      if ((x + y) % 2) {
+        check (canvas, a, b, d, &counts);
+        check (canvas, a, d, c, &counts);
+      }
+      else {
+        check (canvas, a, b, c, &counts);
+        check (canvas, b, d, c, &counts);
+      }
+    }
+  }
+
+  // pixels well inside the grid's outline are covered once
+  int const margin = 2;
+  i32 const lo = from / subpixel_one + margin, hi = -from / subpixel_one - margin;
+  for (int py = 0; py != canvas.height (); py++) {
+    for (int px = 0; px != canvas.width (); px++) {
+      int const count = counts[size_t (py) * canvas.width () + px];
+      int const x = px - canvas.width () / 2, y = canvas.height () / 2 - py;
+      bool const interior = x >= lo && x <= hi && y >= lo && y <= hi;
+      if (count > 1 || (interior && count != 1))
+        fail ("shared edge covered twice or not at all", grid[0], grid[cells], grid.back (), px, py);
+    }
+  }
+}
+
+// zero-area triangles, and slivers thinner than a pixel at any angle
+static void thin_triangles (Image<Pixelu8> const& canvas, SceneRandom& random) {
+  double const hw = canvas.width () / 2 * double (subpixel_one), hh = canvas.height () / 2 * double (subpixel_one);
+  for (int i = 0; i != 500; i++) {
+    P2fx const
+      a { coordinate (random, -hw, hw), coordinate (random, -hh, hh) },
+      b { coordinate (random, -hw, hw), coordinate (random, -hh, hh) };
+    // repeated and collinear corners
+    check (canvas, a, a, b);
+    check (canvas, a, b, b);
+    check (canvas, a, b, P2fx { 2*b.x - a.x, 2*b.y - a.y });
+    // a corner just off the middle of ab, either side
+    i32 const off = coordinate (random, 1, subpixel_one);
+    P2fx const mid { (a.x + b.x) / 2 + (i % 2? off : -off), (a.y + b.y) / 2 };
+    check (canvas, a, b, mid);
+    check (canvas, b, a, mid);
+  }
+}
+
+// triangles whose vertices are far off the canvas, out to the edge of
+// the guard band. edge values over the bbox outgrow 32 bits somewhere
+// along the way, so both the narrow and the wide paths are taken
+static void large_triangles (Image<Pixelu8> const& canvas, SceneRandom& random) {
+  for (int i = 0; i != 1000; i++) {
+    // each coordinate of a magnitude from 2^10 sub-pixels to the band
+    auto far = [&random] () {
+      double const magnitude = std::exp2 (random.uniform (10, 29));
+      return coordinate (random, -magnitude, magnitude);
+    };
+    P2fx v[3];
+    for (P2fx& p : v)
+      p = P2fx { far (), far () };
+    // nearly every one has to reach over the canvas to cover any of it,
+    // so put one corner near the middle of it
+    v[i % 3] = P2fx { coordinate (random, -canvas.width () * subpixel_one, canvas.width () * subpixel_one), coordinate (random, -canvas.height () * subpixel_one, canvas.height () * subpixel_one) };
+    check (canvas, v[0], v[1], v[2]);
+  }
+
+  // corners on the guard band itself
+  i32 const g = guard_band;
+  check (canvas, P2fx { -g, -g }, P2fx { g, -g }, P2fx { g, g });
+  check (canvas, P2fx { -g, -g }, P2fx { g, g }, P2fx { -g, g });
+  check (canvas, P2fx { -g, 0 }, P2fx { g, -1 }, P2fx { 0, g });
+  check (canvas, P2fx { g, 1 }, P2fx { -g, 0 }, P2fx { 0, -g });
+  check (canvas, P2fx { -g, subpixel_one }, P2fx { g, -subpixel_one }, P2fx { g, g });
+
+  // near-vertical slivers from one end of the band to the other, a pixel
+  // or so wide: the step over a lane group doesn't fit 32 bits there
+  for (i32 w : { 1, subpixel_one / 2, subpixel_one, 3 * subpixel_one }) {
+    check (canvas, P2fx { 0, -g }, P2fx { w, g }, P2fx { 0, g });
+    check (canvas, P2fx { 0, g }, P2fx { -w, -g }, P2fx { 0, -g });
+  }
+
+  // edges right across the band step 2^30 a pixel, so two steps from a
+  // value that fits can reach one that does too, past 32 bits between
+  for (i32 o : { 0, -subpixel_one, 2 * subpixel_one + 3 }) {
+    for (i32 w : { 1, subpixel_one, 3 * subpixel_one - subpixel_one / 8 }) {
+      check (canvas, P2fx { o, -g }, P2fx { o + w, g }, P2fx { o, g });
+      check (canvas, P2fx { o, g }, P2fx { o + w, -g }, P2fx { o + w, g });
+      check (canvas, P2fx { o, g }, P2fx { o - w, -g }, P2fx { o, -g });
+      check (canvas, P2fx { -g, o }, P2fx { g, o + w }, P2fx { g, o });
+      check (canvas, P2fx { g, o }, P2fx { -g, o + w }, P2fx { -g, o });
+      check (canvas, P2fx { -g, o }, P2fx { g, o - w }, P2fx { -g, o - w });
+    }
+  }
+}
+
+int main () {
+  Image<Pixelu8> small (128, 96);
+  Image<Pixelu8> large (128, 128);
+  SceneRandom random (1);
+
+  random_triangles (small, random, 4000);
+  aligned_triangles (small);
+  shared_edges (small, random);
+  thin_triangles (small, random);
+  large_triangles (large, random);
+
+  std::cout << tally.triangles << " triangles, "
+            << tally.rejected << " rejected, "
+            << tally.narrow << " stepped in 32 bits, "
+            << tally.wide << " in 64, "
+            << tally.pixels << " pixels, "
+            << I32Lanes::width << " lanes\n";
+
+  // the wide cases have to have been reached for the test to count
+  if (tally.narrow == 0 || tally.wide == 0) {
+    std::cerr << "Large triangles didn't reach both edge widths\n";
+    return EXIT_FAILURE;
+  }
+  if (tally.failures) {
+    std::cerr << tally.failures << " failures\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
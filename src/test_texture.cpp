@@ -0,0 +1,140 @@
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+
+#include "fixed.hpp"
+#include "image.hpp"
+#include "pixel.hpp"
+#include "scene_gen.hpp"
+#include "texture.hpp"
+
+// texture level of detail tests: texture_lod over triangles whose uvs
+// are a known scale of their positions, so the answer is the log2 of
+// that scale, from small triangles to ones spanning the whole of 32 bits
+// in both positions and uvs. then PerspectiveLod's per-pixel levels,
+// against texture_lod's where there's no perspective, and against
+// gradients of the perspective mapping taken by finite differences.
+// exits nonzero if anything disagrees
+
+static long checks = 0, failures = 0;
+
+static void expect (char const* what, double lod, double expected) {
+  checks++;
+  if (!(std::abs (lod - expected) < 1e-3)) {
+    if (failures++ < 20)
+      std::cerr << what << ": level of detail " << lod << ", expected " << expected << "\n";
+  }
+}
+
+// a right triangle at o, legs of the given length in sub-pixels, with uvs
+// su and sv texels per sub-pixel along them from t
+static double scaled_lod (P2fx o, double leg, P2i32 t, double su, double sv) {
+  P2fx const a = o, b { i32 (o.x + leg), o.y }, c { o.x, i32 (o.y + leg) };
+  P2i32 const ta = t, tb { i32 (t.x + leg*su), t.y }, tc { t.x, i32 (t.y + leg*sv) };
+  return texture_lod (a, b, c, ta, tb, tc);
+}
+
+// texels per pixel along the more stretched axis
+static double expected_lod (double su, double sv) {
+  return std::log2 (std::max (su, sv) * subpixel_one);
+}
+
+static void small_triangles () {
+  for (double s : { 1.0/64, 1.0/4, 1.0, 3.0, 16.0, 256.0 }) {
+    double const per = s / subpixel_one;
+    expect ("uniform", scaled_lod (P2fx { 0, 0 }, 64 * subpixel_one, P2i32 { 0, 0 }, per, per), expected_lod (per, per));
+    expect ("stretched", scaled_lod (P2fx { -5, 7 }, 64 * subpixel_one, P2i32 { 3, -9 }, per, per / 8), expected_lod (per, per / 8));
+  }
+}
+
+// vertices and uvs at the ends of 32 bits, whose differences overflow
+// 32 bits, and whose products of differences overflow 64
+static void full_range_triangles () {
+  i32 const lo = std::numeric_limits<i32>::min (), hi = std::numeric_limits<i32>::max ();
+  double const span = double (hi) - lo;
+  P2fx const a { lo, lo }, b { hi, lo }, c { lo, hi };
+
+  // a quarter of a texel per sub-pixel
+  double const quarter = double (1 << 30) / span;
+  expect ("full range positions", texture_lod (a, b, c, P2i32 { 0, 0 }, P2i32 { 1 << 30, 0 }, P2i32 { 0, 1 << 30 }), expected_lod (quarter, quarter));
+
+  // and uvs as far apart as positions, a texel per sub-pixel
+  expect ("full range uvs", texture_lod (a, b, c, P2i32 { lo, hi }, P2i32 { hi, hi }, P2i32 { lo, lo }), expected_lod (1, 1));
+
+  // uvs across the whole range on a triangle a few pixels wide
+  P2fx const d { 0, 0 }, e { 4 * subpixel_one, 0 }, f { 0, 4 * subpixel_one };
+  double const wide = span / (4 * subpixel_one);
+  expect ("full range uvs, small triangle", texture_lod (d, e, f, P2i32 { lo, 0 }, P2i32 { hi, 0 }, P2i32 { lo, 0 }), expected_lod (wide, 0));
+}
+
+static void expect_level (char const* what, int level, int expected) {
+  checks++;
+  if (level != expected) {
+    if (failures++ < 20)
+      std::cerr << what << ": level " << level << ", expected " << expected << "\n";
+  }
+}
+
+// without perspective, 1/w is flat, and every pixel picks the level the
+// whole triangle would
+static void affine_levels (Texture const& texture) {
+  for (double s : { 1.0/4, 1.0, 3.0, 16.0, 100.0, 256.0, 5000.0 }) {
+    for (double stretch : { 1.0, 1.0/8 }) {
+      double const su = s / subpixel_one, sv = su * stretch;
+      int const expected = texture.level_for (float (scaled_lod (P2fx { 0, 0 }, 64 * subpixel_one, P2i32 { 0, 0 }, su, sv)));
+      // steps per pixel column and row; rows run down the image
+      PerspectiveLod const lod { { float (s), 0 }, { 0, -float (s * stretch) }, { 0, 0 }, texture.levels () };
+      for (float u : { 0.f, 37.5f, -1000.f })
+        expect_level ("affine", lod.level (u, u, 1), expected);
+    }
+  }
+}
+
+// u/w, v/w and 1/w as planes over the image, as a receding floor has
+// them. the reference divides them at neighbouring points, and picks the
+// level from the differences as Texture::level_for would
+static void perspective_levels (Texture const& texture, SceneRandom& random) {
+  for (int i = 0; i != 2000; i++) {
+    double const
+      q0 = random.uniform (0.05, 2), qx = random.uniform (-1e-3, 1e-3), qy = random.uniform (-3e-3, 3e-3),
+      u0 = random.uniform (-500, 500), ux = random.uniform (-20, 20), uy = random.uniform (-20, 20),
+      v0 = random.uniform (-500, 500), vx = random.uniform (-20, 20), vy = random.uniform (-20, 20);
+    double const x = random.uniform (-200, 200), y = random.uniform (-200, 200);
+    auto q = [&] (double x, double y) { return q0 + qx*x + qy*y; };
+    auto u = [&] (double x, double y) { return (u0 + ux*x + uy*y) / q (x, y); };
+    auto v = [&] (double x, double y) { return (v0 + vx*x + vy*y) / q (x, y); };
+    if (q (x, y) < 0.05)
+      continue;
+
+    double const h = 1e-4;
+    double const
+      dudx = (u (x+h, y) - u (x-h, y)) / (2*h), dvdx = (v (x+h, y) - v (x-h, y)) / (2*h),
+      dudy = (u (x, y+h) - u (x, y-h)) / (2*h), dvdy = (v (x, y+h) - v (x, y-h)) / (2*h);
+    double const lod = 0.5 * std::log2 (std::max (dudx*dudx + dvdx*dvdx, dudy*dudy + dvdy*dvdy));
+    // float rounding can tip a level either way right at a boundary
+    if (std::abs (lod + 0.5 - std::round (lod + 0.5)) < 1e-3)
+      continue;
+
+    PerspectiveLod const lod_at { { float (ux), float (uy) }, { float (vx), float (vy) }, { float (qx), float (qy) }, texture.levels () };
+    expect_level ("perspective", lod_at.level (float (u (x, y)), float (v (x, y)), float (1 / q (x, y))), texture.level_for (float (lod)));
+  }
+}
+
+int main () {
+  small_triangles ();
+  full_range_triangles ();
+
+  Texture const texture (Image<Pixelu8> (1024, 1024));
+  SceneRandom random (1);
+  affine_levels (texture);
+  perspective_levels (texture, random);
+
+  std::cout << checks << " checks\n";
+  if (failures) {
+    std::cerr << failures << " failures\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
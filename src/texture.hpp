@@ -0,0 +1,302 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined (__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "blend.hpp"
+#include "fixed.hpp"
+#include "image.hpp"
+#include "pixel.hpp"
+
+// texels are kept in 32x32 tiles, one 4k page each, in Morton order
+// inside the tile, so a bilinear footprint is nearly always a cache line
+// or two and nearby samples share pages
+using TexelLayout = Tiled<32, true>;
+
+// how texels are combined into a sample
+enum class Filter {
+  nearest, // the closest texel of the chosen level
+  bilinear // the four closest, weighted by distance
+};
+
+static inline Filter filter_named (char const* name) {
+  if (!strcmp (name, "nearest"))
+    return Filter::nearest;
+  if (!strcmp (name, "bilinear"))
+    return Filter::bilinear;
+  throw std::runtime_error (std::string ("Unknown filter ") + name);
+}
+
+// a mip-mapped texture. texture coordinates are in level 0 texels, with
+// texel centres on whole numbers and v pointing up, and wrap around.
+// sizes must be powers of two
+class Texture {
+  std::vector<Image<Pixelu8, TexelLayout>> chain;
+
+  static bool power_of_two (int x) {
+    return x > 0 && (x & (x - 1)) == 0;
+  }
+
+public:
+  // build the mip chain from an image, top row first. premultiplied
+  // texels are filtered without colour bleeding from transparent ones
+  explicit Texture (Image<Pixelu8> const& image, bool premultiply = false) {
+    int w = image.width (), h = image.height ();
+    if (!power_of_two (w) || !power_of_two (h))
+      throw std::runtime_error ("Texture sizes must be powers of two");
+
+    // level 0 is stored bottom row first, so rows count up with v
+    chain.emplace_back (w, h, Uninitialized ());
+    Image<Pixelu8, TexelLayout>& base = chain.back ();
+    for (int y = 0; y != h; y++) {
+      Pixelu8 const* row = image.row (h-1-y);
+      for (int x = 0; x != w; x++) {
+        Pixelu8 p = row[x];
+        // rounded as blending premultiplies, so the two agree
+        if (premultiply) {
+          for (int i = 0; i != 3; i++)
+            p.channels[i] = uint8_t (mul255 (p.channels[i], p.a));
+        }
+        base.at (x, y) = p;
+      }
+    }
+
+    // each level averages 2x2 texels of the one before
+    while (w > 1 || h > 1) {
+      Image<Pixelu8, TexelLayout> const& prev = chain.back ();
+      int const pw = w, ph = h;
+      w = std::max (1, w / 2);
+      h = std::max (1, h / 2);
+
+      Image<Pixelu8, TexelLayout> next (w, h, Uninitialized ());
+      for (int y = 0; y != h; y++) {
+        int const y0 = std::min (2*y, ph-1), y1 = std::min (2*y+1, ph-1);
+        for (int x = 0; x != w; x++) {
+          int const x0 = std::min (2*x, pw-1), x1 = std::min (2*x+1, pw-1);
+          Pixelu8 const a = prev.at (x0, y0), b = prev.at (x1, y0), c = prev.at (x0, y1), d = prev.at (x1, y1);
+          Pixelu8& out = next.at (x, y);
+          for (int i = 0; i != 4; i++)
+            out.channels[i] = uint8_t ((a.channels[i] + b.channels[i] + c.channels[i] + d.channels[i] + 2) / 4);
+        }
+      }
+      chain.push_back (std::move (next));
+    }
+  }
+
+  int levels () const {
+    return int (chain.size ());
+  }
+
+  Image<Pixelu8, TexelLayout> const& level (int i) const {
+    return chain[i];
+  }
+
+  // the level to sample for a level of detail, rounded to the nearest.
+  // magnified textures use level 0
+  int level_for (float lod) const {
+    if (!(lod > 0.5f))
+      return 0;
+    return std::min (levels () - 1, int (lod + 0.5f));
+  }
+};
+
+// level of detail of a texture mapped linearly onto a triangle: log2 of
+// how many texels a pixel step covers, along the more stretched axis.
+// the mapping is affine, so every quad of pixels gives the same answer.
+// with perspective it isn't; see PerspectiveLod
+static inline float texture_lod (P2fx a, P2fx b, P2fx c, P2i32 ta, P2i32 tb, P2i32 tc) {
+  // in doubles: vertices and uvs may be anywhere in 32 bits, so their
+  // differences needn't fit, nor products of those in 64
+  double const
+    bx = double (b.x) - a.x, by = double (b.y) - a.y,
+    cx = double (c.x) - a.x, cy = double (c.y) - a.y,
+    area = bx*cy - by*cx;
+  if (area == 0)
+    return 0;
+
+  // gradients of u and v in texels per pixel
+  double const
+    k  = subpixel_one / area,
+    du_b = double (tb.x) - ta.x, du_c = double (tc.x) - ta.x,
+    dv_b = double (tb.y) - ta.y, dv_c = double (tc.y) - ta.y,
+    dudx = (du_b*cy - du_c*by) * k,
+    dvdx = (dv_b*cy - dv_c*by) * k,
+    dudy = (du_c*bx - du_b*cx) * k,
+    dvdy = (dv_c*bx - dv_b*cx) * k;
+
+  double const rho2 = std::max (dudx*dudx + dvdx*dvdx, dudy*dudy + dvdy*dvdy);
+  return float (0.5 * std::log2 (std::max (rho2, 1e-20)));
+}
+
+// level of detail of a texture mapped with perspective, which changes
+// from pixel to pixel. u/w, v/w and 1/w are linear over the triangle, and
+// from their steps each pixel's gradients of u and v follow from its own
+// u, v and w: du/dx = (d(u/w)/dx - u d(1/w)/dx) w, and so on
+struct PerspectiveLod {
+  float du[2], dv[2], dq[2]; // steps of u/w, v/w and 1/w per column, per row
+  int levels;
+
+  // the level Texture::level_for would pick at a pixel, read off the
+  // exponent of the gradient squared instead of taking a log at each:
+  // half its log2, rounded, is half the exponent of twice it
+  int level (float u, float v, float w) const {
+    float rho2 = 0;
+    for (int i = 0; i != 2; i++) {
+      float const
+        dudi = (du[i] - u*dq[i]) * w,
+        dvdi = (dv[i] - v*dq[i]) * w;
+      rho2 = std::max (rho2, dudi*dudi + dvdi*dvdi);
+    }
+    if (!(rho2 > 2))
+      return 0;
+    uint32_t bits;
+    memcpy (&bits, &rho2, sizeof (bits));
+    int const exponent = int (bits >> 23) - 126;
+    return std::min (levels - 1, exponent >> 1);
+  }
+};
+
+// samples one level of a texture. set up once per triangle, for the
+// level its level of detail picks, or with perspective for each level
+// the pixels of a group pick. the filter is fixed at compile time, so
+// sampling loops don't test it
+template<Filter F>
+class LevelSampler {
+  Image<Pixelu8, TexelLayout> const* image = nullptr;
+  int   wrap_x = 0, wrap_y = 0; // width and height less one
+  float scale = 1;              // from level 0 texels to this level's
+
+  // level coordinate, for a level 0 coordinate. texel i of level n covers
+  // level 0 texels i * 2^n to (i+1) * 2^n - 1
+  float map (float u) const {
+    return (u + 0.5f) * scale - 0.5f;
+  }
+
+  Pixelu8 texel (int x, int y) const {
+    return image->at (x & wrap_x, y & wrap_y);
+  }
+
+public:
+  // samples nothing, for when there's no texture
+  LevelSampler () = default;
+
+  LevelSampler (Texture const& texture, int level) :
+    image  (&texture.level (level)),
+    wrap_x (image->width () - 1),
+    wrap_y (image->height () - 1),
+    scale  (1.0f / float (1 << level))
+  { }
+
+  Pixelu8 operator () (float u, float v) const {
+    float const x = map (u), y = map (v);
+    if (F == Filter::nearest)
+      return texel (int (std::floor (x + 0.5f)), int (std::floor (y + 0.5f)));
+
+    float const x0 = std::floor (x), y0 = std::floor (y), fx = x - x0, fy = y - y0;
+    int const ix = int (x0), iy = int (y0);
+    Pixelu8 const a = texel (ix, iy), b = texel (ix+1, iy), c = texel (ix, iy+1), d = texel (ix+1, iy+1);
+
+    // the same operations, in the same order, as the lane version
+    Pixelu8 out;
+    for (int i = 0; i != 4; i++) {
+      float const
+        top    = float (a.channels[i]) + (float (b.channels[i]) - float (a.channels[i])) * fx,
+        bottom = float (c.channels[i]) + (float (d.channels[i]) - float (c.channels[i])) * fx;
+      out.channels[i] = uint8_t (int (top + (bottom - top) * fy + 0.5f));
+    }
+    return out;
+  }
+
+  // sample up to eight points at once, those in mask. results for lanes
+  // outside the mask are unspecified
+  void lanes (float const* u, float const* v, unsigned mask, Pixelu8* out) const {
+#if defined (__AVX2__)
+    TexelLayout const& layout = image->pixel_layout ();
+    int const* base = reinterpret_cast<int const*> (image->storage ());
+    static_assert (sizeof (Pixelu8) == sizeof (int), "Texels are gathered as ints");
+
+    __m256i const
+      wx = _mm256_set1_epi32 (wrap_x),
+      wy = _mm256_set1_epi32 (wrap_y),
+      tile_mask = _mm256_set1_epi32 (TexelLayout::mask),
+      across = _mm256_set1_epi32 (layout.across);
+
+    // the Morton offset of texels x, y. tile coordinates are below 32,
+    // so bits only need spreading by four places
+    auto spread = [] (__m256i x) {
+      x = _mm256_and_si256 (_mm256_or_si256 (x, _mm256_slli_epi32 (x, 4)), _mm256_set1_epi32 (0x0f0f0f0f));
+      x = _mm256_and_si256 (_mm256_or_si256 (x, _mm256_slli_epi32 (x, 2)), _mm256_set1_epi32 (0x33333333));
+      x = _mm256_and_si256 (_mm256_or_si256 (x, _mm256_slli_epi32 (x, 1)), _mm256_set1_epi32 (0x55555555));
+      return x;
+    };
+    auto fetch = [&] (__m256i x, __m256i y) {
+      x = _mm256_and_si256 (x, wx);
+      y = _mm256_and_si256 (y, wy);
+      __m256i const tile = _mm256_add_epi32 (
+        _mm256_mullo_epi32 (_mm256_srli_epi32 (y, TexelLayout::shift), across),
+        _mm256_srli_epi32 (x, TexelLayout::shift));
+      __m256i const within = _mm256_or_si256 (
+        spread (_mm256_and_si256 (x, tile_mask)),
+        _mm256_slli_epi32 (spread (_mm256_and_si256 (y, tile_mask)), 1));
+      __m256i const offset = _mm256_or_si256 (_mm256_slli_epi32 (tile, 2*TexelLayout::shift), within);
+      return _mm256_i32gather_epi32 (base, offset, 4);
+    };
+
+    __m256 const
+      half = _mm256_set1_ps (0.5f),
+      s    = _mm256_set1_ps (scale),
+      x    = _mm256_sub_ps (_mm256_mul_ps (_mm256_add_ps (_mm256_loadu_ps (u), half), s), half),
+      y    = _mm256_sub_ps (_mm256_mul_ps (_mm256_add_ps (_mm256_loadu_ps (v), half), s), half);
+
+    __m256i result;
+    if (F == Filter::nearest) {
+      result = fetch (
+        _mm256_cvttps_epi32 (_mm256_floor_ps (_mm256_add_ps (x, half))),
+        _mm256_cvttps_epi32 (_mm256_floor_ps (_mm256_add_ps (y, half))));
+    }
+    else {
+      __m256 const
+        x0 = _mm256_floor_ps (x), fx = _mm256_sub_ps (x, x0),
+        y0 = _mm256_floor_ps (y), fy = _mm256_sub_ps (y, y0);
+      __m256i const
+        ix = _mm256_cvttps_epi32 (x0), ix1 = _mm256_add_epi32 (ix, _mm256_set1_epi32 (1)),
+        iy = _mm256_cvttps_epi32 (y0), iy1 = _mm256_add_epi32 (iy, _mm256_set1_epi32 (1));
+      __m256i const
+        a = fetch (ix, iy), b = fetch (ix1, iy), c = fetch (ix, iy1), d = fetch (ix1, iy1);
+
+      // a channel at a time, as floats
+      __m256i const byte = _mm256_set1_epi32 (0xff);
+      result = _mm256_setzero_si256 ();
+      for (int i = 0; i != 4; i++) {
+        auto channel = [&] (__m256i t) {
+          return _mm256_cvtepi32_ps (_mm256_and_si256 (_mm256_srli_epi32 (t, 8*i), byte));
+        };
+        __m256 const
+          ca = channel (a), cb = channel (b), cc = channel (c), cd = channel (d),
+          top    = _mm256_add_ps (ca, _mm256_mul_ps (_mm256_sub_ps (cb, ca), fx)),
+          bottom = _mm256_add_ps (cc, _mm256_mul_ps (_mm256_sub_ps (cd, cc), fx)),
+          mixed  = _mm256_add_ps (_mm256_add_ps (top, _mm256_mul_ps (_mm256_sub_ps (bottom, top), fy)), half);
+        result = _mm256_or_si256 (result, _mm256_slli_epi32 (_mm256_cvttps_epi32 (mixed), 8*i));
+      }
+    }
+    _mm256_storeu_si256 (reinterpret_cast<__m256i*> (out), result);
+    (void) mask;
+#else
+    for (int i = 0; i != 8; i++) {
+      if (mask & (1u << i))
+        out[i] = (*this) (u[i], v[i]);
+    }
+#endif
+  }
+};
+
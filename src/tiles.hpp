@@ -0,0 +1,101 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "image.hpp"
+
+// side length of a screen tile, in pixels
+static constexpr int tile_size = 64;
+
+// the rasterizer walks triangles in blocks of these sizes. blocks are
+// aligned to the image grid, so screen tiles hold whole blocks
+static constexpr int block_size = 8, coarse_block_size = 64;
+static_assert (tile_size % coarse_block_size == 0, "Tiles must hold whole blocks");
+
+// divides a canvas into a grid of square tiles; edge tiles may be partial
+class TileGrid {
+  int const wide, high;
+
+public:
+  int const columns, rows;
+
+  TileGrid (int w, int h) :
+    wide (w), high (h),
+    columns ((w + tile_size - 1) / tile_size),
+    rows    ((h + tile_size - 1) / tile_size)
+  { }
+
+  int count () const {
+    return columns * rows;
+  }
+
+  Rect rect (int tile) const {
+    int const
+      x = (tile % columns) * tile_size,
+      y = (tile / columns) * tile_size;
+    return Rect { x, y, std::min (x + tile_size, wide), std::min (y + tile_size, high) };
+  }
+};
+
+// per-tile lists of triangle indices, for one contiguous run of triangles.
+// stored as a single array bucketed by tile, so binning allocates once
+class TileBins {
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> items;
+
+public:
+  // bins triangles [begin, end). bounds (i, rect) should produce the pixel
+  // bounds of triangle i and return false if it draws nothing
+  template<typename Bounds>
+  void fill (TileGrid const& grid, uint32_t begin, uint32_t end, Bounds const& bounds) {
+    offsets.assign (grid.count () + 1, 0);
+
+    // count triangles per tile, then prefix-sum the counts into offsets
+    std::vector<Rect> spans;
+    spans.reserve (end - begin);
+    for (uint32_t i = begin; i != end; i++) {
+      Rect r;
+      if (!bounds (i, r) || r.empty ()) {
+        spans.push_back (Rect { 0, 0, 0, 0 });
+        continue;
+      }
+
+      // rect in tiles
+      Rect const t {
+        r.x0 / tile_size, r.y0 / tile_size,
+        (r.x1 - 1) / tile_size + 1, (r.y1 - 1) / tile_size + 1
+      };
+      spans.push_back (t);
+
+      for (int y = t.y0; y != t.y1; y++) {
+        for (int x = t.x0; x != t.x1; x++)
+          offsets[y * grid.columns + x + 1]++;
+      }
+    }
+
+    for (int i = 0; i != grid.count (); i++)
+      offsets[i+1] += offsets[i];
+
+    // scatter indices, preserving submission order within each tile
+    items.resize (offsets.back ());
+    std::vector<uint32_t> cursor (offsets.begin (), offsets.end () - 1);
+    for (uint32_t i = begin; i != end; i++) {
+      Rect const& t = spans[i - begin];
+      for (int y = t.y0; y < t.y1; y++) {
+        for (int x = t.x0; x < t.x1; x++)
+          items[cursor[y * grid.columns + x]++] = i;
+      }
+    }
+  }
+
+  uint32_t const* begin (int tile) const {
+    return items.data () + offsets[tile];
+  }
+
+  uint32_t const* end (int tile) const {
+    return items.data () + offsets[tile+1];
+  }
+};
+
@@ -0,0 +1,366 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined (__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "fixed.hpp"
+#include "pixel.hpp"
+#include "scene.hpp"
+
+// 4x4 matrix taking points, as columns (x, y, z, 1), to clip space: x
+// and y in canvas pixels once divided by w, with y up, and z, divided by
+// w, the depth. 2d affine matrices leave w at 1
+struct Matrix4 {
+  float m[4][4];
+
+  static Matrix4 identity () {
+    return Matrix4 {{
+      { 1, 0, 0, 0 },
+      { 0, 1, 0, 0 },
+      { 0, 0, 1, 0 },
+      { 0, 0, 0, 1 }
+    }};
+  }
+
+  // x' = a x + b y + tx, y' = c x + d y + ty
+  static Matrix4 affine (float a, float b, float c, float d, float tx, float ty) {
+    return Matrix4 {{
+      { a, b, 0, tx },
+      { c, d, 0, ty },
+      { 0, 0, 1, 0  },
+      { 0, 0, 0, 1  }
+    }};
+  }
+
+  static Matrix4 translation (float x, float y, float z) {
+    Matrix4 t = identity ();
+    t.m[0][3] = x;
+    t.m[1][3] = y;
+    t.m[2][3] = z;
+    return t;
+  }
+
+  static Matrix4 scaling (float x, float y, float z) {
+    Matrix4 s = identity ();
+    s.m[0][0] = x;
+    s.m[1][1] = y;
+    s.m[2][2] = z;
+    return s;
+  }
+
+  // rotations by an angle in radians, anticlockwise looking down the
+  // axis towards the origin
+  static Matrix4 rotation (int axis, float angle) {
+    int const i = (axis + 1) % 3, j = (axis + 2) % 3;
+    float const c = std::cos (angle), s = std::sin (angle);
+    Matrix4 r = identity ();
+    r.m[i][i] = c; r.m[i][j] = -s;
+    r.m[j][i] = s; r.m[j][j] = c;
+    return r;
+  }
+
+  // the eye at the origin looking along +z, with focal the distance, in
+  // pixels, to a canvas it sees through. depths run from 0 at the near
+  // plane to 1 at the far one
+  static Matrix4 perspective (float focal, float near, float far) {
+    float const a = far / (far - near);
+    return Matrix4 {{
+      { focal, 0,     0, 0         },
+      { 0,     focal, 0, 0         },
+      { 0,     0,     a, -a * near },
+      { 0,     0,     1, 0         }
+    }};
+  }
+
+  friend Matrix4 operator * (Matrix4 const& a, Matrix4 const& b) {
+    Matrix4 r;
+    for (int i = 0; i != 4; i++) {
+      for (int j = 0; j != 4; j++)
+        r.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] + a.m[i][2]*b.m[2][j] + a.m[i][3]*b.m[3][j];
+    }
+    return r;
+  }
+};
+
+// points as an array per coordinate
+struct Points {
+  float* x;
+  float* y;
+  float* z;
+  float* w;
+};
+
+struct ConstPoints {
+  float const* x;
+  float const* y;
+  float const* z;
+};
+
+// float operations on a register of each width
+#if defined (__SSE2__)
+struct Floats128 {
+  static constexpr size_t width = 4;
+  static __m128 load (float const* p) { return _mm_loadu_ps (p); }
+  static void store (float* p, __m128 v) { _mm_storeu_ps (p, v); }
+  static __m128 splat (float x) { return _mm_set1_ps (x); }
+  static __m128 add (__m128 a, __m128 b) { return _mm_add_ps (a, b); }
+  static __m128 mul (__m128 a, __m128 b) { return _mm_mul_ps (a, b); }
+};
+#endif
+
+#if defined (__AVX__)
+struct Floats256 {
+  static constexpr size_t width = 8;
+  static __m256 load (float const* p) { return _mm256_loadu_ps (p); }
+  static void store (float* p, __m256 v) { _mm256_storeu_ps (p, v); }
+  static __m256 splat (float x) { return _mm256_set1_ps (x); }
+  static __m256 add (__m256 a, __m256 b) { return _mm256_add_ps (a, b); }
+  static __m256 mul (__m256 a, __m256 b) { return _mm256_mul_ps (a, b); }
+};
+#endif
+
+// transform n points to clip space, eight or four at a time. every
+// version does the same float operations in the same order, so they
+// agree exactly
+static inline void transform_points (Matrix4 const& m, ConstPoints in, Points out, size_t n) {
+  size_t i = 0;
+
+  // row r applied to whole registers of points, as r0*x + r1*y + r2*z + r3
+  auto rows = [&] (auto ops) {
+    using Ops = decltype (ops);
+    for (; i + Ops::width <= n; i += Ops::width) {
+      auto const x = Ops::load (in.x + i), y = Ops::load (in.y + i), z = Ops::load (in.z + i);
+      float* const to[4] = { out.x, out.y, out.z, out.w };
+      for (int r = 0; r != 4; r++) {
+        auto v = Ops::mul (Ops::splat (m.m[r][0]), x);
+        v = Ops::add (v, Ops::mul (Ops::splat (m.m[r][1]), y));
+        v = Ops::add (v, Ops::mul (Ops::splat (m.m[r][2]), z));
+        v = Ops::add (v, Ops::splat (m.m[r][3]));
+        Ops::store (to[r] + i, v);
+      }
+    }
+  };
+
+#if defined (__AVX__)
+  rows (Floats256 ());
+#endif
+#if defined (__SSE2__)
+  rows (Floats128 ());
+#endif
+
+  for (; i < n; i++) {
+    float const x = in.x[i], y = in.y[i], z = in.z[i];
+    float* const to[4] = { out.x, out.y, out.z, out.w };
+    for (int r = 0; r != 4; r++)
+      to[r][i] = m.m[r][0]*x + m.m[r][1]*y + m.m[r][2]*z + m.m[r][3];
+  }
+}
+
+// the largest float below 2^31, so sub-pixel positions stay within i32.
+// vertices that far out are clipped to the guard band anyway
+static constexpr float fixed_limit = 2147483520.f;
+
+// a point in front of the eye, with w > 0, divided by w and rounded to
+// the sub-pixel grid, ties to even as the vector conversions do
+static inline void project_point (float x, float y, float z, float w, P2fx& p, float& depth, float& rhw) {
+  rhw = 1 / w;
+  // clamped as maxps and minps do, which take the bound for nan
+  auto fixed = [] (float v) {
+    v *= subpixel_one;
+    v = v > -fixed_limit? v : -fixed_limit;
+    v = v <  fixed_limit? v :  fixed_limit;
+    return i32 (std::nearbyint (v));
+  };
+  p = P2fx { fixed (x * rhw), fixed (y * rhw) };
+  depth = z * rhw;
+}
+
+// project n points in clip space, as project_point does, eight or four at
+// a time. points behind the eye come out as garbage, to be clipped before
+static inline void project_points (Points in, size_t n, P2fx* p, float* depth, float* rhw) {
+  size_t i = 0;
+
+#if defined (__AVX2__)
+  for (; i + 8 <= n; i += 8) {
+    __m256 const
+      r  = _mm256_div_ps (_mm256_set1_ps (1), _mm256_loadu_ps (in.w + i)),
+      lo = _mm256_set1_ps (-fixed_limit), hi = _mm256_set1_ps (fixed_limit), one = _mm256_set1_ps (float (subpixel_one));
+    auto fixed = [&] (__m256 v) {
+      return _mm256_cvtps_epi32 (_mm256_min_ps (_mm256_max_ps (_mm256_mul_ps (v, one), lo), hi));
+    };
+    __m256i const
+      x = fixed (_mm256_mul_ps (_mm256_loadu_ps (in.x + i), r)),
+      y = fixed (_mm256_mul_ps (_mm256_loadu_ps (in.y + i), r));
+    // interleave to x, y pairs; the unpacks work within 128-bit halves
+    __m256i const a = _mm256_unpacklo_epi32 (x, y), b = _mm256_unpackhi_epi32 (x, y);
+    _mm256_storeu_si256 (reinterpret_cast<__m256i*> (p + i),     _mm256_permute2x128_si256 (a, b, 0x20));
+    _mm256_storeu_si256 (reinterpret_cast<__m256i*> (p + i + 4), _mm256_permute2x128_si256 (a, b, 0x31));
+    _mm256_storeu_ps (depth + i, _mm256_mul_ps (_mm256_loadu_ps (in.z + i), r));
+    _mm256_storeu_ps (rhw + i, r);
+  }
+#endif
+#if defined (__SSE2__)
+  for (; i + 4 <= n; i += 4) {
+    __m128 const
+      r  = _mm_div_ps (_mm_set1_ps (1), _mm_loadu_ps (in.w + i)),
+      lo = _mm_set1_ps (-fixed_limit), hi = _mm_set1_ps (fixed_limit), one = _mm_set1_ps (float (subpixel_one));
+    auto fixed = [&] (__m128 v) {
+      return _mm_cvtps_epi32 (_mm_min_ps (_mm_max_ps (_mm_mul_ps (v, one), lo), hi));
+    };
+    __m128i const
+      x = fixed (_mm_mul_ps (_mm_loadu_ps (in.x + i), r)),
+      y = fixed (_mm_mul_ps (_mm_loadu_ps (in.y + i), r));
+    _mm_storeu_si128 (reinterpret_cast<__m128i*> (p + i),     _mm_unpacklo_epi32 (x, y));
+    _mm_storeu_si128 (reinterpret_cast<__m128i*> (p + i + 2), _mm_unpackhi_epi32 (x, y));
+    _mm_storeu_ps (depth + i, _mm_mul_ps (_mm_loadu_ps (in.z + i), r));
+    _mm_storeu_ps (rhw + i, r);
+  }
+#endif
+
+  for (; i < n; i++)
+    project_point (in.x[i], in.y[i], in.z[i], in.w[i], p[i], depth[i], rhw[i]);
+}
+
+// a model in its own space: an array per vertex coordinate, per-vertex
+// attributes, and triangles as indices into them
+struct Model {
+  std::vector<float>    x, y, z;
+  std::vector<P2i32>    uvs;
+  std::vector<Pixelf>   colours;
+  std::vector<uint32_t> indices;
+
+  size_t vertex_count () const {
+    return x.size ();
+  }
+
+  uint32_t vertex (float vx, float vy, float vz, P2i32 uv, Pixelf colour = Pixelf (1, 1, 1)) {
+    x.push_back (vx);
+    y.push_back (vy);
+    z.push_back (vz);
+    uvs.push_back (uv);
+    colours.push_back (colour);
+    return uint32_t (x.size () - 1);
+  }
+
+  void triangle (uint32_t a, uint32_t b, uint32_t c) {
+    indices.insert (indices.end (), { a, b, c });
+  }
+};
+
+// add a model's triangles to a script, seen through m. every vertex is
+// transformed and projected once, in batches, and those of whole
+// triangles are shared in the script. triangles are cut where
+// they cross the near plane, where depth is 0, and parts behind it are
+// dropped. vertices keep 1/w, for attributes to be interpolated with
+// perspective; new vertices on the near plane get theirs interpolated,
+// and their uvs rounded to whole texels
+static inline void project_model (Model const& model, Matrix4 const& m, Script& out) {
+  size_t const n = model.vertex_count ();
+  std::vector<float> clip (4*n);
+  Points const c { clip.data (), clip.data () + n, clip.data () + 2*n, clip.data () + 3*n };
+  transform_points (m, ConstPoints { model.x.data (), model.y.data (), model.z.data () }, c, n);
+
+  std::vector<P2fx>  p (n);
+  std::vector<float> depth (n), rhw (n);
+  project_points (c, n, p.data (), depth.data (), rhw.data ());
+
+  out.depth_test = true;
+  out.perspective = true;
+
+  // the script's copy of model vertex i, added when first used
+  std::vector<uint32_t> added (n, ~uint32_t (0));
+  auto vertex = [&] (uint32_t i) {
+    if (added[i] == ~uint32_t (0)) {
+      Vertex v;
+      v.position = p[i];
+      v.uv       = model.uvs[i];
+      v.colour   = model.colours[i];
+      v.depth    = depth[i];
+      v.rhw      = rhw[i];
+      added[i] = out.vertex (v);
+    }
+    return added[i];
+  };
+
+  // a vertex in clip space with its attributes, for cutting
+  struct Cut {
+    float  x, y, z, w, u, v;
+    Pixelf colour;
+  };
+
+  for (size_t t = 0; t + 3 <= model.indices.size (); t += 3) {
+    uint32_t const* const tri = &model.indices[t];
+    int const in = (c.z[tri[0]] >= 0) + (c.z[tri[1]] >= 0) + (c.z[tri[2]] >= 0);
+    if (in == 3) {
+      uint32_t const a = vertex (tri[0]), b = vertex (tri[1]), c = vertex (tri[2]);
+      out.triangle (a, b, c);
+      continue;
+    }
+    if (in == 0)
+      continue;
+
+    // cut at the near plane, from the inside end of each edge
+    Cut corner[3], kept[4];
+    for (int k = 0; k != 3; k++) {
+      uint32_t const i = tri[k];
+      corner[k] = Cut { c.x[i], c.y[i], c.z[i], c.w[i], float (model.uvs[i].x), float (model.uvs[i].y), model.colours[i] };
+    }
+    auto cut = [] (Cut const& a, Cut const& b) {
+      float const t = a.z / (a.z - b.z);
+      auto lerp = [t] (float p, float q) { return p + (q - p)*t; };
+      Cut r;
+      r.x = lerp (a.x, b.x);
+      r.y = lerp (a.y, b.y);
+      r.z = 0;
+      r.w = lerp (a.w, b.w);
+      r.u = lerp (a.u, b.u);
+      r.v = lerp (a.v, b.v);
+      for (int i = 0; i != 4; i++)
+        r.colour.channels[i] = lerp (a.colour.channels[i], b.colour.channels[i]);
+      return r;
+    };
+    int k = 0;
+    for (int i = 0; i != 3; i++) {
+      Cut const& s = corner[i];
+      Cut const& e = corner[(i+1) % 3];
+      if (s.z >= 0)
+        kept[k++] = s;
+      if ((s.z >= 0) != (e.z >= 0))
+        kept[k++] = s.z >= 0? cut (s, e) : cut (e, s);
+    }
+
+    uint32_t v[4];
+    for (int i = 0; i != k; i++) {
+      Vertex cut_vertex;
+      project_point (kept[i].x, kept[i].y, kept[i].z, kept[i].w, cut_vertex.position, cut_vertex.depth, cut_vertex.rhw);
+      cut_vertex.uv     = P2i32 { i32 (std::lround (kept[i].u)), i32 (std::lround (kept[i].v)) };
+      cut_vertex.colour = kept[i].colour;
+      v[i] = out.vertex (cut_vertex);
+    }
+    for (int i = 1; i + 1 < k; i++)
+      out.triangle (v[0], v[i], v[i+1]);
+  }
+}
+
+// move a script's vertices by a 2d affine matrix, through the same
+// batched transform. scripts are indexed, so that's once a vertex kept,
+// however many triangles share it
+static inline void transform_script (Script& script, Matrix4 const& m) {
+  size_t const n = script.positions.size ();
+  std::vector<float> in (3*n), clip (4*n), depth (n), rhw (n);
+  for (size_t i = 0; i != n; i++) {
+    in[i]   = float (script.positions[i].x) / subpixel_one;
+    in[n+i] = float (script.positions[i].y) / subpixel_one;
+  }
+  Points const c { clip.data (), clip.data () + n, clip.data () + 2*n, clip.data () + 3*n };
+  transform_points (m, ConstPoints { in.data (), in.data () + n, in.data () + 2*n }, c, n);
+  project_points (c, n, script.positions.data (), depth.data (), rhw.data ());
+}
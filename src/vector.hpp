@@ -7,6 +7,7 @@
 #include <cmath>
 
 using i32 = int32_t;
+using i64 = int64_t;
 
 template<typename T>
 class Vector final {
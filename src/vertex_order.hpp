@@ -0,0 +1,137 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// triangle reordering for a post-transform vertex cache, after Tom
+// Forsyth's "Linear-speed vertex cache optimisation". every vertex is
+// scored by how recently it was used and by how few triangles still use
+// it, and each step draws the best scoring triangle among those using
+// vertices in a modelled cache. that favours finishing off vertices
+// before they fall out of it. the model cache is LRU, but the order does
+// nearly as well for a FIFO one of the same size
+
+static constexpr int order_cache_size = 32;
+
+static inline float order_score (int position, uint32_t remaining) {
+  // vertices no triangle needs any more don't count
+  if (remaining == 0)
+    return -1;
+
+  // the last triangle's vertices score a little less than the ones just
+  // before, so a strip doesn't double back on itself
+  float score = 0;
+  if (position >= 0) {
+    if (position < 3)
+      score = 0.75f;
+    else
+      score = std::pow (1 - float (position - 3) / (order_cache_size - 3), 1.5f);
+  }
+
+  // and vertices with few triangles left get a boost, to get rid of them
+  return score + 2 * std::pow (float (remaining), -0.5f);
+}
+
+// reorder a list of triangles, keeping each one's winding. vertex_count
+// is one more than the greatest index
+static inline void optimize_vertex_order (std::vector<uint32_t>& indices, size_t vertex_count) {
+  size_t const triangles = indices.size () / 3;
+
+  // the triangles using each vertex, those not drawn yet first:
+  // uses[first[v] .. first[v] + remaining[v])
+  std::vector<uint32_t> first (vertex_count + 1, 0), remaining (vertex_count, 0);
+  for (size_t i = 0; i != triangles*3; i++)
+    remaining[indices[i]]++;
+  for (size_t v = 0; v != vertex_count; v++)
+    first[v+1] = first[v] + remaining[v];
+  std::vector<uint32_t> uses (triangles*3);
+  {
+    std::vector<uint32_t> fill (first.begin (), first.end () - 1);
+    for (size_t i = 0; i != triangles*3; i++)
+      uses[fill[indices[i]]++] = uint32_t (i / 3);
+  }
+
+  std::vector<int>   position (vertex_count, -1);
+  std::vector<float> score (vertex_count);
+  for (size_t v = 0; v != vertex_count; v++)
+    score[v] = order_score (-1, remaining[v]);
+
+  std::vector<float> triangle_score (triangles, 0);
+  std::vector<bool>  drawn (triangles, false);
+  for (size_t t = 0; t != triangles; t++) {
+    for (int k = 0; k != 3; k++)
+      triangle_score[t] += score[indices[t*3 + k]];
+  }
+
+  // the best triangle to start with
+  int64_t best = -1;
+  for (size_t t = 0; t != triangles; t++) {
+    if (best < 0 || triangle_score[t] > triangle_score[best])
+      best = int64_t (t);
+  }
+
+  std::vector<uint32_t> order, cache, next;
+  order.reserve (triangles*3);
+  cache.reserve (order_cache_size + 3);
+  next.reserve (order_cache_size + 3);
+  size_t scan = 0;
+
+  while (order.size () != triangles*3) {
+    // with nothing in the cache left to draw, take the next triangle
+    // not drawn yet
+    if (best < 0) {
+      while (drawn[scan])
+        scan++;
+      best = int64_t (scan);
+    }
+
+    uint32_t const* const tri = &indices[size_t (best)*3];
+    order.insert (order.end (), tri, tri + 3);
+    drawn[size_t (best)] = true;
+
+    // it's no longer one of its vertices' remaining triangles
+    for (int k = 0; k != 3; k++) {
+      uint32_t const v = tri[k];
+      uint32_t* const live = &uses[first[v]];
+      uint32_t* const end = live + remaining[v];
+      *std::find (live, end, uint32_t (best)) = end[-1];
+      remaining[v]--;
+    }
+
+    // its vertices go to the front of the cache, pushing the others back
+    next.assign (tri, tri + 3);
+    for (uint32_t v : cache) {
+      if (v != tri[0] && v != tri[1] && v != tri[2])
+        next.push_back (v);
+    }
+    cache.swap (next);
+
+    // rescore the vertices in the cache and any just pushed out of it,
+    // and the triangles they're in
+    for (size_t i = 0; i != cache.size (); i++) {
+      uint32_t const v = cache[i];
+      position[v] = i < size_t (order_cache_size)? int (i) : -1;
+      float const now = order_score (position[v], remaining[v]);
+      for (uint32_t u = first[v]; u != first[v] + remaining[v]; u++)
+        triangle_score[uses[u]] += now - score[v];
+      score[v] = now;
+    }
+    if (cache.size () > size_t (order_cache_size))
+      cache.resize (order_cache_size);
+
+    // the best triangle to draw next uses a vertex in the cache
+    best = -1;
+    for (uint32_t v : cache) {
+      for (uint32_t u = first[v]; u != first[v] + remaining[v]; u++) {
+        if (best < 0 || triangle_score[uses[u]] > triangle_score[best])
+          best = int64_t (uses[u]);
+      }
+    }
+  }
+
+  indices.swap (order);
+}
@@ -0,0 +1,134 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "attributes.hpp"
+#include "draw_triangle.hpp"
+#include "image.hpp"
+#include "stats.hpp"
+
+// deferred shading. a first pass draws each triangle's index into a
+// visibility buffer, through the usual coverage and depth tests but with
+// nothing to shade, and a second sweeps the buffer and shades every pixel
+// once, for whichever triangle ended up on top. shading then costs a
+// pixel's worth however deep the overdraw. attributes aren't kept from
+// the first pass; the second works them out again from the triangle
+
+// in the visibility buffer where nothing is drawn
+static constexpr uint32_t no_triangle = ~uint32_t (0);
+
+// the first pass's shader
+struct IdShader {
+  uint32_t id;
+
+  uint32_t operator () (Attributes<0> const&) const {
+    return id;
+  }
+};
+
+// attribute planes of triangle abc with their origin at canvas pixel o,
+// worked out in doubles straight from the vertices rather than from edge
+// setup, so any triangle will do, clipped or not
+template<size_t N>
+Planes<N> triangle_planes (
+  P2fx const a, P2fx const b, P2fx const c,
+  Attributes<N> const& aa, Attributes<N> const& ba, Attributes<N> const& ca,
+  P2i32 const o)
+{
+  double const
+    area = (double (b.x) - a.x) * (double (c.y) - a.y) - (double (b.y) - a.y) * (double (c.x) - a.x),
+    px = double (o.x) * subpixel_one,
+    py = double (o.y) * subpixel_one;
+
+  // a vertex's weight is the edge function of its opposite edge over the
+  // area: its value at o, and steps per image column and row
+  struct Weight {
+    double w, dx, dy;
+  };
+  auto weight = [&] (P2fx e0, P2fx e1) {
+    return Weight {
+      ((double (e1.x) - e0.x) * (py - e0.y) - (double (e1.y) - e0.y) * (px - e0.x)) / area,
+      (double (e0.y) - e1.y) * subpixel_one / area,
+      (double (e0.x) - e1.x) * subpixel_one / area
+    };
+  };
+  Weight const wa = weight (b, c), wb = weight (c, a), wc = weight (a, b);
+
+  Planes<N> p;
+  for (size_t i = 0; i != N; i++) {
+    p.at0[i] = float (aa[i]*wa.w  + ba[i]*wb.w  + ca[i]*wc.w );
+    p.dx[i]  = float (aa[i]*wa.dx + ba[i]*wb.dx + ca[i]*wc.dx);
+    p.dy[i]  = float (aa[i]*wa.dy + ba[i]*wb.dy + ca[i]*wc.dy);
+  }
+  return p;
+}
+
+// what the second pass needs of a triangle: its planes over the rect
+// being shaded, and its shader
+template<size_t N, typename Shader>
+struct Visible {
+  static constexpr size_t size = N;
+
+  uint32_t  id = no_triangle;
+  Planes<N> planes;
+  Shader    shader;
+};
+
+// the second pass, over rect r: shade each pixel with a triangle in ids,
+// a group along a row at a time. setup (id) gives triangle id's Visible,
+// with planes from the top left of r. neighbouring pixels mostly show the
+// same few triangles, so the last few are kept
+template<typename L, typename Setup>
+void shade_visible (Image<Pixelu8, L>& out, Image<uint32_t, L> const& ids, Rect const& r, Setup const& setup) {
+  using V = decltype (setup (uint32_t ()));
+  RasterStats& stats = thread_stats ();
+  V seen[8];
+
+  for (int y = r.y0; y != r.y1; y++) {
+    for (int x = r.x0; x < r.x1; x += group_size) {
+      int const run = std::min (group_size, r.x1 - x);
+      uint32_t id[group_size];
+      unsigned left = 0;
+      for (int i = 0; i != run; i++) {
+        id[i] = ids.at (x+i, y);
+        if (id[i] != no_triangle)
+          left |= 1u << i;
+      }
+      unsigned const covered = left;
+
+      // the lanes showing each triangle in turn
+      Pixelu8 pixels[group_size];
+      while (left) {
+        uint32_t const tri = id[lowest_lane (left)];
+        V& v = seen[tri % 8];
+        if (v.id != tri)
+          v = setup (tri);
+
+        Attributes<V::size> vs[group_size] = { };
+        unsigned mask = 0;
+        for (unsigned m = left; m; m &= m - 1) {
+          int const i = lowest_lane (m);
+          if (id[i] == tri) {
+            vs[i] = v.planes.at (x+i - r.x0, y - r.y0);
+            mask |= 1u << i;
+          }
+        }
+
+        // shaders may fill lanes outside the mask, so each triangle's
+        // are shaded on their own and then picked out
+        Pixelu8 shaded[group_size];
+        shade_group (v.shader, vs, mask, shaded, 0);
+        for (unsigned m = mask; m; m &= m - 1) {
+          int const i = lowest_lane (m);
+          pixels[i] = shaded[i];
+        }
+        left &= ~mask;
+      }
+
+      write_group (out, x, y, pixels, covered, Overwrite ());
+      stats.pixels_deferred += __builtin_popcount (covered);
+    }
+  }
+}
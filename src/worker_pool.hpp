@@ -0,0 +1,161 @@
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// persistent pool of worker threads running batches of indexed tasks.
+// each worker owns a queue of task indices; it takes work from the front
+// of its own queue, and steals from the back of the others' when it runs dry
+class WorkerPool {
+  // padded so neighbouring queues don't share cache lines.
+  // (not alignas, which c++14 new can't honour)
+  struct Queue {
+    std::mutex      lock;
+    std::deque<int> tasks;
+    char            pad[64];
+  };
+
+  std::vector<std::thread>          threads;
+  std::unique_ptr<Queue[]>          queues;
+  int const                         count;
+
+  std::mutex                        lock;
+  std::condition_variable           wake, done;
+  std::function<void (int, int)>    job;
+  unsigned                          generation = 0;
+  int                               busy = 0;
+  bool                              quit = false;
+  std::exception_ptr                failure;
+
+  bool pop (int worker, int& task) {
+    Queue& own = queues[worker];
+    std::lock_guard<std::mutex> guard (own.lock);
+    if (own.tasks.empty ())
+      return false;
+    task = own.tasks.front ();
+    own.tasks.pop_front ();
+    return true;
+  }
+
+  bool steal (int worker, int& task) {
+    for (int i = 1; i != count; i++) {
+      Queue& victim = queues[(worker + i) % count];
+      std::lock_guard<std::mutex> guard (victim.lock);
+      if (victim.tasks.empty ())
+        continue;
+      task = victim.tasks.back ();
+      victim.tasks.pop_back ();
+      return true;
+    }
+    return false;
+  }
+
+  // run tasks until every queue is empty. the first exception thrown by
+  // a task is kept for run to rethrow; the remaining tasks still run
+  void drain (int worker) {
+    int task;
+    while (pop (worker, task) || steal (worker, task)) {
+      try {
+        job (task, worker);
+      }
+      catch (...) {
+        std::lock_guard<std::mutex> guard (lock);
+        if (!failure)
+          failure = std::current_exception ();
+      }
+    }
+  }
+
+  void work (int worker) {
+    unsigned seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> guard (lock);
+        wake.wait (guard, [&] { return quit || generation != seen; });
+        if (quit)
+          return;
+        seen = generation;
+      }
+
+      drain (worker);
+
+      std::lock_guard<std::mutex> guard (lock);
+      if (--busy == 0)
+        done.notify_one ();
+    }
+  }
+
+public:
+  // worker 0 is the calling thread, so a pool of one spawns nothing
+  explicit WorkerPool (int size) :
+    queues (new Queue[std::max (size, 1)]),
+    count (std::max (size, 1))
+  {
+    for (int i = 1; i != count; i++)
+      threads.emplace_back ([this, i] { work (i); });
+  }
+
+  ~WorkerPool () {
+    {
+      std::lock_guard<std::mutex> guard (lock);
+      quit = true;
+    }
+    wake.notify_all ();
+    for (auto& thread : threads)
+      thread.join ();
+  }
+
+  WorkerPool (WorkerPool const&) = delete;
+  WorkerPool& operator = (WorkerPool const&) = delete;
+
+  int size () const {
+    return count;
+  }
+
+  // calls fn (task, worker) for every task in [0, tasks), returning once all
+  // have finished. tasks are dealt out in contiguous runs, so neighbouring
+  // tasks tend to land on the same worker. if any task throws, run throws
+  // the first exception once everything has finished
+  template<typename Fn>
+  void run (int tasks, Fn const& fn) {
+    if (tasks <= 0)
+      return;
+
+    for (int w = 0; w != count; w++) {
+      int const
+        begin = int (int64_t (tasks) *  w    / count),
+        end   = int (int64_t (tasks) * (w+1) / count);
+      for (int t = begin; t != end; t++)
+        queues[w].tasks.push_back (t);
+    }
+
+    job = std::cref (fn);
+    {
+      std::lock_guard<std::mutex> guard (lock);
+      busy = count - 1;
+      generation++;
+    }
+    wake.notify_all ();
+
+    drain (0);
+
+    std::unique_lock<std::mutex> guard (lock);
+    done.wait (guard, [&] { return busy == 0; });
+    job = nullptr;
+
+    if (failure) {
+      std::exception_ptr e = failure;
+      failure = nullptr;
+      std::rethrow_exception (e);
+    }
+  }
+};
+